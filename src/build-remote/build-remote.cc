@@ -5,6 +5,7 @@
 #include <memory>
 #include <tuple>
 #include <iomanip>
+#include <chrono>
 #if __APPLE__
 #include <sys/time.h>
 #endif
@@ -25,12 +26,6 @@ using std::cin;
 static void handleAlarm(int sig) {
 }
 
-std::string escapeUri(std::string uri)
-{
-    std::replace(uri.begin(), uri.end(), '/', '_');
-    return uri;
-}
-
 static string currentLoad;
 
 #ifndef _WIN32
@@ -48,6 +43,32 @@ static bool allSupportedLocally(const std::set<std::string>& requiredFeatures) {
     return true;
 }
 
+/* Return the NAR sizes of the paths in the input closure of a
+   derivation, i.e. of what may have to be copied to a builder. */
+static std::map<Path, uint64_t> getInputClosure(Store & store, const Path & drvPath)
+{
+    try {
+        auto drv = store.sharedDerivationFromPath(drvPath);
+        PathSet inputs = drv->inputSrcs;
+        for (auto & i : drv->inputDrvs) {
+            auto inDrv = store.sharedDerivationFromPath(i.first);
+            for (auto & j : i.second) {
+                auto k = inDrv->outputs.find(j);
+                if (k != inDrv->outputs.end()) inputs.insert(k->second.path);
+            }
+        }
+        PathSet closure;
+        store.computeFSClosure(inputs, closure);
+        std::map<Path, uint64_t> sizes;
+        for (auto & i : store.queryPathInfos(closure))
+            sizes[i.first] = i.second->narSize;
+        return sizes;
+    } catch (Error & e) {
+        debug("cannot determine the inputs of '%s': %s", drvPath, e.msg());
+        return {};
+    }
+}
+
 static int _main(int argc, char * * argv)
 {
     {
@@ -101,6 +122,7 @@ static int _main(int argc, char * * argv)
 
         string drvPath;
         string storeUri;
+        Machine * chosenMachine = nullptr;
 
         while (true) {
 
@@ -119,6 +141,20 @@ static int _main(int argc, char * * argv)
                      || settings.extraPlatforms.get().count(neededSystem) > 0)
                  &&  allSupportedLocally(requiredFeatures);
 
+            auto rightTypeFor = [&](const Machine & m) {
+                return m.enabled && std::find(m.systemTypes.begin(),
+                        m.systemTypes.end(),
+                        neededSystem) != m.systemTypes.end() &&
+                    m.allSupported(requiredFeatures) &&
+                    m.mandatoryMet(requiredFeatures);
+            };
+
+            /* The input closure only matters to choose between
+               machines, so don't compute it if there's no choice. */
+            std::map<Path, uint64_t> inputClosure;
+            if (std::count_if(machines.begin(), machines.end(), rightTypeFor) > 1)
+                inputClosure = getInputClosure(*store, drvPath);
+
             /* Error ignored here, will be caught later */
             mkdir(currentLoad.c_str()
 #ifndef _WIN32
@@ -138,16 +174,15 @@ static int _main(int argc, char * * argv)
 
                 bool rightType = false;
 
+                /* Pick the machine on which we expect the build to
+                   finish first, given its running builds and what we
+                   have measured of its build speed and bandwidth. */
                 Machine * bestMachine = nullptr;
-                unsigned long long bestLoad = 0;
+                double bestTime = 0;
                 for (auto & m : machines) {
                     debug("considering building on remote machine '%s'", m.storeUri);
 
-                    if (m.enabled && std::find(m.systemTypes.begin(),
-                            m.systemTypes.end(),
-                            neededSystem) != m.systemTypes.end() &&
-                        m.allSupported(requiredFeatures) &&
-                        m.mandatoryMet(requiredFeatures)) {
+                    if (rightTypeFor(m)) {
                         rightType = true;
 #ifndef _WIN32
                         AutoCloseFD free;
@@ -168,22 +203,19 @@ static int _main(int argc, char * * argv)
                         if (!free) {
                             continue;
                         }
+                        /* Prefer machines that already have most of
+                           the inputs. */
+                        auto time = estimateBuildTime(currentLoad, m, load, inputClosure);
                         bool best = false;
                         if (!bestSlotLock) {
                             best = true;
-                        } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
+                        } else if (time < bestTime) {
+                            best = true;
+                        } else if (time == bestTime && m.speedFactor > bestMachine->speedFactor) {
                             best = true;
-                        } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
-                            if (m.speedFactor > bestMachine->speedFactor) {
-                                best = true;
-                            } else if (m.speedFactor == bestMachine->speedFactor) {
-                                if (load < bestLoad) {
-                                    best = true;
-                                }
-                            }
                         }
                         if (best) {
-                            bestLoad = load;
+                            bestTime = time;
                             bestSlotLock = std::move(free);
                             bestMachine = &m;
                         }
@@ -227,6 +259,7 @@ static int _main(int argc, char * * argv)
                     sshStore = openStore(bestMachine->storeUri, storeParams);
                     sshStore->connect();
                     storeUri = bestMachine->storeUri;
+                    chosenMachine = bestMachine;
 
                 } catch (std::exception & e) {
 #ifndef _WIN32
@@ -274,25 +307,62 @@ connected:
 
         auto substitute = settings.buildersUseSubstitutes ? Substitute : NoSubstitute;
 
+        uint64_t bytesCopied = 0, bytesAvoided = 0;
+        auto copyStart = std::chrono::steady_clock::now();
+
         {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("copying dependencies to '%s'", storeUri));
+            auto present = sshStore->queryValidPaths(inputs);
+            PathSet absent;
+            for (auto & i : store->queryPathInfos(inputs)) {
+                if (present.count(i.first))
+                    bytesAvoided += i.second->narSize;
+                else {
+                    bytesCopied += i.second->narSize;
+                    absent.insert(i.first);
+                }
+            }
+            try {
+                recordPresentPaths(currentLoad, *chosenMachine, present, absent);
+            } catch (Error & e) {
+                printError("cannot record the paths present on '%s': %s", storeUri, e.msg());
+            }
             copyPaths(store, ref<Store>(sshStore), inputs, NoRepair, NoCheckSigs, substitute);
         }
 
+        printMsg(lvlTalkative, "copied %.1f MiB to '%s', %.1f MiB were already present",
+            bytesCopied / (1024.0 * 1024.0), storeUri, bytesAvoided / (1024.0 * 1024.0));
+
+        auto copyTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - copyStart).count();
+
 #ifndef _WIN32
         uploadLock = -1;
 #else
         uploadLock = INVALID_HANDLE_VALUE;
 #endif
 
-        BasicDerivation drv(readDerivation(store->realStoreDir + "/" + baseNameOf(drvPath)));
+        BasicDerivation drv(*readSharedDerivation(drvPath, store->realStoreDir + "/" + baseNameOf(drvPath)));
         drv.inputSrcs = inputs;
 
+        auto buildStart = std::chrono::steady_clock::now();
+
         auto result = sshStore->buildDerivation(drvPath, drv);
 
         if (!result.success())
             throw Error("build of '%s' on '%s' failed: %s", drvPath, storeUri, result.errorMsg);
 
+        auto buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+
+        try {
+            recordMachineStats(currentLoad, *chosenMachine, buildTime, bytesCopied, copyTime, bytesAvoided);
+            /* The inputs and outputs are now on the machine. */
+            PathSet present = inputs;
+            present.insert(outputs.begin(), outputs.end());
+            recordPresentPaths(currentLoad, *chosenMachine, present, {});
+        } catch (Error & e) {
+            printError("cannot record statistics of '%s': %s", storeUri, e.msg());
+        }
+
         PathSet missing;
         for (auto & path : outputs)
             if (!store->isValidPath(path)) missing.insert(path);
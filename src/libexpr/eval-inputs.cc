@@ -0,0 +1,67 @@
+#include "eval-inputs.hh"
+#include "util.hh"
+#include "hash.hh"
+#include "globals.hh"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+namespace nix {
+
+
+string fingerprintPath(const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) return "missing";
+
+    Path realPath = canonPath(path, true);
+    if (isInDir(realPath, settings.nixStore))
+        return "store:" + realPath;
+
+    if (S_ISDIR(st.st_mode)) {
+        StringSet names;
+        for (auto & i : readDirectory(realPath))
+            names.insert(i.name());
+        return "dir:" + hashString(htSHA256, concatStringsSep("/", names)).to_string();
+    }
+
+    if (S_ISREG(st.st_mode))
+        return "file:" + hashFile(htSHA256, realPath).to_string();
+
+    return fmt("other:%s", realPath);
+}
+
+
+void EvalInputs::addFile(const Path & path)
+{
+    if (files.count(path)) return;
+    files.emplace(path, fingerprintPath(path));
+}
+
+
+void EvalInputs::addEnvVar(const string & name, const string & value)
+{
+    envVars.emplace(name, value);
+}
+
+
+void EvalInputs::markImpure(const string & what)
+{
+    if (impure.empty()) impure = what;
+}
+
+
+bool EvalInputs::isUpToDate() const
+{
+    for (auto & i : envVars)
+        if (getEnv(i.first) != i.second) return false;
+
+    for (auto & i : files)
+        if (fingerprintPath(i.first) != i.second) return false;
+
+    return true;
+}
+
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.hh"
+
+#include <map>
+
+
+namespace nix {
+
+
+/* The inputs that an evaluation depended on, i.e. the files it
+   accessed and the environment variables it read.  This allows the
+   results of an evaluation to be cached until one of its inputs
+   changes.  Paths that resolve into the Nix store are immutable, so
+   for those only the result of resolving symlinks is recorded. */
+struct EvalInputs
+{
+    /* Maps paths to their fingerprint (see fingerprintPath()). */
+    std::map<Path, string> files;
+
+    /* Maps environment variables to their values. */
+    std::map<string, string> envVars;
+
+    /* If not empty, the evaluation used something that cannot be
+       recorded as an input, such as the current time or a download
+       without a hash, so its result must not be cached.  Holds the
+       name of the first such builtin. */
+    string impure;
+
+    /* Record a dependency on the file or directory `path'. */
+    void addFile(const Path & path);
+
+    void addEnvVar(const string & name, const string & value);
+
+    void markImpure(const string & what);
+
+    /* Whether all recorded inputs are unchanged. */
+    bool isUpToDate() const;
+};
+
+
+/* Return a string that changes when the contents of `path' (or the
+   entries of `path', if it is a directory) change. */
+string fingerprintPath(const Path & path);
+
+
+}
@@ -7,6 +7,8 @@
 #include "eval-inline.hh"
 #include "download.hh"
 #include "json.hh"
+#include "primops.hh"
+#include "eval-inputs.hh"
 
 #include <algorithm>
 #include <chrono>
@@ -310,6 +312,7 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     , sOutputHashMode(symbols.create("outputHashMode"))
     , repair(NoRepair)
     , store(store)
+    , regexCache(std::make_shared<RegexCache>(evalSettings.regexCacheSize))
     , baseEnv(allocEnv(128))
     , staticBaseEnv(false, 0)
 {
@@ -359,8 +362,40 @@ EvalState::~EvalState()
 }
 
 
+void EvalState::writeDerivationsAsync()
+{
+    if (!derivationWriter)
+        derivationWriter = std::make_unique<DerivationWriter>(store);
+}
+
+
+Path EvalState::writeDerivation(const Derivation & drv, const string & name)
+{
+    /* In read-only mode nothing is written, and repairs have to
+       happen before the path is used. */
+    if (!derivationWriter || settings.readOnlyMode || repair)
+        return nix::writeDerivation(store, drv, name, repair);
+    return derivationWriter->write(drv, name);
+}
+
+
+void EvalState::flushDerivations()
+{
+    if (derivationWriter) derivationWriter->flush();
+}
+
+
+void EvalState::ensureDerivationWritten(const Path & path)
+{
+    if (derivationWriter && derivationWriter->isPending(path))
+        derivationWriter->flush();
+}
+
+
 Path EvalState::checkSourcePath(const Path & path_)
 {
+    if (inputs) inputs->addFile(path_);
+
     if (!allowedPaths) return path_;
 
     auto i = resolvedPaths.find(path_);
@@ -1847,6 +1882,12 @@ void EvalState::printStats()
         topObj.attr("nrLookups", nrLookups);
         topObj.attr("nrPrimOpCalls", nrPrimOpCalls);
         topObj.attr("nrFunctionCalls", nrFunctionCalls);
+        {
+            auto regex = topObj.object("regex");
+            regex.attr("cacheHits", regexCache->nrHits);
+            regex.attr("cacheMisses", regexCache->nrMisses);
+            regex.attr("time", std::chrono::duration<float>(regexCache->time).count());
+        }
 #if HAVE_BOEHMGC
         {
             auto gc = topObj.object("gc");
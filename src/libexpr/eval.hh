@@ -18,6 +18,10 @@ namespace nix {
 
 class Store;
 class EvalState;
+struct Derivation;
+class DerivationWriter;
+struct EvalInputs;
+struct RegexCache;
 enum RepairFlag : bool;
 
 
@@ -89,9 +93,18 @@ public:
 
     const ref<Store> store;
 
+    /* Cache of compiled regular expressions. */
+    std::shared_ptr<RegexCache> regexCache;
+
+    /* If set, the files and environment variables that evaluation
+       depends on are recorded here. */
+    std::shared_ptr<EvalInputs> inputs;
+
 private:
     SrcToStore srcToStore;
 
+    std::unique_ptr<DerivationWriter> derivationWriter;
+
     /* A cache from path names to parse trees. */
 #if HAVE_BOEHMGC
     typedef std::map<Path, Expr *, std::less<Path>, traceable_allocator<std::pair<const Path, Expr *> > > FileParseCache;
@@ -284,6 +297,21 @@ public:
 
     void realiseContext(const PathSet & context);
 
+    /* Write the derivations produced by derivationStrict to the store
+       in the background.  Callers that enable this must call
+       flushDerivations() before passing the paths of those
+       derivations to the store. */
+    void writeDerivationsAsync();
+
+    Path writeDerivation(const Derivation & drv, const string & name);
+
+    /* Wait until all derivations produced so far are in the store. */
+    void flushDerivations();
+
+    /* Wait until `path' is in the store, if it is a derivation that is
+       being written in the background. */
+    void ensureDerivationWritten(const Path & path);
+
 private:
 
     unsigned long nrEnvs = 0;
@@ -356,6 +384,9 @@ struct EvalSettings : Config
     Setting<Strings> allowedUris{this, {}, "allowed-uris",
         "Prefixes of URIs that builtin functions such as fetchurl and fetchGit are allowed to fetch."};
 
+    Setting<unsigned int> regexCacheSize{this, 1024, "regex-cache-size",
+        "Maximum number of compiled regular expressions cached by builtins.match and builtins.split."};
+
     Setting<bool> traceFunctionCalls{this, false, "trace-function-calls",
         "Emit log messages for each function entry and exit at the 'vomit' log level (-vvvv)"};
 };
@@ -61,6 +61,7 @@ public:
     */
 
     void setName(const string & s) { name = s; }
+    void setSystem(const string & s) { system = s; }
     void setDrvPath(const string & s) { drvPath = s; }
     void setOutPath(const string & s) { outPath = s; }
 
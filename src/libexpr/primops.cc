@@ -3,6 +3,7 @@
 #include "download.hh"
 #include "eval-inline.hh"
 #include "eval.hh"
+#include "eval-inputs.hh"
 #include "globals.hh"
 #include "json-to-value.hh"
 #include "names.hh"
@@ -20,8 +21,11 @@
 #endif
 
 #include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <regex>
+#include <string_view>
+#include <unordered_set>
 #ifndef _WIN32
 #include <dlfcn.h>
 #endif
@@ -68,6 +72,7 @@ void EvalState::realiseContext(const PathSet & context)
         std::pair<string, string> decoded = decodeContext(i);
         Path ctx = decoded.first;
         assert(store->isStorePath(ctx));
+        ensureDerivationWritten(ctx);
         if (!store->isValidPath(ctx))
             throw InvalidPathError(ctx);
         if (!decoded.second.empty() && nix::isDerivation(ctx)) {
@@ -76,9 +81,9 @@ void EvalState::realiseContext(const PathSet & context)
             /* Add the output of this derivation to the allowed
                paths. */
             if (allowedPaths) {
-                auto drv = store->derivationFromPath(decoded.first);
-                DerivationOutputs::iterator i = drv.outputs.find(decoded.second);
-                if (i == drv.outputs.end())
+                auto drv = store->sharedDerivationFromPath(decoded.first);
+                auto i = drv->outputs.find(decoded.second);
+                if (i == drv->outputs.end())
                     throw Error("derivation '%s' does not have an output named '%s'", decoded.first, decoded.second);
                 allowedPaths->insert(i->second.path);
             }
@@ -115,7 +120,7 @@ static void prim_scopedImport(EvalState & state, const Pos & pos, Value * * args
     Path realPath = state.checkSourcePath(state.toRealPath(path, context));
 
     if (state.store->isStorePath(path) && state.store->isValidPath(path) && isDerivation(path)) {
-        Derivation drv = readDerivation(realPath);
+        auto drv = *readSharedDerivation(path, realPath);
         Value & w = *state.allocValue();
         state.mkAttrs(w, 3 + drv.outputs.size());
         Value * v2 = state.allocAttr(w, state.sDrvPath);
@@ -156,7 +161,7 @@ static void prim_scopedImport(EvalState & state, const Pos & pos, Value * * args
             }
 
             printTalkative("evaluating file '%1%'", realPath);
-            Expr * e = state.parseExprFromFile(resolveExprPath(realPath), staticEnv);
+            Expr * e = state.parseExprFromFile(state.checkSourcePath(resolveExprPath(realPath)), staticEnv);
 
             e->eval(state, *env, v);
         }
@@ -184,6 +189,8 @@ void prim_importNative(EvalState & state, const Pos & pos, Value * * args, Value
 
     path = state.checkSourcePath(path);
 
+    if (state.inputs) state.inputs->markImpure("builtins.importNative");
+
     string sym = state.forceStringNoCtx(*args[1], pos);
 
     void *handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_LOCAL);
@@ -229,6 +236,8 @@ void prim_exec(EvalState & state, const Pos & pos, Value * * args, Value & v)
             % program % e.path % pos);
     }
 
+    if (state.inputs) state.inputs->markImpure("builtins.exec");
+
     auto output = runProgramGetStdout(program, true, commandArgs);
     Expr * parsed;
     try {
@@ -364,11 +373,79 @@ struct CompareValues
 };
 
 
-#if HAVE_BOEHMGC
-typedef list<Value *, gc_allocator<Value *> > ValueList;
-#else
-typedef list<Value *> ValueList;
-#endif
+/* The set of keys seen by genericClosure.  This is equivalent to a
+   std::set<Value *, CompareValues>, but uses hash tables specialised
+   for the key types that CompareValues supports, so lookups don't go
+   through the generic comparator. */
+class ClosureKeys
+{
+    /* The first key inserted.  As with CompareValues, all keys must
+       be numbers or all must be of the type of the first key. */
+    Value * first = nullptr;
+
+    /* Integers, and floats with an integral value (since 1 and 1.0
+       compare equal). */
+    std::unordered_set<NixInt> ints;
+    std::unordered_set<NixFloat> floats;
+
+    /* NaN is not equal to itself, so it can't go in `floats'.  Treat
+       all NaN keys as the same key, so that a closure over NaN keys
+       terminates. */
+    bool haveNaN = false;
+
+    /* Strings or paths.  These point into values that are reachable
+       from the closure, so they don't need to be copied. */
+    std::unordered_set<std::string_view> strings;
+
+    static bool isNumber(const Value & v)
+    {
+        return v.type == tInt || v.type == tFloat;
+    }
+
+public:
+
+    /* Whether further keys can be compared with the keys in the set. */
+    bool comparable() const
+    {
+        return !first || isNumber(*first) || first->type == tString || first->type == tPath;
+    }
+
+    /* Return true if `key' was not in the set yet. */
+    bool insert(Value * key)
+    {
+        bool isFirst = !first;
+        if (isFirst)
+            first = key;
+        else if (first->type != key->type && !(isNumber(*first) && isNumber(*key)))
+            throw EvalError(format("cannot compare %1% with %2%") % showType(*key) % showType(*first));
+
+        switch (key->type) {
+            case tInt:
+                return ints.insert(key->integer).second;
+            case tFloat:
+                if (key->fpoint == std::trunc(key->fpoint)
+                    && key->fpoint >= (NixFloat) std::numeric_limits<NixInt>::min()
+                    && key->fpoint < (NixFloat) std::numeric_limits<NixInt>::max())
+                    return ints.insert((NixInt) key->fpoint).second;
+                if (std::isnan(key->fpoint)) {
+                    if (haveNaN) return false;
+                    return haveNaN = true;
+                }
+                return floats.insert(key->fpoint).second;
+            case tString:
+                return strings.insert(key->string.s).second;
+            case tPath:
+                return strings.insert(key->path).second;
+            default:
+                /* A single key of an incomparable type is fine, just
+                   like in a std::set with one element.  Any further
+                   key, even the same value again, has to be compared
+                   to it. */
+                if (isFirst) return true;
+                throw EvalError(format("cannot compare %1% with %2%") % showType(*key) % showType(*first));
+        }
+    }
+};
 
 
 static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * args, Value & v)
@@ -382,7 +459,10 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
         throw EvalError(format("attribute 'startSet' required, at %1%") % pos);
     state.forceList(*startSet->value, pos);
 
-    ValueList workSet;
+    /* The work set is processed in FIFO order.  Processed elements
+       are not removed, so that everything in it stays reachable by
+       the garbage collector. */
+    ValueVector workSet;
     for (unsigned int n = 0; n < startSet->value->listSize(); ++n)
         workSet.push_back(startSet->value->listElems()[n]);
 
@@ -393,26 +473,33 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
         throw EvalError(format("attribute 'operator' required, at %1%") % pos);
     state.forceValue(*op->value);
 
+    Symbol sKey = state.symbols.create("key");
+
     /* Construct the closure by applying the operator to element of
        `workSet', adding the result to `workSet', continuing until
        no new elements are found. */
-    ValueList res;
-    // `doneKeys' doesn't need to be a GC root, because its values are
-    // reachable from res.
-    set<Value *, CompareValues> doneKeys;
-    while (!workSet.empty()) {
-        Value * e = *(workSet.begin());
-        workSet.pop_front();
+    ValueVector res;
+    // `doneKeys' and `doneValues' don't need to be GC roots, because
+    // their values are reachable from `workSet'.
+    ClosureKeys doneKeys;
+    /* Operators often return the same value several times, so skip
+       values we've already seen without looking at their key. */
+    std::unordered_set<Value *> doneValues;
+    for (size_t next = 0; next < workSet.size(); ++next) {
+        Value * e = workSet[next];
+
+        /* With incomparable keys, fall through so that the
+           comparison error is thrown as before. */
+        if (!doneValues.insert(e).second && doneKeys.comparable()) continue;
 
         state.forceAttrs(*e, pos);
 
-        Bindings::iterator key =
-            e->attrs->find(state.symbols.create("key"));
+        Bindings::iterator key = e->attrs->find(sKey);
         if (key == e->attrs->end())
             throw EvalError(format("attribute 'key' required, at %1%") % pos);
         state.forceValue(*key->value);
 
-        if (!doneKeys.insert(key->value).second) continue;
+        if (!doneKeys.insert(key->value)) continue;
         res.push_back(e);
 
         /* Call the `operator' function with `e' as argument. */
@@ -485,7 +572,9 @@ static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_getEnv(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     string name = state.forceStringNoCtx(*args[0], pos);
-    mkString(v, evalSettings.restrictEval || evalSettings.pureEval ? "" : getEnv(name));
+    string value = evalSettings.restrictEval || evalSettings.pureEval ? "" : getEnv(name);
+    if (state.inputs) state.inputs->addEnvVar(name, value);
+    mkString(v, value);
 }
 
 
@@ -700,6 +789,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
         if (path.at(0) == '=') {
             /* !!! This doesn't work if readOnlyMode is set. */
             PathSet refs;
+            state.ensureDerivationWritten(string(path, 1));
             state.store->computeFSClosure(string(path, 1), refs);
             for (auto & j : refs) {
                 drv.inputSrcs.insert(j);
@@ -770,16 +860,11 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     }
 
     /* Write the resulting term into the Nix store directory. */
-    Path drvPath = writeDerivation(state.store, drv, drvName, state.repair);
+    Path drvPath = state.writeDerivation(drv, drvName);
 
     printMsg(lvlChatty, format("instantiated '%1%' -> '%2%'")
         % drvName % drvPath);
 
-    /* Optimisation, but required in read-only mode! because in that
-       case we don't actually write store derivations, so we can't
-       read them later. */
-    drvHashes[drvPath] = hashDerivationModulo(*state.store, drv);
-
     state.mkAttrs(v, 1 + drv.outputs.size());
     mkString(*state.allocAttr(v, state.sDrvPath), drvPath, {"=" + drvPath});
     for (auto & i : drv.outputs) {
@@ -836,6 +921,7 @@ static void prim_storePath(EvalState & state, const Pos & pos, Value * * args, V
     if (!state.store->isInStore(path))
         throw EvalError(format("path '%1%' is not in the Nix store, at %2%") % path % pos);
     Path path2 = state.store->toStorePath(path);
+    state.ensureDerivationWritten(path2);
     if (!settings.readOnlyMode)
         state.store->ensurePath(path2);
     context.insert(path2);
@@ -1040,6 +1126,7 @@ static void prim_toFile(EvalState & state, const Pos & pos, Value * * args, Valu
     for (auto path : context) {
         if (path.at(0) != '/')
             throw EvalError(format("in 'toFile': the file '%1%' cannot refer to derivation outputs, at %2%") % name % pos);
+        state.ensureDerivationWritten(path);
         refs.insert(path);
     }
 
@@ -1402,6 +1489,97 @@ static void prim_mapAttrs(EvalState & state, const Pos & pos, Value * * args, Va
 }
 
 
+/* filterAttrs = pred: set: listToAttrs (concatMap (name: let v = set.${name}; in if pred name v then [(nameValuePair name v)] else []) (attrNames set)); */
+/* C++-version avoids allocating an env and a thunk per attribute. */
+static void prim_filterAttrs(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceFunction(*args[0], pos);
+    state.forceAttrs(*args[1], pos);
+
+    state.mkAttrs(v, args[1]->attrs->size());
+
+    for (auto & i : *args[1]->attrs) {
+        Value vName, vFun2, res;
+        mkString(vName, i.name);
+        state.callFunction(*args[0], vName, vFun2, pos);
+        state.callFunction(vFun2, *i.value, res, pos);
+        if (state.forceBool(res, pos))
+            v.attrs->push_back(i);
+    }
+
+    v.attrs->sort();
+}
+
+
+/* mapAttrsToList = f: set: map (name: f name set.${name}) (attrNames set); */
+static void prim_mapAttrsToList(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceAttrs(*args[1], pos);
+
+    auto len = args[1]->attrs->size();
+
+    std::vector<const Attr *> attrs;
+    attrs.reserve(len);
+    for (auto & i : *args[1]->attrs)
+        attrs.push_back(&i);
+
+    std::sort(attrs.begin(), attrs.end(),
+        [](const Attr * a, const Attr * b) { return (const string &) a->name < (const string &) b->name; });
+
+    state.mkList(v, len);
+
+    for (unsigned int n = 0; n < len; ++n) {
+        Value * vName = state.allocValue();
+        Value * vFun2 = state.allocValue();
+        mkString(*vName, attrs[n]->name);
+        mkApp(*vFun2, *args[0], *vName);
+        mkApp(*(v.listElems()[n] = state.allocValue()), *vFun2, *attrs[n]->value);
+    }
+}
+
+
+/* zipAttrsWith = f: sets: the set mapping each attribute name `n'
+   occurring in any of `sets' to `f n (catAttrs n sets)'. */
+static void prim_zipAttrsWith(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceList(*args[1], pos);
+
+    auto nrSets = args[1]->listSize();
+
+    /* First count the occurrences of each name, so that every list of
+       values can be allocated at its final size. */
+    std::map<Symbol, std::pair<unsigned int, Value *>> attrsSeen;
+
+    for (unsigned int n = 0; n < nrSets; ++n) {
+        Value & vSet(*args[1]->listElems()[n]);
+        state.forceAttrs(vSet, pos);
+        for (auto & i : *vSet.attrs)
+            attrsSeen[i.name].first++;
+    }
+
+    state.mkAttrs(v, attrsSeen.size());
+
+    for (auto & i : attrsSeen) {
+        Value * vName = state.allocValue();
+        Value * vFun2 = state.allocValue();
+        mkString(*vName, i.first);
+        mkApp(*vFun2, *args[0], *vName);
+        Value * vList = i.second.second = state.allocValue();
+        state.mkList(*vList, i.second.first);
+        i.second.first = 0;
+        mkApp(*state.allocAttr(v, i.first), *vFun2, *vList);
+    }
+
+    for (unsigned int n = 0; n < nrSets; ++n)
+        for (auto & i : *args[1]->listElems()[n]->attrs) {
+            auto & item = attrsSeen[i.name];
+            item.second->listElems()[item.first++] = i.value;
+        }
+
+    v.attrs->sort();
+}
+
+
 
 /*************************************************************
  * Lists
@@ -1710,6 +1888,55 @@ static void prim_concatMap(EvalState & state, const Pos & pos, Value * * args, V
 }
 
 
+/* groupBy = f: list: the set mapping each name `f x' for an element
+   `x' of `list' to the elements for which `f' returned that name, in
+   their original order. */
+static void prim_groupBy(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceFunction(*args[0], pos);
+    state.forceList(*args[1], pos);
+
+    ValueVectorMap groups;
+
+    for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
+        auto vElem = args[1]->listElems()[n];
+        Value res;
+        state.callFunction(*args[0], *vElem, res, pos);
+        groups[state.symbols.create(state.forceStringNoCtx(res, pos))].push_back(vElem);
+    }
+
+    state.mkAttrs(v, groups.size());
+
+    for (auto & i : groups) {
+        Value * vList = state.allocAttr(v, i.first);
+        auto size = i.second.size();
+        state.mkList(*vList, size);
+        memcpy(vList->listElems(), i.second.data(), sizeof(Value *) * size);
+    }
+
+    v.attrs->sort();
+}
+
+
+/* Return the list of integers from `first' to `last', inclusive. */
+static void prim_range(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    auto first = state.forceInt(*args[0], pos);
+    auto last = state.forceInt(*args[1], pos);
+
+    /* Compute the length without signed overflow, and refuse lists
+       longer than genList can create. */
+    uint64_t len = first > last ? 0 : (uint64_t) last - (uint64_t) first + 1;
+    if (first <= last && (len == 0 || len > std::numeric_limits<unsigned int>::max()))
+        throw EvalError(format("range from %1% to %2% is too large, at %3%") % first % last % pos);
+
+    state.mkList(v, len);
+
+    for (uint64_t n = 0; n < len; ++n)
+        mkInt(*(v.listElems()[n] = state.allocValue()), first + (NixInt) n);
+}
+
+
 /*************************************************************
  * Integer arithmetic
  *************************************************************/
@@ -1833,6 +2060,26 @@ static void prim_stringLength(EvalState & state, const Pos & pos, Value * * args
 }
 
 
+/* Return true if the string `s' starts with `prefix'. */
+static void prim_hasPrefix(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    PathSet context; // discarded
+    string prefix = state.coerceToString(pos, *args[0], context);
+    string s = state.coerceToString(pos, *args[1], context);
+    mkBool(v, hasPrefix(s, prefix));
+}
+
+
+/* Return true if the string `s' ends with `suffix'. */
+static void prim_hasSuffix(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    PathSet context; // discarded
+    string suffix = state.coerceToString(pos, *args[0], context);
+    string s = state.coerceToString(pos, *args[1], context);
+    mkBool(v, hasSuffix(s, suffix));
+}
+
+
 /* Return the cryptographic hash of a string in base-16. */
 static void prim_hashString(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
@@ -1848,6 +2095,30 @@ static void prim_hashString(EvalState & state, const Pos & pos, Value * * args,
 }
 
 
+std::shared_ptr<std::regex> RegexCache::get(const std::string & re)
+{
+    auto regex = cache.get(re);
+    if (regex) {
+        nrHits++;
+        return *regex;
+    }
+    nrMisses++;
+    auto compiled = std::make_shared<std::regex>(re, std::regex::extended);
+    cache.upsert(re, compiled);
+    return compiled;
+}
+
+
+/* Add the time spent in a regex primop to the regex statistics. */
+struct RegexTimer
+{
+    RegexCache & cache;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    RegexTimer(RegexCache & cache) : cache(cache) { }
+    ~RegexTimer() { cache.time += std::chrono::steady_clock::now() - start; }
+};
+
+
 /* Match a regular expression against a string and return either
    ‘null’ or a list containing substring matches. */
 static void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
@@ -1856,13 +2127,19 @@ static void prim_match(EvalState & state, const Pos & pos, Value * * args, Value
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        std::shared_ptr<std::regex> regex;
+        {
+            RegexTimer timer(*state.regexCache);
+            regex = state.regexCache->get(re);
+        }
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
+        RegexTimer timer(*state.regexCache);
+
         std::smatch match;
-        if (!std::regex_match(str, match, regex)) {
+        if (!std::regex_match(str, match, *regex)) {
             mkNull(v);
             return;
         }
@@ -1896,12 +2173,18 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        std::shared_ptr<std::regex> regex;
+        {
+            RegexTimer timer(*state.regexCache);
+            regex = state.regexCache->get(re);
+        }
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
-        auto begin = std::sregex_iterator(str.begin(), str.end(), regex);
+        RegexTimer timer(*state.regexCache);
+
+        auto begin = std::sregex_iterator(str.begin(), str.end(), *regex);
         auto end = std::sregex_iterator();
 
         // Any matches results are surrounded by non-matching results.
@@ -2116,6 +2399,10 @@ void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
     if (evalSettings.pureEval && !request.expectedHash)
         throw Error("in pure evaluation mode, '%s' requires a 'sha256' argument", who);
 
+    /* Without a hash, the result depends on the download cache's TTL
+       and on whatever the server returns. */
+    if (state.inputs && !request.expectedHash) state.inputs->markImpure(who);
+
     auto res = getDownloader()->downloadCached(state.store, request);
 
     if (state.allowedPaths)
@@ -2137,6 +2424,24 @@ static void prim_fetchTarball(EvalState & state, const Pos & pos, Value * * args
 }
 
 
+/* The expression behind `builtins.currentTime'.  It is evaluated when
+   the value is first used, so that only evaluations that use it are
+   marked as impure. */
+struct ExprCurrentTime : Expr
+{
+    void show(std::ostream & str) const override
+    {
+        str << "builtins.currentTime";
+    }
+
+    void eval(EvalState & state, Env & env, Value & v) override
+    {
+        if (state.inputs) state.inputs->markImpure("builtins.currentTime");
+        mkInt(v, time(0));
+    }
+};
+
+
 /*************************************************************
  * Primop registration
  *************************************************************/
@@ -2182,7 +2487,7 @@ void EvalState::createBaseEnv()
     };
 
     if (!evalSettings.pureEval) {
-        mkInt(v, time(0));
+        mkThunk_(v, new ExprCurrentTime);
         addConstant("__currentTime", v);
     }
 
@@ -2274,6 +2579,9 @@ void EvalState::createBaseEnv()
     addPrimOp("__catAttrs", 2, prim_catAttrs);
     addPrimOp("__functionArgs", 1, prim_functionArgs);
     addPrimOp("__mapAttrs", 2, prim_mapAttrs);
+    addPrimOp("__filterAttrs", 2, prim_filterAttrs);
+    addPrimOp("__mapAttrsToList", 2, prim_mapAttrsToList);
+    addPrimOp("__zipAttrsWith", 2, prim_zipAttrsWith);
 
     // Lists
     addPrimOp("__isList", 1, prim_isList);
@@ -2292,6 +2600,8 @@ void EvalState::createBaseEnv()
     addPrimOp("__sort", 2, prim_sort);
     addPrimOp("__partition", 2, prim_partition);
     addPrimOp("__concatMap", 2, prim_concatMap);
+    addPrimOp("__groupBy", 2, prim_groupBy);
+    addPrimOp("__range", 2, prim_range);
 
     // Integer arithmetic
     addPrimOp("__add", 2, prim_add);
@@ -2307,6 +2617,8 @@ void EvalState::createBaseEnv()
     addPrimOp("toString", 1, prim_toString);
     addPrimOp("__substring", 3, prim_substring);
     addPrimOp("__stringLength", 1, prim_stringLength);
+    addPrimOp("__hasPrefix", 2, prim_hasPrefix);
+    addPrimOp("__hasSuffix", 2, prim_hasSuffix);
     addPrimOp("__hashString", 2, prim_hashString);
     addPrimOp("__match", 2, prim_match);
     addPrimOp("__split", 2, prim_split);
@@ -1,5 +1,8 @@
 #include "eval.hh"
+#include "lru-cache.hh"
 
+#include <chrono>
+#include <regex>
 #include <tuple>
 #include <vector>
 
@@ -15,6 +18,26 @@ struct RegisterPrimOp
     RegisterPrimOp(std::string name, size_t arity, PrimOpFun fun);
 };
 
+/* A bounded cache of compiled regular expressions, used by
+   builtins.match and builtins.split so that the same pattern is not
+   recompiled on every call. */
+struct RegexCache
+{
+    LRUCache<std::string, std::shared_ptr<std::regex>> cache;
+
+    /* Statistics, reported by EvalState::printStats(). */
+    unsigned long nrHits = 0;
+    unsigned long nrMisses = 0;
+    std::chrono::steady_clock::duration time{0};
+
+    RegexCache(size_t capacity) : cache(capacity) { }
+
+    /* Return the compiled form of the POSIX extended regular
+       expression `re', compiling it if necessary.  Throws
+       std::regex_error if `re' is invalid. */
+    std::shared_ptr<std::regex> get(const std::string & re);
+};
+
 #ifndef _WIN32
 /* These primops are disabled without enableNativeCode, but plugins
    may wish to use them in limited contexts without globally enabling
@@ -4,10 +4,20 @@
 
 namespace nix {
 
+/* Derivations in `context' may still be being written to the store in
+   the background.  Wait for them before their paths leave the string
+   context, since nothing would wait for them afterwards. */
+static void ensureContextWritten(EvalState & state, const PathSet & context)
+{
+    for (auto & p : context)
+        state.ensureDerivationWritten(p.at(0) == '=' ? string(p, 1) : decodeContext(p).first);
+}
+
 static void prim_unsafeDiscardStringContext(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     PathSet context;
     string s = state.coerceToString(pos, *args[0], context);
+    ensureContextWritten(state, context);
     mkString(v, s, PathSet());
 }
 
@@ -73,6 +83,7 @@ static void prim_getContext(EvalState & state, const Pos & pos, Value * * args,
     };
     PathSet context;
     state.forceString(*args[0], context, pos);
+    ensureContextWritten(state, context);
     auto contextInfos = std::map<Path, ContextInfo>();
     for (const auto & p : context) {
         Path drv;
@@ -3,6 +3,7 @@
 #include "download.hh"
 #include "store-api.hh"
 #include "pathlocks.hh"
+#include "eval-inputs.hh"
 #ifndef _MSC_VER
 #  include <sys/time.h>
 #endif
@@ -277,6 +278,11 @@ static void prim_fetchGit(EvalState & state, const Pos & pos, Value * * args, Va
     // whitelist. Ah well.
     state.checkURI(url);
 
+    /* Without a commit hash, the result depends on the current state
+       of the repository. */
+    if (state.inputs && !std::regex_match(rev, revRegex))
+        state.inputs->markImpure("fetchGit");
+
     auto gitInfo = exportGit(state.store, url, ref, rev, name);
 
     state.mkAttrs(v, 8);
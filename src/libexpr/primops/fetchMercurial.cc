@@ -3,6 +3,7 @@
 #include "download.hh"
 #include "store-api.hh"
 #include "pathlocks.hh"
+#include "eval-inputs.hh"
 #ifndef _MSC_VER
 #include <sys/time.h>
 #endif
@@ -247,6 +248,11 @@ static void prim_fetchMercurial(EvalState & state, const Pos & pos, Value * * ar
     // whitelist. Ah well.
     state.checkURI(url);
 
+    /* Without a commit hash, the result depends on the current state
+       of the repository. */
+    if (state.inputs && !std::regex_match(rev, commitHashRegex))
+        state.inputs->markImpure("fetchMercurial");
+
     auto hgInfo = exportMercurial(state.store, url, rev, name);
 
     state.mkAttrs(v, 8);
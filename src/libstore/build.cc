@@ -23,6 +23,7 @@
 #include <chrono>
 #include <regex>
 #include <queue>
+#include <condition_variable>
 
 #include <limits.h>
 #ifndef _MSC_VER
@@ -96,6 +97,9 @@ struct HookInstance;
 /* A pointer to a goal. */
 class Goal;
 class DerivationGoal;
+#ifndef _WIN32
+class RemotePrefetcher;
+#endif
 typedef std::shared_ptr<Goal> GoalPtr;
 typedef std::weak_ptr<Goal> WeakGoalPtr;
 
@@ -322,6 +326,10 @@ public:
     /* Whether to ask the build hook if it can build a derivation. If
        it answers with "decline-permanently", we don't try again. */
     bool tryBuildHook = true;
+
+    /* Copies inputs to remote builders ahead of time. */
+    std::unique_ptr<RemotePrefetcher> prefetcher;
+    bool tryPrefetch = true;
 #endif
     Worker(LocalStore & store);
     ~Worker();
@@ -379,6 +387,14 @@ public:
     /* Wait for input to become available. */
     void waitForInput();
 
+#ifndef _WIN32
+    /* Start copying `paths', which are inputs of a derivation for
+       `system' that isn't runnable yet, to the remote builder that will
+       probably build it. */
+    void prefetchInputs(const std::string & system,
+        const StringSet & requiredFeatures, const PathSet & paths);
+#endif
+
     unsigned int exitStatus();
 
     /* Check whether the given valid path exists and has the right
@@ -757,6 +773,158 @@ HookInstance::~HookInstance()
         ignoreException();
     }
 }
+
+
+/* Copies the inputs of derivations that are still waiting for other
+   inputs to the machine that the build hook will probably pick for
+   them, so that the hook doesn't have to copy them when the
+   derivation becomes runnable.  Copying happens on a thread of its
+   own, in chunks so that shutting down doesn't wait for long. */
+class RemotePrefetcher
+{
+    struct Request
+    {
+        std::string system;
+        StringSet requiredFeatures;
+        PathSet paths;
+    };
+
+    struct State
+    {
+        std::deque<Request> queue;
+        bool quit = false;
+    };
+
+    LocalStore & store;
+    const Path currentLoad;
+    const Machines machines;
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /* The paths copied so far, per machine. Only used by the thread. */
+    std::map<std::string, PathSet> copied;
+    std::map<std::string, std::shared_ptr<Store>> remoteStores;
+
+    std::thread thread;
+
+public:
+
+    RemotePrefetcher(LocalStore & store, const Path & currentLoad, const Machines & machines)
+        : store(store), currentLoad(currentLoad), machines(machines)
+    {
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~RemotePrefetcher()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_one();
+        thread.join();
+    }
+
+    void enqueue(const std::string & system, const StringSet & requiredFeatures, const PathSet & paths)
+    {
+        auto state(state_.lock());
+        /* Old requests are less likely to matter by the time we get
+           to them. */
+        if (state->queue.size() >= 64) state->queue.pop_front();
+        state->queue.push_back({system, requiredFeatures, paths});
+        wakeup.notify_one();
+    }
+
+private:
+
+    bool quitting()
+    {
+        return state_.lock()->quit;
+    }
+
+    void run()
+    {
+        while (true) {
+            Request request;
+            {
+                auto state(state_.lock());
+                while (!state->quit && state->queue.empty()) state.wait(wakeup);
+                if (state->quit) return;
+                request = std::move(state->queue.front());
+                state->queue.pop_front();
+            }
+            try {
+                prefetch(request);
+            } catch (std::exception & e) {
+                printMsg(lvlTalkative, "cannot copy inputs to a remote builder ahead of time: %s", e.what());
+            }
+        }
+    }
+
+    void prefetch(const Request & request)
+    {
+        PathSet closure;
+        store.computeFSClosure(request.paths, closure);
+
+        std::map<Path, uint64_t> inputClosure;
+        for (auto & i : store.queryPathInfos(closure))
+            inputClosure[i.first] = i.second->narSize;
+
+        auto machine = predictMachine(machines, currentLoad,
+            request.system, request.requiredFeatures, inputClosure);
+        if (!machine) return;
+
+        auto & copied = this->copied[machine->storeUri];
+        auto present = readPresentPaths(currentLoad, *machine);
+        PathSet missing;
+        for (auto & path : closure)
+            if (!copied.count(path) && !present.count(path)) missing.insert(path);
+        if (missing.empty()) return;
+
+        /* Don't get in the way of a build that is uploading: only
+           copy while the upload lock is free, and let go of it between
+           chunks, so that a build waits for one chunk at most. */
+        AutoCloseFD uploadLock = openLockFile(currentLoad + "/" + escapeUri(machine->storeUri) + ".upload-lock", true);
+        auto lockUpload = [&]() {
+            if (lockFile(uploadLock.get(), ltWrite, false)) return true;
+            debug("not copying inputs to '%s' ahead of time, since it's busy", machine->storeUri);
+            return false;
+        };
+        if (!lockUpload()) return;
+        bool locked = true;
+
+        auto & remoteStore = remoteStores[machine->storeUri];
+        if (!remoteStore) {
+            Store::Params storeParams;
+            if (hasPrefix(machine->storeUri, "ssh://")) {
+                storeParams["max-connections"] = "1";
+                if (machine->sshKey != "")
+                    storeParams["ssh-key"] = machine->sshKey;
+            }
+            remoteStore = openStore(machine->storeUri, storeParams);
+        }
+
+        printMsg(lvlTalkative, "copying %d inputs to '%s' ahead of time", missing.size(), machine->storeUri);
+
+        /* Copy in dependency order, a few megabytes at a time. */
+        auto sorted = store.topoSortPaths(missing);
+        PathSet chunk;
+        uint64_t chunkSize = 0;
+        for (auto i = sorted.rbegin(); i != sorted.rend(); ++i) {
+            chunk.insert(*i);
+            chunkSize += inputClosure[*i];
+            if (chunkSize < 64 * 1024 * 1024 && std::next(i) != sorted.rend()) continue;
+            if (quitting()) return;
+            if (!locked && !lockUpload()) return;
+            copyPaths(ref<Store>(store.shared_from_this()), ref<Store>(remoteStore), chunk,
+                NoRepair, NoCheckSigs, settings.buildersUseSubstitutes ? Substitute : NoSubstitute);
+            lockFile(uploadLock.get(), ltNone, false);
+            locked = false;
+            recordPresentPaths(currentLoad, *machine, chunk, {});
+            copied.insert(chunk.begin(), chunk.end());
+            chunk.clear();
+            chunkSize = 0;
+        }
+    }
+};
 #endif
 
 //////////////////////////////////////////////////////////////////////
@@ -946,6 +1114,8 @@ public:
 
     void timedOut() override;
 
+    void waiteeDone(GoalPtr waitee, ExitCode result) override;
+
     string key() override
     {
         /* Ensure that derivations get built in order of their name,
@@ -980,6 +1150,11 @@ private:
 #ifndef _WIN32
     /* Is the build hook willing to perform the build? */
     HookReply tryBuildHook();
+
+    /* Copy those of `paths' that are valid to the remote builder that
+       will probably build this derivation, while we wait for the other
+       inputs. */
+    void prefetchInputs(const PathSet & paths);
 #endif
     /* Start building a derivation. */
     void startBuilder();
@@ -1312,9 +1487,59 @@ void DerivationGoal::outputsSubstituted()
 
     if (waitees.empty()) /* to prevent hang (no wake-up event) */
         inputsRealised();
-    else
+    else {
         state = &DerivationGoal::inputsRealised;
+#ifndef _WIN32
+        prefetchInputs(drv->inputSrcs);
+#endif
+    }
+}
+
+
+void DerivationGoal::waiteeDone(GoalPtr waitee, ExitCode result)
+{
+    Goal::waiteeDone(waitee, result);
+
+#ifndef _WIN32
+    /* If we're still waiting for other inputs, the outputs of this
+       one can already go to the remote builder. */
+    if (result != ecSuccess || waitees.empty() || state != &DerivationGoal::inputsRealised)
+        return;
+
+    auto inputGoal = std::dynamic_pointer_cast<DerivationGoal>(waitee);
+    if (!inputGoal || !inputGoal->drv || !useDerivation) return;
+
+    auto & inputDrvs = dynamic_cast<Derivation *>(drv.get())->inputDrvs;
+    auto i = inputDrvs.find(inputGoal->drvPath);
+    if (i == inputDrvs.end()) return;
+
+    PathSet paths = drv->inputSrcs;
+    for (auto & j : i->second) {
+        auto k = inputGoal->drv->outputs.find(j);
+        if (k != inputGoal->drv->outputs.end()) paths.insert(k->second.path);
+    }
+
+    prefetchInputs(paths);
+#endif
+}
+
+
+#ifndef _WIN32
+void DerivationGoal::prefetchInputs(const PathSet & paths)
+{
+    if (!settings.prefetchRemoteInputs || !worker.tryBuildHook || !worker.tryPrefetch
+        || buildMode != bmNormal || parsedDrv->willBuildLocally())
+        return;
+
+    try {
+        auto valid = worker.store.queryValidPaths(paths);
+        if (!valid.empty())
+            worker.prefetchInputs(drv->platform, parsedDrv->getRequiredSystemFeatures(), valid);
+    } catch (Error & e) {
+        debug("not prefetching the inputs of '%s': %s", drvPath, e.msg());
+    }
 }
+#endif
 
 
 void DerivationGoal::repairClosure()
@@ -1343,8 +1568,8 @@ void DerivationGoal::repairClosure()
     std::map<Path, Path> outputsToDrv;
     for (auto & i : inputClosure)
         if (isDerivation(i)) {
-            Derivation drv = worker.store.derivationFromPath(i);
-            for (auto & j : drv.outputs)
+            auto drv = worker.store.sharedDerivationFromPath(i);
+            for (auto & j : drv->outputs)
                 outputsToDrv[j.second.path] = i;
         }
 
@@ -1415,10 +1640,10 @@ void DerivationGoal::inputsRealised()
                `i' as input paths.  Only add the closures of output paths
                that are specified as inputs. */
             assert(worker.store.isValidPath(i.first));
-            Derivation inDrv = worker.store.derivationFromPath(i.first);
+            auto inDrv = worker.store.sharedDerivationFromPath(i.first);
             for (auto & j : i.second)
-                if (inDrv.outputs.find(j) != inDrv.outputs.end())
-                    worker.store.computeFSClosure(inDrv.outputs[j].path, inputPaths);
+                if (auto k = inDrv->outputs.find(j); k != inDrv->outputs.end())
+                    worker.store.computeFSClosure(k->second.path, inputPaths);
                 else
                     throw Error(
                         format("derivation '%1%' requires non-existent output '%2%' from input derivation '%3%'")
@@ -1947,8 +2172,8 @@ std::cerr << "----------------------------------------------------DerivationGoal
 
     for (auto & j : paths2) {
         if (isDerivation(j)) {
-            Derivation drv = worker.store.derivationFromPath(j);
-            for (auto & k : drv.outputs)
+            auto drv = worker.store.sharedDerivationFromPath(j);
+            for (auto & k : drv->outputs)
                 worker.store.computeFSClosure(k.second.path, paths);
         }
     }
@@ -4742,6 +4967,26 @@ void Worker::wakeUp(GoalPtr goal)
 }
 
 
+#ifndef _WIN32
+void Worker::prefetchInputs(const std::string & system,
+    const StringSet & requiredFeatures, const PathSet & paths)
+{
+    if (!prefetcher) {
+        auto machines = getMachines();
+        if (machines.empty()) {
+            tryPrefetch = false;
+            return;
+        }
+        Path currentLoad = store.stateDir + "/current-load";
+        /* Error ignored here, like in the build hook. */
+        mkdir(currentLoad.c_str(), 0777);
+        prefetcher = std::make_unique<RemotePrefetcher>(store, currentLoad, machines);
+    }
+    prefetcher->enqueue(system, requiredFeatures, paths);
+}
+#endif
+
+
 unsigned Worker::getNrLocalBuilds()
 {
     return nrLocalBuilds;
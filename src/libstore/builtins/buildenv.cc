@@ -4,19 +4,35 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <algorithm>
+#include <chrono>
 
 namespace nix {
 
-typedef std::map<Path,int> Priorities;
+/* The user environment is first built in memory and then written out
+   in one go.  This way each file in it costs a single system call,
+   and collisions between packages don't cause symlinks to be created
+   and then deleted again. */
+struct Node
+{
+    bool isDir;
 
-// FIXME: change into local variables.
+    /* For symlinks: the target, whether the target is a directory,
+       and the priority of the package it came from. */
+    Path target;
+    bool targetIsDir = false;
+    int priority = 0;
+};
+
+/* The files in the user environment, keyed by path.  Since a
+   directory's path is a prefix of its entries' paths, iterating in
+   order visits directories before their contents. */
+typedef std::map<Path, Node> Tree;
 
-static Priorities priorities;
+// FIXME: change into local variables.
 
-static unsigned long symlinks;
+static Tree tree;
 
 /* For each activated package, create symlinks */
-// TODO: make Windows native version
 static void createLinks(const Path & srcDir, const Path & dstDir, int priority)
 {
     DirEntries srcFiles;
@@ -43,16 +59,22 @@ static void createLinks(const Path & srcDir, const Path & dstDir, int priority)
         auto srcFile = srcDir + "/" + name;
         auto dstFile = dstDir + "/" + name;
 #ifndef _WIN32
-        struct stat srcSt;
-        try {
-            if (stat(srcFile.c_str(), &srcSt) == -1)
-                throw PosixError("getting status-4 of '%1%'", srcFile);
-        } catch (PosixError & e) {
-            if (e.errNo == ENOENT || e.errNo == ENOTDIR) {
-                printError("warning: skipping dangling symlink '%s'", dstFile);
-                continue;
+        /* Only symlinks need to be looked at to find out whether they
+           point to a directory. */
+        bool srcIsDir = ent.type() == DT_DIR;
+        if (ent.type() == DT_LNK || ent.type() == DT_UNKNOWN) {
+            struct stat srcSt;
+            try {
+                if (stat(srcFile.c_str(), &srcSt) == -1)
+                    throw PosixError("getting status-4 of '%1%'", srcFile);
+            } catch (PosixError & e) {
+                if (e.errNo == ENOENT || e.errNo == ENOTDIR) {
+                    printError("warning: skipping dangling symlink '%s'", dstFile);
+                    continue;
+                }
+                throw;
             }
-            throw;
+            srcIsDir = S_ISDIR(srcSt.st_mode);
         }
 #else
         WIN32_FILE_ATTRIBUTE_DATA wfad;
@@ -64,6 +86,7 @@ static void createLinks(const Path & srcDir, const Path & dstDir, int priority)
             }
             throw winError;
         }
+        bool srcIsDir = (wfad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
 #endif
 
         /* The files below are special-cased to that they don't show up
@@ -79,72 +102,67 @@ static void createLinks(const Path & srcDir, const Path & dstDir, int priority)
             hasSuffix(srcFile, "/log"))
             continue;
 
-#ifndef _WIN32
-        else if (S_ISDIR(srcSt.st_mode)) {
-#else
-        else if ((wfad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0) {
-#endif
-            unsigned char dt = getFileType(dstFile);
+        auto dst = tree.find(dstFile);
 
-            if (dt != DT_UNKNOWN) {
-                if (dt == DT_DIR) {
-                    createLinks(srcFile, dstFile, priority);
-                    continue;
-                } else if (dt == DT_LNK) {
-                    auto target = canonPath(dstFile, true);
-                    if (getFileType(target) != DT_DIR)
-                        throw Error("collision between '%1%' and non-directory '%2%'", srcFile, target);
-#ifndef _WIN32
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw PosixError(format("unlinking '%1%'") % dstFile);
-                    if (mkdir(dstFile.c_str(), 0755) == -1)
-                        throw PosixError(format("creating directory '%1%'"));
-#else
-                    if (!DeleteFileW(pathW(dstFile).c_str()))
-                        throw WinError("DeleteFileW when createLinks '%1%'", dstFile);
-                    if (!CreateDirectoryW(pathW(dstFile).c_str(), NULL))
-                        throw WinError("CreateDirectoryW when createLinks '%1%'", dstFile);
-#endif
-                    createLinks(target, dstFile, priorities[dstFile]);
+        if (srcIsDir) {
+            if (dst != tree.end()) {
+                if (dst->second.isDir) {
                     createLinks(srcFile, dstFile, priority);
                     continue;
                 }
-            } //else if (errno != ENOENT)
-                //throw PosixError(format("getting status-5 of '%1%'") % dstFile);
+                if (!dst->second.targetIsDir)
+                    throw Error("collision between '%1%' and non-directory '%2%'", srcFile, dst->second.target);
+                /* Replace the symlink by a directory containing the
+                   entries of both. */
+                auto target = dst->second.target;
+                auto prevPriority = dst->second.priority;
+                dst->second = Node{true};
+                createLinks(target, dstFile, prevPriority);
+                createLinks(srcFile, dstFile, priority);
+                continue;
+            }
+        }
+
+        else if (dst != tree.end()) {
+            if (dst->second.isDir)
+                throw Error("collision between non-directory '%1%' and directory '%2%'", srcFile, dstFile);
+            auto prevPriority = dst->second.priority;
+            if (prevPriority == priority)
+                throw Error(
+                        "packages '%1%' and '%2%' have the same priority %3%; "
+                        "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
+                        "to change the priority of one of the conflicting packages"
+                        " (0 being the highest priority)",
+                        srcFile, dst->second.target, priority);
+            if (prevPriority < priority)
+                continue;
         }
 
-        else {
-            unsigned char dt = getFileType(dstFile);
-            if (dt != DT_UNKNOWN) {
-                if (dt == DT_LNK) {
-                    auto prevPriority = priorities[dstFile];
-                    if (prevPriority == priority)
-                        throw Error(
-                                "packages '%1%' and '%2%' have the same priority %3%; "
-                                "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
-                                "to change the priority of one of the conflicting packages"
-                                " (0 being the highest priority)",
-                                srcFile, readLink(dstFile), priority);
-                    if (prevPriority < priority)
-                        continue;
+        tree[dstFile] = Node{false, srcFile, srcIsDir, priority};
+    }
+}
+
+/* Create the files in `tree'.  Returns the number of symlinks. */
+static unsigned long writeTree()
+{
+    unsigned long symlinks = 0;
+
+    for (auto & i : tree) {
+        if (i.second.isDir) {
 #ifndef _WIN32
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw PosixError(format("unlinking '%1%'") % dstFile);
+            if (mkdir(i.first.c_str(), 0755) == -1)
+                throw PosixError(format("creating directory '%1%'") % i.first);
 #else
-                    if (!DeleteFileW(pathW(dstFile).c_str()))
-                        throw WinError("DeleteFileW when createLinks '%1%'", dstFile);
+            if (!CreateDirectoryW(pathW(i.first).c_str(), NULL))
+                throw WinError("CreateDirectoryW when createLinks '%1%'", i.first);
 #endif
-                } else
-                if (dt == DT_DIR)
-                    throw Error("collision between non-directory '%1%' and directory '%2%'", srcFile, dstFile);
-            } //else if (errno != ENOENT)
-                //throw PosixError(format("getting status-6 of '%1%'") % dstFile);
+        } else {
+            createSymlink(i.second.target, i.first);
+            symlinks++;
         }
-
-        createSymlink(srcFile, dstFile);
-        priorities[dstFile] = priority;
-        symlinks++;
     }
+
+    return symlinks;
 }
 
 typedef std::set<Path> FileProp;
@@ -190,6 +208,8 @@ void builtinBuildenv(const BasicDerivation & drv)
         return i->second;
     };
 
+    auto startTime = std::chrono::steady_clock::now();
+
     out = getAttr("out");
     createDirs(out);
 
@@ -232,7 +252,12 @@ void builtinBuildenv(const BasicDerivation & drv)
             addPkg(pkgDir, priorityCounter++);
     }
 
-    printError("created %d symlinks in user environment", symlinks);
+    auto symlinks = writeTree();
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - startTime);
+
+    printError("created %d symlinks in user environment in %.3f s", symlinks, duration.count() / 1000.0);
 
     createSymlink(getAttr("manifest"), out + "/manifest.nix");
 }
@@ -8,6 +8,18 @@
 #include "archive.hh"
 #include "derivations.hh"
 #include "args.hh"
+#include "sync.hh"
+#include "compression.hh"
+
+#include <condition_variable>
+#include <cstring>
+#include <optional>
+#include <queue>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
 
 namespace nix::daemon {
 
@@ -30,7 +42,7 @@ Sink & operator << (Sink & sink, const Logger::Fields & fields)
    true). */
 struct TunnelLogger : public Logger
 {
-    FdSink & to;
+    BufferedSink & to;
 
     struct State
     {
@@ -42,7 +54,14 @@ struct TunnelLogger : public Logger
 
     unsigned int clientVersion;
 
-    TunnelLogger(FdSink & to, unsigned int clientVersion)
+    /* The verbosity requested by the client.  In threaded mode, this
+       can't be applied to the global `verbosity'. */
+    Verbosity clientVerbosity = lvlVomit;
+
+    /* Likewise for `settings.verboseBuild'. */
+    bool clientVerboseBuild = true;
+
+    TunnelLogger(BufferedSink & to, unsigned int clientVersion)
         : to(to), clientVersion(clientVersion) { }
 
     void enqueueMsg(const std::string & s)
@@ -66,7 +85,7 @@ struct TunnelLogger : public Logger
 
     void log(Verbosity lvl, const FormatOrString & fs) override
     {
-        if (lvl > verbosity) return;
+        if (lvl > verbosity || lvl > clientVerbosity) return;
 
         StringSink buf;
         buf << STDERR_NEXT << (fs.s + "\n");
@@ -135,6 +154,78 @@ struct TunnelLogger : public Logger
     }
 };
 
+/* In threaded mode, the global logger forwards to the logger of the
+   connection served by the current thread, or to the daemon's own
+   logger for threads that don't serve a connection. */
+struct ConnectionLogger : Logger
+{
+    Logger & fallback;
+
+    static thread_local Logger * current;
+
+    ConnectionLogger(Logger & fallback) : fallback(fallback) { }
+
+    Logger & get()
+    {
+        return current ? *current : fallback;
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        get().log(lvl, fs);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        get().warn(msg);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        get().startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        get().stopActivity(act);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        get().result(act, type, fields);
+    }
+};
+
+thread_local Logger * ConnectionLogger::current = nullptr;
+
+void initThreadedMode()
+{
+    logger = new ConnectionLogger(*logger);
+}
+
+/* Whether `op' depends on settings that the client can change.  In
+   threaded mode, such operations (builds and substitutions) can't run
+   in the daemon process, since settings are process-wide, as is much
+   of the build machinery (interruption, build users, handling of child
+   processes). */
+static bool usesClientSettings(unsigned int op)
+{
+    switch (op) {
+    case wopBuildPaths:
+    case wopBuildDerivation:
+    case wopEnsurePath:
+    case wopHasSubstitutes:
+    case wopQuerySubstitutablePaths:
+    case wopQuerySubstitutablePathInfo:
+    case wopQuerySubstitutablePathInfos:
+    case wopQueryMissing:
+        return true;
+    default:
+        return false;
+    }
+}
+
 struct TunnelSink : Sink
 {
     Sink & to;
@@ -161,6 +252,25 @@ struct TunnelSource : BufferedSource
     }
 };
 
+static std::string readCompressionMethod(Source & from)
+{
+    auto method = readString(from);
+    if (method != "" && !streamCompressionMethods().count(method))
+        throw Error("unsupported compression method '%s'", method);
+    return method;
+}
+
+/* Compressors for NARs sent to clients, shared between connections so
+   that the compression level carries over. */
+static StreamCompressor & getStreamCompressor(const std::string & method)
+{
+    static Sync<std::map<std::string, std::unique_ptr<StreamCompressor>>> compressors;
+    auto compressors_(compressors.lock());
+    auto & compressor = (*compressors_)[method];
+    if (!compressor) compressor = std::make_unique<StreamCompressor>(method);
+    return *compressor;
+}
+
 /* If the NAR archive contains a single file at top-level, then save
    the contents of the file to `s'.  Otherwise barf. */
 struct RetrieveRegularNARSink : ParseSink
@@ -187,9 +297,11 @@ struct RetrieveRegularNARSink : ParseSink
 };
 
 static void performOp(TunnelLogger * logger, ref<Store> store,
-    bool trusted, unsigned int clientVersion,
-    Source & from, BufferedSink & to, unsigned int op)
+    bool trusted, StringMap * clientSettings, unsigned int clientVersion,
+    const StringSet & extensions, Source & from, BufferedSink & to, unsigned int op)
 {
+    assert(!clientSettings || !usesClientSettings(op));
+
     switch (op) {
 
     case wopIsValidPath: {
@@ -464,18 +576,40 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
     }
 
     case wopSetOptions: {
-        settings.keepFailed = readInt(from);
-        settings.keepGoing = readInt(from);
-        settings.tryFallback = readInt(from);
-        verbosity = (Verbosity) readInt(from);
-        settings.maxBuildJobs.assign(readInt(from));
-        settings.maxSilentTime = readInt(from);
-        readInt(from); // obsolete useBuildHook
-        settings.verboseBuild = lvlError == (Verbosity) readInt(from);
-        readInt(from); // obsolete logType
-        readInt(from); // obsolete printBuildTrace
-        settings.buildCores = readInt(from);
-        settings.useSubstitutes  = readInt(from);
+        if (!clientSettings) {
+            settings.keepFailed = readInt(from);
+            settings.keepGoing = readInt(from);
+            settings.tryFallback = readInt(from);
+            verbosity = (Verbosity) readInt(from);
+            settings.maxBuildJobs.assign(readInt(from));
+            settings.maxSilentTime = readInt(from);
+            readInt(from); // obsolete useBuildHook
+            settings.verboseBuild = lvlError == (Verbosity) readInt(from);
+            readInt(from); // obsolete logType
+            readInt(from); // obsolete printBuildTrace
+            settings.buildCores = readInt(from);
+            settings.useSubstitutes  = readInt(from);
+        } else {
+            clientSettings->clear();
+            auto setBool = [&](Setting<bool> & setting) {
+                (*clientSettings)[setting.name] = readInt(from) ? "true" : "false";
+            };
+            auto setInt = [&](AbstractSetting & setting) {
+                (*clientSettings)[setting.name] = std::to_string(readInt(from));
+            };
+            setBool(settings.keepFailed);
+            setBool(settings.keepGoing);
+            setBool(settings.tryFallback);
+            logger->clientVerbosity = (Verbosity) readInt(from);
+            setInt(settings.maxBuildJobs);
+            setInt(settings.maxSilentTime);
+            readInt(from); // obsolete useBuildHook
+            logger->clientVerboseBuild = lvlError == (Verbosity) readInt(from);
+            readInt(from); // obsolete logType
+            readInt(from); // obsolete printBuildTrace
+            setInt(settings.buildCores);
+            setBool(settings.useSubstitutes);
+        }
 
         StringMap overrides;
         if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
@@ -506,7 +640,10 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
                         subs.push_back(s);
                     else
                         warn("ignoring untrusted substituter '%s'", s);
-                res = subs;
+                if (clientSettings)
+                    (*clientSettings)[res.name] = concatStringsSep(" ", subs);
+                else
+                    res = subs;
                 return true;
             };
 
@@ -517,7 +654,12 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
                     || name == settings.buildTimeout.name
                     || name == "connect-timeout"
                     || (name == "builders" && value == ""))
-                    settings.set(name, value);
+                {
+                    if (clientSettings)
+                        (*clientSettings)[name] = value;
+                    else
+                        settings.set(name, value);
+                }
                 else if (setSubstituters(settings.substituters))
                     ;
                 else if (setSubstituters(settings.extraSubstituters))
@@ -597,6 +739,61 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryPathInfos: {
+        auto paths = readStorePaths<PathSet>(*store, from);
+        logger->startWork();
+        auto infos = store->queryPathInfos(paths);
+        logger->stopWork();
+        to << infos.size();
+        for (auto & i : infos) {
+            auto & info(i.second);
+            to << i.first << info->deriver << info->narHash.to_string(Base16, false)
+               << info->references << info->registrationTime << info->narSize
+               << info->ultimate << info->sigs << info->ca;
+        }
+        break;
+    }
+
+    case wopQueryClosure: {
+        auto paths = readStorePaths<PathSet>(*store, from);
+        bool flipDirection, includeOutputs, includeDerivers;
+        from >> flipDirection >> includeOutputs >> includeDerivers;
+        logger->startWork();
+        PathSet closure;
+        store->computeFSClosure(paths, closure, flipDirection, includeOutputs, includeDerivers);
+        logger->stopWork();
+        to << closure;
+        break;
+    }
+
+    case wopQueryReferrersOfPaths: {
+        auto paths = readStorePaths<PathSet>(*store, from);
+        logger->startWork();
+        auto referrers = store->queryReferrersOfPaths(paths);
+        logger->stopWork();
+        to << referrers.size();
+        for (auto & i : referrers)
+            to << i.first << i.second;
+        break;
+    }
+
+    case wopQueryDrvHashesModulo: {
+        auto drvPaths = readStorePaths<PathSet>(*store, from);
+        logger->startWork();
+        /* Clients cannot register hashes, since a wrong one would give
+           other users wrong output paths.  So compute missing ones
+           here, which also records them. */
+        std::map<Path, Hash> hashes;
+        for (auto & drvPath : drvPaths)
+            if (isDerivation(drvPath) && store->isValidPath(drvPath))
+                hashes.emplace(drvPath, hashDerivationPathModulo(*store, drvPath));
+        logger->stopWork();
+        to << hashes.size();
+        for (auto & i : hashes)
+            to << i.first << i.second.to_string(Base16);
+        break;
+    }
+
     case wopOptimiseStore:
         logger->startWork();
         store->optimiseStore();
@@ -630,9 +827,15 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
 
     case wopNarFromPath: {
         auto path = readStorePath(*store, from);
+        std::string compression;
+        if (extensions.count("compression"))
+            compression = readCompressionMethod(from);
         logger->startWork();
         logger->stopWork();
-        dumpPath(path, to);
+        if (compression != "")
+            getStreamCompressor(compression)(to, [&](Sink & sink) { dumpPath(path, sink); });
+        else
+            dumpPath(path, to);
         break;
     }
 
@@ -652,12 +855,19 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
             dontCheckSigs = false;
         if (!trusted)
             info.ultimate = false;
+        std::string compression;
+        if (extensions.count("compression"))
+            compression = readCompressionMethod(from);
 
         std::string saved;
-        std::unique_ptr<Source> source;
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 21)
-            source = std::make_unique<TunnelSource>(from, to);
-        else {
+        std::unique_ptr<Source> tunnel, source;
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 21) {
+            tunnel = std::make_unique<TunnelSource>(from, to);
+            if (compression != "")
+                source = makeFramedDecompressionSource(compression, *tunnel);
+            else
+                source = std::move(tunnel);
+        } else {
             TeeSink tee(from);
             parseDump(tee, tee.source);
             saved = std::move(*tee.source.data);
@@ -669,6 +879,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         // FIXME: race if addToStore doesn't read source?
         store->addToStore(info, *source, (RepairFlag) repair,
             dontCheckSigs ? NoCheckSigs : CheckSigs, nullptr);
+        if (compression != "") source->drain();
 
         logger->stopWork();
         break;
@@ -690,6 +901,311 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
     }
 }
 
+/* Whether `op' may be sent over a multiplexed connection.  These are
+   the operations that only read the store and that don't stream data
+   to or from the client while they run. */
+static bool isMultiplexableOp(unsigned int op)
+{
+    switch (op) {
+    case wopIsValidPath:
+    case wopQueryValidPaths:
+    case wopQuerySubstitutablePaths:
+    case wopQueryPathInfo:
+    case wopQueryReferrers:
+    case wopQueryValidDerivers:
+    case wopQueryDerivationOutputs:
+    case wopQueryDerivationOutputNames:
+    case wopQueryPathFromHashPart:
+    case wopQuerySubstitutablePathInfos:
+    case wopQueryMissing:
+    case wopQueryPathInfos:
+    case wopQueryClosure:
+    case wopQueryReferrersOfPaths:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* A sink that collects a reply in memory. */
+struct ReplySink : BufferedSink
+{
+    std::string s;
+    void write(const unsigned char * data, size_t len) override
+    {
+        s.append((const char *) data, len);
+    }
+};
+
+/* Serve a connection in multiplexed mode (entered by wopMultiplex).
+   The client sends requests of the form `<id> <op> <args>', where
+   `args' is the serialisation of the operation's arguments.  Requests
+   are executed concurrently, and as each finishes, the daemon sends
+   `<id> <reply>', where `reply' is exactly what the operation would
+   have sent on a plain connection (i.e. stderr messages followed by
+   STDERR_LAST and the result, or by STDERR_ERROR).  Replies may thus
+   arrive in any order.  The client ends multiplexed mode by sending
+   the id 0; the daemon answers with 0 once all outstanding requests
+   have been answered, and the connection reverts to normal mode. */
+static void processMultiplexed(ref<Store> store, bool trusted,
+    StringMap * clientSettings, unsigned int clientVersion,
+    const StringSet & extensions, Source & from, FdSink & to)
+{
+    struct Request
+    {
+        uint64_t id;
+        unsigned int op;
+        std::string args;
+    };
+
+    struct State
+    {
+        std::queue<Request> queue;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::mutex writeLock;
+
+    auto worker = [&]() {
+        while (true) {
+            Request req;
+
+            {
+                auto state(state_.lock());
+                while (state->queue.empty() && !state->quit)
+                    state.wait(wakeup);
+                if (state->queue.empty()) return;
+                req = std::move(state->queue.front());
+                state->queue.pop();
+            }
+
+            ReplySink reply;
+            TunnelLogger logger(reply, clientVersion);
+
+            /* Messages logged by this request go into its reply. */
+            ConnectionLogger::current = &logger;
+
+            /* An operation may fail after it has started writing its
+               result, so on error, replace whatever it wrote by the
+               error. */
+            auto replyError = [&](const std::string & msg, unsigned int status) {
+                reply.flush();
+                reply.s.clear();
+                logger.stopWork(false, msg, status);
+            };
+
+            try {
+                if (!isMultiplexableOp(req.op) || (clientSettings && usesClientSettings(req.op)))
+                    throw Error("operation %d cannot be multiplexed", req.op);
+                StringSource source(req.args);
+                performOp(&logger, store, trusted, clientSettings, clientVersion, extensions, source, reply, req.op);
+            } catch (Error & e) {
+                replyError(e.msg(), e.status);
+            } catch (std::exception & e) {
+                replyError(e.what(), 1);
+            }
+
+            ConnectionLogger::current = nullptr;
+
+            reply.flush();
+
+            try {
+                std::lock_guard<std::mutex> lock(writeLock);
+                to << req.id << reply.s;
+                to.flush();
+            } catch (...) {
+                /* The client is gone; the reader will notice. */
+                ignoreException();
+            }
+        }
+    };
+
+    size_t nrWorkers = std::max(4U, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+
+    auto stopWorkers = [&]() {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thr : workers) thr.join();
+        workers.clear();
+    };
+
+    Finally cleanup(stopWorkers);
+
+    for (size_t n = 0; n < nrWorkers; ++n)
+        workers.emplace_back(worker);
+
+    while (true) {
+        Request req;
+        try {
+            req.id = readNum<uint64_t>(from);
+            if (req.id == 0) break;
+            req.op = readInt(from);
+            req.args = readString(from);
+        } catch (EndOfFile & e) {
+            return;
+        }
+        state_.lock()->queue.push(std::move(req));
+        wakeup.notify_one();
+    }
+
+    /* Wait for the outstanding requests before acknowledging the end
+       of multiplexed mode. */
+    stopWorkers();
+
+    to << 0;
+}
+
+#ifndef _WIN32
+static void handOffConnection(TunnelLogger * tunnelLogger, bool trusted,
+    const StringMap & clientSettings, unsigned int clientVersion,
+    const StringSet & extensions,
+    FdSource & from, FdSink & to, WorkerOp op);
+#endif
+
+/* Process client requests, starting with `pending' if set.  In
+   threaded mode (i.e. if `clientSettings' is set), the first
+   operation that uses the client's settings hands the connection over
+   to a separate process. */
+static void processOps(ref<Store> store, TunnelLogger * tunnelLogger,
+    bool trusted, StringMap * clientSettings, unsigned int clientVersion,
+    const StringSet & extensions, FdSource & from, FdSink & to, unsigned int & opCount,
+    std::optional<WorkerOp> pending)
+{
+    while (true) {
+        WorkerOp op;
+        if (pending) {
+            op = *pending;
+            pending.reset();
+        } else {
+            try {
+                op = (WorkerOp) readInt(from);
+            } catch (Interrupted & e) {
+                break;
+            } catch (EndOfFile & e) {
+                break;
+            }
+            opCount++;
+        }
+
+        if (op == wopMultiplex && extensions.count("multiplex")) {
+            tunnelLogger->startWork();
+            tunnelLogger->stopWork();
+            to.flush();
+            processMultiplexed(store, trusted, clientSettings, clientVersion, extensions, from, to);
+            to.flush();
+            continue;
+        }
+
+#ifndef _WIN32
+        if (clientSettings && usesClientSettings(op)) {
+            handOffConnection(tunnelLogger, trusted, *clientSettings, clientVersion, extensions, from, to, op);
+            break;
+        }
+#endif
+
+        try {
+            performOp(tunnelLogger, store, trusted, clientSettings, clientVersion, extensions, from, to, op);
+        } catch (Error & e) {
+            /* If we're not in a state where we can send replies, then
+               something went wrong processing the input of the
+               client.  This can happen especially if I/O errors occur
+               during addTextToStore() / importPath().  If that
+               happens, just send the error message and exit. */
+            bool errorAllowed = tunnelLogger->state_.lock()->canSendStderr;
+            tunnelLogger->stopWork(false, e.msg(), e.status);
+            if (!errorAllowed) throw;
+        } catch (std::bad_alloc & e) {
+            tunnelLogger->stopWork(false, "Nix daemon out of memory", 1);
+            throw;
+        }
+
+        to.flush();
+
+        assert(!tunnelLogger->state_.lock()->canSendStderr);
+    }
+}
+
+#ifndef _WIN32
+/* Serve the rest of a connection of the threaded daemon, starting with
+   `op', from a fresh `nix-daemon' process that applies the client's
+   settings, as the forking daemon does.  Forking this multithreaded
+   process is only safe if the child does nothing but exec, so the
+   state of the connection is sent to the new process through a pipe
+   (see resumeConnection()).  Returns once the connection has ended. */
+static void handOffConnection(TunnelLogger * tunnelLogger, bool trusted,
+    const StringMap & clientSettings, unsigned int clientVersion,
+    const StringSet & extensions,
+    FdSource & from, FdSink & to, WorkerOp op)
+{
+    /* Prepare everything the child needs before forking. */
+    Path program = settings.nixBinDir + "/nix-daemon";
+    Strings args = {"nix-daemon", "--resume-connection"};
+    auto argv = stringsToCharPtrs(args);
+
+    Pipe state;
+    state.create();
+
+    ProcessOptions options;
+    options.errorPrefix = "unexpected Nix daemon error: ";
+    options.dieWithParent = false;
+
+    Pid pid = startProcess([&]() {
+        if (setsid() == -1)
+            throw PosixError("creating a new session");
+        if (dup2(from.fd, STDIN_FILENO) == -1 || dup2(to.fd, STDOUT_FILENO) == -1)
+            throw PosixError("dupping connection");
+        if (state.readSide.get() == resumeStateFd) {
+            if (fcntl(resumeStateFd, F_SETFD, 0) == -1)
+                throw PosixError("clearing close-on-exec flag");
+        } else if (dup2(state.readSide.get(), resumeStateFd) == -1)
+            throw PosixError("dupping state pipe");
+        execv(program.c_str(), argv.data());
+        throw PosixError("executing '%1%'", program);
+    }, options);
+
+    state.readSide = -1;
+
+    try {
+        FdSink sink(state.writeSide.get());
+
+        /* Our own overridden settings, such as those from the command
+           line, followed by those of the client. */
+        std::map<std::string, Config::SettingInfo> daemonSettings;
+        globalConfig.getSettings(daemonSettings, true);
+        sink << daemonSettings.size();
+        for (auto & i : daemonSettings)
+            sink << i.first << i.second.value;
+        sink << clientSettings.size();
+        for (auto & i : clientSettings)
+            sink << i.first << i.second;
+
+        sink << clientVersion << extensions << trusted
+             << tunnelLogger->clientVerbosity << tunnelLogger->clientVerboseBuild
+             << op;
+
+        /* Messages logged since the last reply. */
+        auto pendingMsgs(tunnelLogger->state_.lock()->pendingMsgs);
+        sink << Strings(pendingMsgs.begin(), pendingMsgs.end());
+
+        /* The input that we've already read from the client. */
+        writeString(from.buffer.get() + from.bufPosOut, from.bufPosIn - from.bufPosOut, sink);
+
+        sink.flush();
+    } catch (SysError & e) {
+        /* The child died; its status is reported below. */
+    }
+
+    state.writeSide = -1;
+
+    int status = pid.wait();
+    if (status != 0)
+        printError("connection process %s", statusToString(status));
+}
+#endif
+
 void processConnection(
     ref<Store> store,
     FdSource & from,
@@ -699,10 +1215,15 @@ void processConnection(
 #ifndef _WIN32
     , uid_t userId
 #endif
-    )
+    , bool threaded)
 {
 #ifndef _WIN32
-    MonitorFdHup monitor(from.fd);
+    /* Interrupt the operation in progress if the client goes away.
+       Interruption is process-wide, so this can't be done in threaded
+       mode; there, a vanished client is noticed at the next write. */
+    std::unique_ptr<MonitorFdHup> monitor;
+    if (!threaded)
+        monitor = std::make_unique<MonitorFdHup>(from.fd);
 #endif
 
     /* Exchange the greeting. */
@@ -716,20 +1237,56 @@ void processConnection(
         throw Error("the Nix client version is too old");
 
     auto tunnelLogger = new TunnelLogger(to, clientVersion);
+    std::unique_ptr<TunnelLogger> tunnelLoggerOwner;
     auto prevLogger = nix::logger;
-    logger = tunnelLogger;
+
+    /* In threaded mode, the settings requested by the client. */
+    StringMap clientSettings;
+    auto clientSettingsPtr = threaded ? &clientSettings : nullptr;
+
+    /* Log through a ConnectionLogger, so that the requests of a
+       multiplexed connection can each log to their own reply.  In
+       forking mode, this process serves only this connection, so
+       other threads log to the connection. */
+    if (threaded) {
+        tunnelLoggerOwner.reset(tunnelLogger);
+        auto connectionLogger = dynamic_cast<ConnectionLogger *>(logger);
+        assert(connectionLogger);
+        prevLogger = &connectionLogger->fallback;
+    } else
+        logger = new ConnectionLogger(*tunnelLogger);
+
+    ConnectionLogger::current = tunnelLogger;
+
+#ifndef _WIN32
+    /* In threaded mode, the process outlives the connection, so the
+       temporary roots of the connection are kept apart and released
+       when it ends. */
+    std::shared_ptr<LocalStore::TempRootsFile> tempRoots;
+    if (threaded)
+        if (auto localStore = store.dynamic_pointer_cast<LocalStore>())
+            tempRoots = localStore->createTempRootsFile();
+    LocalStore::TempRootsScope tempRootsScope(tempRoots.get());
+#endif
 
     unsigned int opCount = 0;
 
     Finally finally([&]() {
-        _isInterrupted = false;
+        ConnectionLogger::current = nullptr;
+        if (!threaded)
+            _isInterrupted = false;
         prevLogger->log(lvlDebug, fmt("%d operations", opCount));
     });
 
-    if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from))
-        setAffinityTo(readInt(from));
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from)) {
+        auto cpu = readInt(from);
+        if (!threaded) setAffinityTo(cpu);
+    }
 
-    readInt(from); // obsolete reserveSpace
+    /* Clients that support protocol extensions send
+       WORKER_EXTENSIONS_MAGIC in place of the obsolete `reserveSpace'
+       flag. */
+    bool wantsExtensions = readInt(from) == WORKER_EXTENSIONS_MAGIC;
 
     /* Send startup error messages to the client. */
     tunnelLogger->startWork();
@@ -750,48 +1307,84 @@ void processConnection(
         store->createUser(userName, userId);
 #endif
 
+        /* Agree on the protocol extensions to use. */
+        StringSet extensions;
+        if (wantsExtensions) {
+            StringSet ours{"multiplex", "bulk-queries", "drv-hashes", "compression"};
+            for (auto & method : streamCompressionMethods())
+                ours.insert("compression:" + method);
+            TunnelSink sink(to);
+            sink << ours;
+            TunnelSource source(from, to);
+            for (auto & i : readStrings<StringSet>(source))
+                if (ours.count(i)) extensions.insert(i);
+        }
+
         tunnelLogger->stopWork();
         to.flush();
 
-        /* Process client requests. */
-        while (true) {
-            WorkerOp op;
-            try {
-                op = (WorkerOp) readInt(from);
-            } catch (Interrupted & e) {
-                break;
-            } catch (EndOfFile & e) {
-                break;
-            }
+        processOps(store, tunnelLogger, trusted, clientSettingsPtr, clientVersion, extensions, from, to, opCount, {});
 
-            opCount++;
+    } catch (std::exception & e) {
+        tunnelLogger->stopWork(false, e.what(), 1);
+        to.flush();
+        return;
+    }
+}
 
-            try {
-                performOp(tunnelLogger, store, trusted, clientVersion, from, to, op);
-            } catch (Error & e) {
-                /* If we're not in a state where we can send replies, then
-                   something went wrong processing the input of the
-                   client.  This can happen especially if I/O errors occur
-                   during addTextToStore() / importPath().  If that
-                   happens, just send the error message and exit. */
-                bool errorAllowed = tunnelLogger->state_.lock()->canSendStderr;
-                tunnelLogger->stopWork(false, e.msg(), e.status);
-                if (!errorAllowed) throw;
-            } catch (std::bad_alloc & e) {
-                tunnelLogger->stopWork(false, "Nix daemon out of memory", 1);
-                throw;
-            }
+#ifndef _WIN32
+void resumeConnection(FdSource & from, FdSink & to, Source & state)
+{
+    MonitorFdHup monitor(from.fd);
 
-            to.flush();
+    auto n = readNum<size_t>(state);
+    while (n--) {
+        auto name = readString(state);
+        auto value = readString(state);
+        globalConfig.set(name, value);
+    }
+
+    n = readNum<size_t>(state);
+    while (n--) {
+        auto name = readString(state);
+        auto value = readString(state);
+        try {
+            settings.set(name, value);
+        } catch (UsageError & e) {
+            warn(e.what());
+        }
+    }
 
-            assert(!tunnelLogger->state_.lock()->canSendStderr);
-        };
+    unsigned int clientVersion = readInt(state);
+    auto extensions = readStrings<StringSet>(state);
+    bool trusted = readInt(state);
+    verbosity = (Verbosity) readInt(state);
+    settings.verboseBuild = readInt(state);
+    auto op = (WorkerOp) readInt(state);
+    auto pendingMsgs = readStrings<Strings>(state);
+    auto input = readString(state);
+
+    assert(input.size() <= from.bufSize);
+    from.buffer = decltype(from.buffer)(new unsigned char[from.bufSize]);
+    memcpy(from.buffer.get(), input.data(), input.size());
+    from.bufPosIn = input.size();
+    from.bufPosOut = 0;
 
+    auto tunnelLogger = new TunnelLogger(to, clientVersion);
+    tunnelLogger->state_.lock()->pendingMsgs = {pendingMsgs.begin(), pendingMsgs.end()};
+    logger = new ConnectionLogger(*tunnelLogger);
+    ConnectionLogger::current = tunnelLogger;
+
+    unsigned int opCount = 0;
+
+    try {
+        processOps(openStore(settings.storeUri, {{"path-info-cache-size", "0"}}),
+            tunnelLogger, trusted, nullptr, clientVersion, extensions, from, to, opCount, op);
     } catch (std::exception & e) {
         tunnelLogger->stopWork(false, e.what(), 1);
         to.flush();
-        return;
     }
 }
+#endif
 
 }
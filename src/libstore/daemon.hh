@@ -3,6 +3,12 @@
 
 namespace nix::daemon {
 
+/* Serve a client connection.  If `threaded' is set, several
+   connections may be served concurrently by threads of this process
+   sharing `store', so process-wide state (the global logger, settings,
+   interrupt flag and CPU affinity) is left alone; the first build or
+   substitution hands the connection over to a forked process.  This
+   requires initThreadedMode() to have been called. */
 void processConnection(
     ref<Store> store,
     FdSource & from,
@@ -12,6 +18,19 @@ void processConnection(
 #ifndef _WIN32
     , uid_t userId
 #endif
-    );
+    , bool threaded = false);
+
+/* Prepare for calls to processConnection() in threaded mode. */
+void initThreadedMode();
+
+#ifndef _WIN32
+/* The file descriptor from which `nix-daemon --resume-connection'
+   reads the state of a connection handed off by a threaded daemon. */
+constexpr int resumeStateFd = 3;
+
+/* Serve the rest of a connection handed off by a threaded daemon,
+   given the state of the connection read from `state'. */
+void resumeConnection(FdSource & from, FdSink & to, Source & state);
+#endif
 
 }
@@ -4,7 +4,10 @@
 #include "util.hh"
 #include "worker-protocol.hh"
 #include "fs-accessor.hh"
-#include "istringstream_nocopy.hh"
+#include "lru-cache.hh"
+#include "sync.hh"
+
+#include <string_view>
 
 namespace nix {
 
@@ -42,8 +45,7 @@ bool BasicDerivation::isBuiltin() const
 }
 
 
-Path writeDerivation(ref<Store> store,
-    const Derivation & drv, const string & name, RepairFlag repair)
+static PathSet derivationReferences(const Derivation & drv)
 {
     PathSet references;
     references.insert(drv.inputSrcs.begin(), drv.inputSrcs.end());
@@ -52,153 +54,351 @@ Path writeDerivation(ref<Store> store,
     /* Note that the outputs of a derivation are *not* references
        (that can be missing (of course) and should not necessarily be
        held during a garbage collection). */
+    return references;
+}
+
+
+Path writeDerivation(ref<Store> store,
+    const Derivation & drv, const string & name, RepairFlag repair)
+{
+    PathSet references = derivationReferences(drv);
     string suffix = name + drvExtension;
     string contents = drv.unparse();
-    return settings.readOnlyMode
+    Path drvPath = settings.readOnlyMode
         ? store->computeStorePathForText(suffix, contents, references)
         : store->addTextToStore(suffix, contents, references, repair);
+
+    /* Record the hash of the new derivation, so that derivations that
+       depend on it don't have to read it back.  This is required in
+       read-only mode, because in that case we don't actually write
+       store derivations, so we can't read them later. */
+    Hash h = hashDerivationModulo(*store, drv);
+    drvHashes.lock()->insert_or_assign(drvPath, h);
+    if (!settings.readOnlyMode)
+        store->registerDrvHashModulo(drvPath, h);
+
+    return drvPath;
 }
 
 
-/* Read string `s' from stream `str'. */
-static void expect(std::istream & str, const string & s)
+DerivationWriter::DerivationWriter(ref<Store> store, size_t maxThreads)
+    : store(store)
+    , maxThreads(std::max((size_t) 1, maxThreads))
 {
-#ifdef _MSC_VER
-    char * s2 = static_cast<char *>(alloca(s.size()));
-#else
-    char s2[s.size()];
-#endif
-    str.read(s2, s.size());
-    if (string(s2, s.size()) != s)
-        throw FormatError(format("expected string '%1%'") % s);
 }
 
 
-/* Read a C-style string from stream `str'. */
-static string parseString(std::istream & str)
+DerivationWriter::~DerivationWriter()
 {
-    string res;
-    expect(str, "\"");
-    int c;
-    while ((c = str.get()) != '"')
-        if (c == '\\') {
-            c = str.get();
-            if (c == 'n') res += '\n';
-            else if (c == 'r') res += '\r';
-            else if (c == 't') res += '\t';
-            else res += c;
+    state_.lock()->quit = true;
+    wakeup.notify_all();
+    for (auto & thr : workers) thr.join();
+
+    auto state(state_.lock());
+    if (state->exc) {
+        try {
+            std::rethrow_exception(state->exc);
+        } catch (...) {
+            ignoreException();
         }
-        else res += c;
-    return res;
+    }
 }
 
 
-static Path parsePath(std::istream & str)
+Path DerivationWriter::write(const Derivation & drv, const string & name)
 {
-    string s = parseString(str);
-#ifndef _WIN32
-    if (s.size() == 0 || s[0] != '/')
-#else
-    if (s.size() < 3 || !('A' <= s[0] && s[0] <= 'Z') || s[1] != ':' || s[2] != '/') // expect result of canonPath
-#endif
-        throw FormatError(format("bad path '%1%' in derivation") % s);
-    return s;
+    Item item;
+    item.name = name + drvExtension;
+    item.contents = drv.unparse();
+    item.references = derivationReferences(drv);
+    item.path = store->computeStorePathForText(item.name, item.contents, item.references);
+
+    /* The hash of the derivation is needed by derivations that depend
+       on it, which shouldn't have to wait for it to be written. */
+    item.hash = hashDerivationModulo(*store, drv);
+    drvHashes.lock()->insert_or_assign(item.path, item.hash);
+
+    Path path = item.path;
+
+    {
+        auto state(state_.lock());
+        if (!state->queued.insert(path).second) return path;
+        state->pending.insert(path);
+        state->queue.push_back(std::move(item));
+        if (workers.size() < std::min(maxThreads, state->queue.size()))
+            workers.emplace_back(&DerivationWriter::worker, this);
+    }
+
+    wakeup.notify_one();
+
+    return path;
 }
 
 
-static bool endOfList(std::istream & str)
+void DerivationWriter::worker()
 {
-    if (str.peek() == ',') {
-        str.get();
-        return false;
+    while (true) {
+        Item item;
+
+        {
+            auto state(state_.lock());
+            while (!state->quit && state->queue.empty())
+                state.wait(wakeup);
+            if (state->queue.empty()) return;
+            item = std::move(state->queue.front());
+            state->queue.pop_front();
+
+            /* Wait for the derivations that this one refers to.  They
+               were queued earlier, so they're already being written
+               by other threads. */
+            while (std::any_of(item.references.begin(), item.references.end(),
+                    [&](const Path & ref) { return state->pending.count(ref); }))
+                state.wait(written);
+        }
+
+        try {
+            store->addTextToStore(item.name, item.contents, item.references);
+            store->registerDrvHashModulo(item.path, item.hash);
+        } catch (...) {
+            auto state(state_.lock());
+            if (!state->exc) state->exc = std::current_exception();
+        }
+
+        state_.lock()->pending.erase(item.path);
+        written.notify_all();
     }
-    if (str.peek() == ']') {
-        str.get();
-        return true;
+}
+
+
+void DerivationWriter::flush()
+{
+    auto state(state_.lock());
+    while (!state->pending.empty())
+        state.wait(written);
+    if (state->exc) {
+        auto exc = state->exc;
+        state->exc = nullptr;
+        std::rethrow_exception(exc);
     }
-    return false;
 }
 
 
-static StringSet parseStrings(std::istream & str, bool arePaths)
+bool DerivationWriter::isPending(const Path & path)
 {
-    StringSet res;
-    while (!endOfList(str))
-        res.insert(arePaths ? parsePath(str) : parseString(str));
-    return res;
+    return state_.lock()->pending.count(path);
 }
 
 
-static Derivation parseDerivation(const string & s)
+/* A single-pass parser of derivations in ATerm format, working on the
+   contents in place. */
+struct DerivationParser
+{
+    const char * pos;
+    const char * const end;
+
+    DerivationParser(std::string_view s) : pos(s.data()), end(s.data() + s.size()) { }
+
+    [[noreturn]] void unexpectedEnd()
+    {
+        throw FormatError("unexpected end of derivation");
+    }
+
+    void expect(char c)
+    {
+        if (pos == end) unexpectedEnd();
+        if (*pos != c)
+            throw FormatError(format("expected string '%1%'") % c);
+        pos++;
+    }
+
+    void expect(std::string_view s)
+    {
+        if ((size_t) (end - pos) < s.size() || std::string_view(pos, s.size()) != s)
+            throw FormatError(format("expected string '%1%'") % s);
+        pos += s.size();
+    }
+
+    /* Parse a C-style string. */
+    string parseString()
+    {
+        expect('"');
+
+        /* Most strings have no escapes, so they can be copied in one
+           go. */
+        const char * start = pos;
+        while (pos != end && *pos != '"' && *pos != '\\') pos++;
+        if (pos == end) unexpectedEnd();
+        string res(start, pos - start);
+        if (*pos == '"') {
+            pos++;
+            return res;
+        }
+
+        while (true) {
+            if (pos == end) unexpectedEnd();
+            char c = *pos++;
+            if (c == '"') break;
+            if (c == '\\') {
+                if (pos == end) unexpectedEnd();
+                c = *pos++;
+                if (c == 'n') res += '\n';
+                else if (c == 'r') res += '\r';
+                else if (c == 't') res += '\t';
+                else res += c;
+            }
+            else res += c;
+        }
+
+        return res;
+    }
+
+    Path parsePath()
+    {
+        string s = parseString();
+#ifndef _WIN32
+        if (s.size() == 0 || s[0] != '/')
+#else
+        if (s.size() < 3 || !('A' <= s[0] && s[0] <= 'Z') || s[1] != ':' || s[2] != '/') // expect result of canonPath
+#endif
+            throw FormatError(format("bad path '%1%' in derivation") % s);
+        return s;
+    }
+
+    bool endOfList()
+    {
+        if (pos == end) unexpectedEnd();
+        if (*pos == ',') {
+            pos++;
+            return false;
+        }
+        if (*pos == ']') {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    StringSet parseStrings(bool arePaths)
+    {
+        StringSet res;
+        while (!endOfList())
+            res.insert(res.end(), arePaths ? parsePath() : parseString());
+        return res;
+    }
+};
+
+
+static Derivation parseDerivation(std::string_view s)
 {
     Derivation drv;
-    istringstream_nocopy str(s);
-    expect(str, "Derive([");
+    DerivationParser str(s);
+    str.expect("Derive([");
 
     /* Parse the list of outputs. */
-    while (!endOfList(str)) {
+    while (!str.endOfList()) {
         DerivationOutput out;
-        expect(str, "("); string id = parseString(str);
-        expect(str, ","); out.path = parsePath(str);
-        expect(str, ","); out.hashAlgo = parseString(str);
-        expect(str, ","); out.hash = parseString(str);
-        expect(str, ")");
-        drv.outputs[id] = out;
+        str.expect('('); string id = str.parseString();
+        str.expect(','); out.path = str.parsePath();
+        str.expect(','); out.hashAlgo = str.parseString();
+        str.expect(','); out.hash = str.parseString();
+        str.expect(')');
+        drv.outputs.insert_or_assign(drv.outputs.end(), std::move(id), std::move(out));
     }
 
     /* Parse the list of input derivations. */
-    expect(str, ",[");
-    while (!endOfList(str)) {
-        expect(str, "(");
-        Path drvPath = parsePath(str);
-        expect(str, ",[");
-        drv.inputDrvs[drvPath] = parseStrings(str, false);
-        expect(str, ")");
+    str.expect(",[");
+    while (!str.endOfList()) {
+        str.expect('(');
+        Path drvPath = str.parsePath();
+        str.expect(",[");
+        drv.inputDrvs.insert_or_assign(drv.inputDrvs.end(), std::move(drvPath), str.parseStrings(false));
+        str.expect(')');
     }
 
-    expect(str, ",["); drv.inputSrcs = parseStrings(str, true);
-    expect(str, ","); drv.platform = parseString(str);
-    expect(str, ","); drv.builder = parseString(str);
+    str.expect(",["); drv.inputSrcs = str.parseStrings(true);
+    str.expect(','); drv.platform = str.parseString();
+    str.expect(','); drv.builder = str.parseString();
 
     /* Parse the builder arguments. */
-    expect(str, ",[");
-    while (!endOfList(str))
-        drv.args.push_back(parseString(str));
+    str.expect(",[");
+    while (!str.endOfList())
+        drv.args.push_back(str.parseString());
 
     /* Parse the environment variables. */
-    expect(str, ",[");
-    while (!endOfList(str)) {
-        expect(str, "("); string name = parseString(str);
-        expect(str, ","); string value = parseString(str);
-        expect(str, ")");
-        drv.env[name] = value;
+    str.expect(",[");
+    while (!str.endOfList()) {
+        str.expect('('); string name = str.parseString();
+        str.expect(','); string value = str.parseString();
+        str.expect(')');
+        drv.env.insert_or_assign(drv.env.end(), std::move(name), std::move(value));
     }
 
-    expect(str, ")");
+    str.expect(')');
     return drv;
 }
 
 
-Derivation readDerivation(const Path & drvPath)
+/* Parsed derivations, keyed by path.  Since the name of a derivation
+   in the store is determined by its contents, they only change when a
+   corrupted derivation is repaired. */
+static Sync<LRUCache<Path, std::shared_ptr<const Derivation>>> derivationCache(16384);
+
+
+static std::shared_ptr<const Derivation> parseDerivationCached(const Path & drvPath, std::function<string()> readContents)
 {
+    {
+        auto cache(derivationCache.lock());
+        auto drv = cache->get(drvPath);
+        if (drv) return *drv;
+    }
+
+    std::shared_ptr<const Derivation> drv;
     try {
-        return parseDerivation(readFile(drvPath));
+        drv = std::make_shared<const Derivation>(parseDerivation(readContents()));
     } catch (FormatError & e) {
         throw Error(format("error parsing derivation '%1%': %2%") % drvPath % e.msg());
     }
+
+    derivationCache.lock()->upsert(drvPath, drv);
+    return drv;
 }
 
 
-Derivation Store::derivationFromPath(const Path & drvPath)
+std::shared_ptr<const Derivation> readSharedDerivation(const Path & drvPath)
+{
+    return parseDerivationCached(drvPath, [&]() { return readFile(drvPath); });
+}
+
+
+std::shared_ptr<const Derivation> readSharedDerivation(const Path & drvPath, const Path & realPath)
+{
+    return parseDerivationCached(drvPath, [&]() { return readFile(realPath); });
+}
+
+
+Derivation readDerivation(const Path & drvPath)
+{
+    return *readSharedDerivation(drvPath);
+}
+
+
+void invalidateDerivationCache(const Path & drvPath)
+{
+    derivationCache.lock()->erase(drvPath);
+}
+
+
+std::shared_ptr<const Derivation> Store::sharedDerivationFromPath(const Path & drvPath)
 {
     assertStorePath(drvPath);
     ensurePath(drvPath);
-    auto accessor = getFSAccessor();
-    try {
-        return parseDerivation(accessor->readFile(drvPath));
-    } catch (FormatError & e) {
-        throw Error(format("error parsing derivation '%1%': %2%") % drvPath % e.msg());
-    }
+    return parseDerivationCached(drvPath, [&]() { return getFSAccessor()->readFile(drvPath); });
+}
+
+
+Derivation Store::derivationFromPath(const Path & drvPath)
+{
+    return *sharedDerivationFromPath(drvPath);
 }
 
 
@@ -289,7 +489,7 @@ bool BasicDerivation::isFixedOutput() const
 }
 
 
-DrvHashes drvHashes;
+Sync<DrvHashes> drvHashes;
 
 
 /* Returns the hash of a derivation modulo fixed-output
@@ -323,17 +523,26 @@ Hash hashDerivationModulo(Store & store, Derivation drv)
             + i->second.path);
     }
 
+    /* Ask the store for the hashes of the inputs that it has recorded
+       all at once, rather than one round trip per input. */
+    PathSet unknown;
+    {
+        auto drvHashes_(drvHashes.lock());
+        for (auto & i : drv.inputDrvs)
+            if (!drvHashes_->count(i.first)) unknown.insert(i.first);
+    }
+    if (unknown.size() > 1) {
+        auto known = store.queryDrvHashesModulo(unknown);
+        auto drvHashes_(drvHashes.lock());
+        for (auto & i : known)
+            drvHashes_->insert_or_assign(i.first, i.second);
+    }
+
     /* For other derivations, replace the inputs paths with recursive
        calls to this function.*/
     DerivationInputs inputs2;
     for (auto & i : drv.inputDrvs) {
-        Hash h = drvHashes[i.first];
-        if (!h) {
-            assert(store.isValidPath(i.first));
-            Derivation drv2 = readDerivation(store.toRealPath(i.first));
-            h = hashDerivationModulo(store, drv2);
-            drvHashes[i.first] = h;
-        }
+        Hash h = hashDerivationPathModulo(store, i.first);
         inputs2[h.to_string(Base16, false)] = i.second;
     }
     drv.inputDrvs = inputs2;
@@ -342,6 +551,32 @@ Hash hashDerivationModulo(Store & store, Derivation drv)
 }
 
 
+Hash hashDerivationPathModulo(Store & store, const Path & drvPath)
+{
+    {
+        auto drvHashes_(drvHashes.lock());
+        auto i = drvHashes_->find(drvPath);
+        if (i != drvHashes_->end()) return i->second;
+    }
+
+    /* The store may have recorded the hash in a previous process, in
+       which case we don't need to read the derivation and its
+       closure. */
+    std::optional<Hash> h;
+    auto known = store.queryDrvHashesModulo({drvPath});
+    if (!known.empty()) h = known.begin()->second;
+
+    if (!h) {
+        assert(store.isValidPath(drvPath));
+        h = hashDerivationModulo(store, *readSharedDerivation(drvPath, store.toRealPath(drvPath)));
+        store.registerDrvHashModulo(drvPath, *h);
+    }
+
+    drvHashes.lock()->insert_or_assign(drvPath, *h);
+    return *h;
+}
+
+
 DrvPathWithOutputs parseDrvPathWithOutputs(const string & s)
 {
     size_t n = s.find("!");
@@ -3,8 +3,12 @@
 #include "types.hh"
 #include "hash.hh"
 #include "store-api.hh"
+#include "sync.hh"
 
 #include <map>
+#include <deque>
+#include <thread>
+#include <condition_variable>
 
 
 namespace nix {
@@ -82,19 +86,97 @@ class Store;
 Path writeDerivation(ref<Store> store,
     const Derivation & drv, const string & name, RepairFlag repair = NoRepair);
 
+/* Writes derivations to the store in the background.  Since store
+   derivations are content-addressed, their paths can be computed
+   without waiting for the store.  A derivation is written only after
+   the queued derivations it refers to, so the store never sees
+   dangling references. */
+class DerivationWriter
+{
+public:
+
+    DerivationWriter(ref<Store> store, size_t maxThreads = 4);
+
+    /* Waits for the queued derivations to be written. */
+    ~DerivationWriter();
+
+    /* Queue `drv' for writing and return its path. */
+    Path write(const Derivation & drv, const string & name);
+
+    /* Wait until every queued derivation has been written, and
+       rethrow the first error that occurred, if any. */
+    void flush();
+
+    /* Whether `path' was queued but has not been written yet. */
+    bool isPending(const Path & path);
+
+private:
+
+    ref<Store> store;
+
+    size_t maxThreads;
+
+    struct Item
+    {
+        Path path;
+        string name;
+        string contents;
+        PathSet references;
+        Hash hash;
+    };
+
+    struct State
+    {
+        std::deque<Item> queue;
+
+        /* Paths that are in `queue' or being written. */
+        PathSet pending;
+
+        /* All paths ever queued. */
+        PathSet queued;
+
+        std::exception_ptr exc;
+
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup, written;
+
+    std::vector<std::thread> workers;
+
+    void worker();
+};
+
 /* Read a derivation from a file. */
 Derivation readDerivation(const Path & drvPath);
 
+/* Like readDerivation(), but without copying the cached parse. */
+std::shared_ptr<const Derivation> readSharedDerivation(const Path & drvPath);
+
+/* Like readSharedDerivation(), but read the store derivation
+   `drvPath' from `realPath' (its location in a chroot store), caching
+   it under `drvPath'. */
+std::shared_ptr<const Derivation> readSharedDerivation(const Path & drvPath, const Path & realPath);
+
+/* Forget the cached parse of `drvPath', e.g. after it was repaired. */
+void invalidateDerivationCache(const Path & drvPath);
+
 /* Check whether a file name ends with the extension for
    derivations. */
 bool isDerivation(const string & fileName);
 
 Hash hashDerivationModulo(Store & store, Derivation drv);
 
+/* Return hashDerivationModulo() of the valid derivation `drvPath',
+   memoised in `drvHashes' and in the store. */
+Hash hashDerivationPathModulo(Store & store, const Path & drvPath);
+
 /* Memoisation of hashDerivationModulo(). */
 typedef std::map<Path, Hash> DrvHashes;
 
-extern DrvHashes drvHashes; // FIXME: global, not thread-safe
+extern Sync<DrvHashes> drvHashes;
 
 /* Split a string specifying a derivation and a set of outputs
    (/nix/store/hash-foo!out1,out2,...) into the derivation path and
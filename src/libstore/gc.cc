@@ -2,12 +2,15 @@
 #include "globals.hh"
 #include "local-store.hh"
 #include "finally.hh"
+#include "profiles.hh"
+#include "thread-pool.hh"
 
 #include <functional>
 #include <queue>
 #include <algorithm>
-#include <regex>
 #include <random>
+#include <chrono>
+#include <cstring>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -201,60 +204,130 @@ Path LocalFSStore::addPermRoot(const Path & _storePath,
 }
 
 
-void LocalStore::addTempRoot(const Path & path)
+#ifndef _WIN32
+AutoCloseFD LocalStore::openTempRootsFile(const Path & fnTempRoots)
+#else
+AutoCloseWindowsHandle LocalStore::openTempRootsFile(const Path & fnTempRoots)
+#endif
 {
-    auto state(_state.lock());
-
-    /* Create the temporary roots file for this process. */
-    if (!state->fdTempRoots) {
-
-        while (1) {
+    while (1) {
 #ifndef _WIN32
-            AutoCloseFD fdGCLock = openGCLock(ltRead);
+        AutoCloseFD fdGCLock = openGCLock(ltRead);
 #else
-            AutoCloseWindowsHandle fdGCLock = openGCLock(ltRead);
+        AutoCloseWindowsHandle fdGCLock = openGCLock(ltRead);
 #endif
-            if (pathExists(fnTempRoots))
-                /* It *must* be stale, since there can be no two
-                   processes with the same pid. */
-                unlink(fnTempRoots.c_str());
+        if (pathExists(fnTempRoots))
+            /* It *must* be stale, since there can be no two
+               processes with the same pid. */
+            unlink(fnTempRoots.c_str());
 
-            state->fdTempRoots = openLockFile(fnTempRoots, true);
+        auto fdTempRoots = openLockFile(fnTempRoots, true);
 #ifndef _WIN32
-            fdGCLock = -1;
-
-            debug(format("acquiring read lock on '%1%'") % fnTempRoots);
-            lockFile(state->fdTempRoots.get(), ltRead, true);
-            /* Check whether the garbage collector didn't get in our
-               way. */
-            struct stat st;
-            if (fstat(state->fdTempRoots.get(), &st) == -1)
-                throw PosixError(format("statting '%1%'") % fnTempRoots);
-            if (st.st_size == 0) break;
-
-            /* The garbage collector deleted this file before we could
-               get a lock.  (It won't delete the file after we get a
-               lock.)  Try again.
-
-               It should not be the case on Windows because other process would fail deleting the file.
-               Perhaps GCLock is not needed here too
-             */
+        fdGCLock = -1;
+
+        debug(format("acquiring read lock on '%1%'") % fnTempRoots);
+        lockFile(fdTempRoots.get(), ltRead, true);
+        /* Check whether the garbage collector didn't get in our
+           way. */
+        struct stat st;
+        if (fstat(fdTempRoots.get(), &st) == -1)
+            throw PosixError(format("statting '%1%'") % fnTempRoots);
+        if (st.st_size == 0) return fdTempRoots;
+
+        /* The garbage collector deleted this file before we could
+           get a lock.  (It won't delete the file after we get a
+           lock.)  Try again.
+
+           It should not be the case on Windows because other process would fail deleting the file.
+           Perhaps GCLock is not needed here too
+         */
 #else
-            fdGCLock = INVALID_HANDLE_VALUE;
+        fdGCLock = INVALID_HANDLE_VALUE;
 
-            debug(format("acquiring read lock on '%1%'") % fnTempRoots);
-            assert(lockFile(state->fdTempRoots.get(), ltRead, true));
-            break;
+        debug(format("acquiring read lock on '%1%'") % fnTempRoots);
+        assert(lockFile(fdTempRoots.get(), ltRead, true));
+        return fdTempRoots;
 #endif
+    }
+}
+
+
+#ifndef _WIN32
+struct LocalStore::TempRootsFile
+{
+    LocalStore & store;
+    Path path;
+    std::mutex lock;
+    AutoCloseFD fd;
+
+    TempRootsFile(LocalStore & store, const Path & path)
+        : store(store), path(path) { }
+
+    ~TempRootsFile()
+    {
+        if (fd) {
+            fd = -1;
+            unlink(path.c_str());
         }
     }
+};
+
+
+static thread_local LocalStore::TempRootsFile * currentTempRootsFile = nullptr;
+
+
+std::shared_ptr<LocalStore::TempRootsFile> LocalStore::createTempRootsFile()
+{
+    static std::atomic<uint64_t> counter{0};
+    return std::make_shared<TempRootsFile>(*this,
+        fmt("%s-%d", fnTempRoots, ++counter));
+}
+
+
+LocalStore::TempRootsScope::TempRootsScope(TempRootsFile * file)
+    : prev(currentTempRootsFile)
+{
+    if (file) currentTempRootsFile = file;
+}
+
+
+LocalStore::TempRootsScope::~TempRootsScope()
+{
+    currentTempRootsFile = prev;
+}
+#endif
+
+
+void LocalStore::addTempRoot(const Path & path)
+{
+    string s = path + '\0';
+
+#ifndef _WIN32
+    /* The file is created lazily, since most clients never add a
+       temporary root.  It is named after the process's file, so the
+       garbage collector attributes it to this process. */
+    auto file = currentTempRootsFile;
+    if (file && &file->store == this) {
+        std::lock_guard<std::mutex> lock(file->lock);
+        if (!file->fd) file->fd = openTempRootsFile(file->path);
+        lockFile(file->fd.get(), ltWrite, true);
+        writeFull(file->fd.get(), s);
+        lockFile(file->fd.get(), ltRead, true);
+        return;
+    }
+#endif
+
+    auto state(_state.lock());
+
+    /* Create the temporary roots file for this process. */
+    if (!state->fdTempRoots)
+        state->fdTempRoots = openTempRootsFile(fnTempRoots);
 
     /* Upgrade the lock to a write lock.  This will cause us to block
        if the garbage collector is holding our lock. */
     debug(format("acquiring write lock on '%1%'") % fnTempRoots);
     lockFile(state->fdTempRoots.get(), ltWrite, true);
 
-    string s = path + '\0';
     writeFull(state->fdTempRoots.get(), s);
 
     /* Downgrade to a read lock. */
@@ -322,7 +395,175 @@ void LocalStore::findTempRoots(FDs & fds, Roots & tempRoots, bool censor)
 #endif
 
 
-void LocalStore::findRoots(const Path & path, unsigned char type, Roots & roots)
+/* A cache of the directories read while looking for GC roots, kept
+   in `<stateDir>/gc-roots-cache' between runs.  Symlinks can't be
+   changed in place, only created, removed or renamed, all of which
+   update the status change time of their directory.  Unlike the
+   modification time, that can't be set by utimes().  So what we know
+   about the entries of a directory stays valid as long as its device,
+   inode and ctime are unchanged, and a GC run only has to stat() the
+   directories it visits instead of reading every root again.
+   Directories changed in the same second as the scan started are not
+   stored, since on file systems with coarse timestamps they could
+   change again without their ctime changing. */
+struct RootsCache
+{
+    struct Entry
+    {
+        bool exists = false;
+        unsigned char type = DT_UNKNOWN;
+        Path target; /* for symlinks, once read */
+    };
+
+    struct Dir
+    {
+        uint64_t dev = 0, ino = 0, ctime = 0;
+        bool listed = false; /* whether `entries' has every entry */
+        bool persist = false;
+        std::map<string, Entry> entries;
+    };
+
+    Path cacheFile;
+    time_t startTime;
+    std::map<Path, Dir> dirs;
+    std::set<Path> checked;
+
+    RootsCache(const Path & cacheFile)
+        : cacheFile(cacheFile), startTime(time(0))
+    {
+        try {
+            auto contents = readFile(cacheFile);
+            StringSource source(contents);
+            if (readNum<unsigned int>(source) != 2) return;
+            auto nrDirs = readNum<uint64_t>(source);
+            for (uint64_t n = 0; n < nrDirs; n++) {
+                auto & dir = dirs[readString(source)];
+                dir.dev = readNum<uint64_t>(source);
+                dir.ino = readNum<uint64_t>(source);
+                dir.ctime = readNum<uint64_t>(source);
+                dir.listed = readNum<unsigned int>(source);
+                auto nrEntries = readNum<uint64_t>(source);
+                for (uint64_t m = 0; m < nrEntries; m++) {
+                    auto & entry = dir.entries[readString(source)];
+                    entry.exists = readNum<unsigned int>(source);
+                    entry.type = readNum<unsigned int>(source);
+                    entry.target = readString(source);
+                }
+            }
+        } catch (Error & e) {
+            dirs.clear();
+        }
+    }
+
+    void save()
+    {
+        StringSink sink;
+        uint64_t nrDirs = 0;
+        for (auto & i : dirs)
+            if (i.second.persist) nrDirs++;
+        sink << 2 << nrDirs;
+        for (auto & i : dirs) {
+            if (!i.second.persist) continue;
+            sink << i.first << i.second.dev << i.second.ino << i.second.ctime
+                 << i.second.listed << i.second.entries.size();
+            for (auto & j : i.second.entries)
+                sink << j.first << j.second.exists << j.second.type << j.second.target;
+        }
+
+        try {
+#ifndef _WIN32
+            Path tmpFile = fmt("%s.tmp.%d", cacheFile, getpid());
+#else
+            Path tmpFile = fmt("%s.tmp.%d", cacheFile, GetCurrentProcessId());
+#endif
+            writeFile(tmpFile, *sink.s);
+#ifndef _WIN32
+            if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+                throw PosixError("cannot rename '%s' to '%s'", tmpFile, cacheFile);
+#else
+            if (!MoveFileExW(pathW(tmpFile).c_str(), pathW(cacheFile).c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+                throw WinError("MoveFileExW '%1%' '%2%'", tmpFile, cacheFile);
+#endif
+        } catch (Error & e) {
+            debug("cannot write GC roots cache '%s': %s", cacheFile, e.msg());
+        }
+    }
+
+    /* Return the cached state of directory `path', discarding it if
+       the directory has changed.  Returns nullptr if `path' is not a
+       directory. */
+    Dir * getDir(const Path & path)
+    {
+        if (!checked.insert(path).second) {
+            auto i = dirs.find(path);
+            return i == dirs.end() ? nullptr : &i->second;
+        }
+
+        struct stat st;
+        if (stat(path.c_str(), &st) == -1) {
+            if (errno != ENOENT && errno != ENOTDIR)
+                throw PosixError("getting status of '%1%'", path);
+            dirs.erase(path);
+            return nullptr;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            dirs.erase(path);
+            return nullptr;
+        }
+
+        auto & dir = dirs[path];
+        auto ctime = statusChangeTime(st);
+        if (dir.dev != (uint64_t) st.st_dev || dir.ino != (uint64_t) st.st_ino || dir.ctime != ctime) {
+            dir = Dir();
+            dir.dev = st.st_dev;
+            dir.ino = st.st_ino;
+            dir.ctime = ctime;
+        }
+        dir.persist = st.st_ctime < startTime;
+        return &dir;
+    }
+
+    /* Return what is known about `path', looking it up if necessary.
+       Returns nullptr if its parent is not a directory. */
+    Entry * lookup(const Path & path)
+    {
+        auto dir = getDir(dirOf(path));
+        if (!dir) return nullptr;
+
+        auto name = baseNameOf(path);
+        auto i = dir->entries.find(name);
+        if (i != dir->entries.end()) return &i->second;
+
+        Entry entry;
+        if (!dir->listed) {
+            try {
+                entry.type = getFileType(path);
+                entry.exists = true;
+            } catch (PosixError & e) {
+                if (e.errNo != ENOENT && e.errNo != ENOTDIR) throw;
+#ifdef _WIN32
+            } catch (WinError & e) {
+                if (e.lastError != ERROR_FILE_NOT_FOUND && e.lastError != ERROR_PATH_NOT_FOUND) throw;
+#endif
+            }
+        }
+        return &(dir->entries[name] = entry);
+    }
+
+    /* Return the target of symlink `path'. */
+    Path readLink(const Path & path)
+    {
+        auto entry = lookup(path);
+        if (!entry || !entry->exists)
+            return nix::readLink(path);
+        if (entry->target.empty())
+            entry->target = nix::readLink(path);
+        return entry->target;
+    }
+};
+
+
+void LocalStore::findRoots(const Path & path, unsigned char type, Roots & roots, RootsCache & cache)
 {
     auto foundRoot = [&](const Path & path, const Path & target) {
         Path storePath = toStorePath(target);
@@ -338,19 +579,47 @@ void LocalStore::findRoots(const Path & path, unsigned char type, Roots & roots)
             type = getFileType(path);
 
         if (type == DT_DIR) {
-            for (auto & i : readDirectory(path))
-                findRoots(path + "/" + i.name(), i.type(), roots);
+            auto dir = cache.getDir(path);
+
+            if (!dir || !dir->listed) {
+                auto entries = readDirectory(path);
+                if (!dir) return;
+
+                for (auto & i : entries) {
+                    auto & entry = dir->entries[i.name()];
+                    entry.exists = true;
+                    if (entry.type == DT_UNKNOWN) entry.type = i.type();
+                }
+
+                /* The directory is new or has changed, so take the
+                   generation link targets of indexed profiles from
+                   their index rather than reading every link. */
+                StringSet names;
+                for (auto & i : entries) names.insert(i.name());
+                for (auto & profile : findIndexedGenerations(path, names))
+                    for (auto & gen : profile.second) {
+                        auto & entry = dir->entries[baseNameOf(gen.path)];
+                        if (entry.exists && entry.target.empty()) entry.target = gen.target;
+                    }
+
+                dir->listed = true;
+            }
+
+            for (auto & i : dir->entries)
+                if (i.second.exists)
+                    findRoots(path + "/" + i.first, i.second.type, roots, cache);
         }
 
         else if (type == DT_LNK) {
-            Path target = readLink(path);
+            Path target = cache.readLink(path);
             if (isInStore(target))
                 foundRoot(path, target);
 
             /* Handle indirect roots. */
             else {
                 target = absPath(target, dirOf(path));
-                if (!pathExists(target)) {
+                auto entry = cache.lookup(target);
+                if (!entry || !entry->exists) {
                     if (isInDir(path, stateDir + "/" + gcRootsDir + "/auto")) {
                         printInfo(format("removing stale link from '%1%' to '%2%'") % path % target);
 #ifndef _WIN32
@@ -369,8 +638,8 @@ void LocalStore::findRoots(const Path & path, unsigned char type, Roots & roots)
 #endif
                     }
                 } else {
-                    if (!isLink(target)) return;
-                    Path target2 = readLink(target);
+                    if (entry->type != DT_LNK) return;
+                    Path target2 = cache.readLink(target);
                     if (isInStore(target2)) foundRoot(target, target2);
                 }
             }
@@ -400,9 +669,13 @@ void LocalStore::findRoots(const Path & path, unsigned char type, Roots & roots)
 
 void LocalStore::findRootsNoTemp(Roots & roots, bool censor)
 {
+    RootsCache cache(stateDir + "/gc-roots-cache");
+
     /* Process direct roots in {gcroots,profiles}. */
-    findRoots(stateDir + "/" + gcRootsDir, DT_UNKNOWN, roots);
-    findRoots(stateDir + "/profiles", DT_UNKNOWN, roots);
+    findRoots(stateDir + "/" + gcRootsDir, DT_UNKNOWN, roots, cache);
+    findRoots(stateDir + "/profiles", DT_UNKNOWN, roots, cache);
+
+    cache.save();
 
     /* Add additional roots returned by different platforms-specific
        heuristics.  This is typically used to add running programs to
@@ -449,12 +722,6 @@ try_again:
 }
 #endif
 
-static string quoteRegexChars(const string & raw)
-{
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
-}
-
 #ifndef _WIN32
 static void readFileRoots(const char * path, Roots & roots)
 {
@@ -465,6 +732,106 @@ static void readFileRoots(const char * path, Roots & roots)
             throw;
     }
 }
+
+
+/* Call `found' for every substring of `s' that looks like a store
+   path, i.e. matches `<storeDir>/[0-9a-z]+[0-9a-zA-Z+-._?=]*'. */
+static void findStorePaths(const string & storeDir, const string & s,
+    std::function<void(string && path)> found)
+{
+    auto prefix = storeDir + "/";
+
+    auto isHashChar = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z');
+    };
+
+    auto isNameChar = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || strchr("+-._?=", c);
+    };
+
+    size_t pos = 0;
+    while ((pos = s.find(prefix, pos)) != string::npos) {
+        auto end = pos + prefix.size();
+        if (end < s.size() && isHashChar(s[end])) {
+            while (end < s.size() && s[end] && isNameChar(s[end])) end++;
+            found(string(s, pos, end - pos));
+        }
+        pos = end;
+    }
+}
+
+
+/* Return the path name field of a line of /proc/<pid>/maps, or an
+   empty string if it doesn't have an absolute one. */
+static string mapsLinePath(const string & line)
+{
+    static const char * whitespace = " \t\r\f\v";
+
+    /* Skip the address, perms, offset, dev and inode fields. */
+    size_t pos = 0;
+    for (int field = 0; field < 5; field++) {
+        pos = line.find_first_not_of(whitespace, pos);
+        if (pos == string::npos) return "";
+        pos = line.find_first_of(whitespace, pos);
+        if (pos == string::npos) return "";
+    }
+
+    pos = line.find_first_not_of(whitespace, pos);
+    if (pos == string::npos || line[pos] != '/') return "";
+    auto end = line.find_first_of(whitespace, pos);
+    if (end != string::npos && line.find_first_not_of(whitespace, end) != string::npos)
+        return "";
+    return string(line, pos, end == string::npos ? string::npos : end - pos);
+}
+
+
+/* Find the roots held by process `pid': its executable, working
+   directory, open files, mapped files, and store paths in its
+   environment. */
+static void findProcessRoots(const string & storeDir, const string & pid, Roots & roots)
+{
+    readProcLink(fmt("/proc/%s/exe" ,pid), roots);
+    readProcLink(fmt("/proc/%s/cwd", pid), roots);
+
+    auto fdStr = fmt("/proc/%s/fd", pid);
+    auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
+    if (!fdDir) {
+        if (errno == ENOENT || errno == EACCES)
+            return;
+        throw PosixError(format("opening %1%") % fdStr);
+    }
+    struct dirent * fd_ent;
+    while (errno = 0, fd_ent = readdir(fdDir.get())) {
+        if (fd_ent->d_name[0] != '.')
+            readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), roots);
+    }
+    if (errno) {
+        if (errno == ESRCH)
+            return;
+        throw PosixError(format("iterating /proc/%1%/fd") % pid);
+    }
+    fdDir.reset();
+
+    try {
+        auto mapFile = fmt("/proc/%s/maps", pid);
+        auto mapLines = tokenizeString<std::vector<string>>(readFile(mapFile, true), "\n");
+        for (const auto & line : mapLines) {
+            auto path = mapsLinePath(line);
+            if (!path.empty())
+                roots[path].emplace(mapFile);
+        }
+
+        auto envFile = fmt("/proc/%s/environ", pid);
+        findStorePaths(storeDir, readFile(envFile, true), [&](string && path) {
+            roots[path].emplace(envFile);
+        });
+    } catch (PosixError & e) {
+        if (e.errNo == ENOENT || e.errNo == EACCES || e.errNo == ESRCH)
+            return;
+        throw;
+    }
+}
 #endif
 
 void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
@@ -472,60 +839,49 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 #ifndef _WIN32
     Roots unchecked;
 
+    auto startTime = std::chrono::steady_clock::now();
+
+    auto elapsed = [&]() {
+        auto now = std::chrono::steady_clock::now();
+        auto d = std::chrono::duration_cast<std::chrono::milliseconds>(now - startTime).count() / 1000.0;
+        startTime = now;
+        return d;
+    };
+
+    /* Scan the processes in parallel; on machines with many processes
+       reading their /proc entries dominates the time spent here. */
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
+        Strings pids;
         struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
         while (errno = 0, ent = readdir(procDir.get())) {
             checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
-                readProcLink(fmt("/proc/%s/exe" ,ent->d_name), unchecked);
-                readProcLink(fmt("/proc/%s/cwd", ent->d_name), unchecked);
-
-                auto fdStr = fmt("/proc/%s/fd", ent->d_name);
-                auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
-                if (!fdDir) {
-                    if (errno == ENOENT || errno == EACCES)
-                        continue;
-                    throw PosixError(format("opening %1%") % fdStr);
-                }
-                struct dirent * fd_ent;
-                while (errno = 0, fd_ent = readdir(fdDir.get())) {
-                    if (fd_ent->d_name[0] != '.')
-                        readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
-                }
-                if (errno) {
-                    if (errno == ESRCH)
-                        continue;
-                    throw PosixError(format("iterating /proc/%1%/fd") % ent->d_name);
-                }
-                fdDir.reset();
-
-                try {
-                    auto mapFile = fmt("/proc/%s/maps", ent->d_name);
-                    auto mapLines = tokenizeString<std::vector<string>>(readFile(mapFile, true), "\n");
-                    for (const auto & line : mapLines) {
-                        auto match = std::smatch{};
-                        if (std::regex_match(line, match, mapRegex))
-                            unchecked[match[1]].emplace(mapFile);
-                    }
-
-                    auto envFile = fmt("/proc/%s/environ", ent->d_name);
-                    auto envString = readFile(envFile, true);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        unchecked[i->str()].emplace(envFile);
-                } catch (SysError & e) {
-                    if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-                        continue;
-                    throw;
-                }
-            }
+            auto name = ent->d_name;
+            if (*name && std::all_of(name, name + strlen(name), [](char c) { return c >= '0' && c <= '9'; }))
+                pids.push_back(name);
         }
         if (errno)
             throw PosixError("iterating /proc");
+        procDir.reset();
+
+        Sync<Roots> unchecked_;
+        ThreadPool pool;
+
+        for (auto & pid : pids)
+            pool.enqueue([&, pid]() {
+                checkInterrupt();
+                Roots found;
+                findProcessRoots(storeDir, pid, found);
+                auto unchecked(unchecked_.lock());
+                for (auto & i : found)
+                    (*unchecked)[i.first].insert(i.second.begin(), i.second.end());
+            });
+
+        pool.process();
+
+        unchecked = std::move(*unchecked_.lock());
+
+        printMsg(lvlTalkative, "scanned %d processes for runtime roots in %.3f s", pids.size(), elapsed());
     }
 
 #if !defined(__linux__)
@@ -534,17 +890,16 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
     // Because of this we disable lsof when running the tests.
     if (getEnv("_NIX_TEST_NO_LSOF") == "") {
         try {
-            std::regex lsofRegex(R"(^n(/.*)$)");
             auto lsofLines =
                 tokenizeString<std::vector<string>>(runProgramGetStdout(LSOF, true, { "-n", "-w", "-F", "n" }), "\n");
             for (const auto & line : lsofLines) {
-                std::smatch match;
-                if (std::regex_match(line, match, lsofRegex))
-                    unchecked[match[1]].emplace("{lsof}");
+                if (hasPrefix(line, "n/"))
+                    unchecked[string(line, 1)].emplace("{lsof}");
             }
         } catch (ExecError & e) {
             /* lsof not installed, lsof failed */
         }
+        printMsg(lvlTalkative, "ran lsof for runtime roots in %.3f s", elapsed());
     }
 #endif
 
@@ -566,6 +921,8 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
             }
         }
     }
+
+    printMsg(lvlTalkative, "checked %d potential runtime roots in %.3f s", unchecked.size(), elapsed());
 #endif
 }
 
@@ -1083,6 +1440,21 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         removeUnusedLinks(state);
     }
 
+    /* Deleting paths made the reference graph snapshot stale.  Rather
+       than leaving every process to query the database until a large
+       enough query rebuilds it, rebuild it now. */
+    if (!results.paths.empty() && pathExists(dbDir + "/reference-graph")
+        && !buildingReferenceGraph.exchange(true))
+    {
+        Finally finally([&]() { buildingReferenceGraph = false; });
+        try {
+            if (auto graph = buildReferenceGraph(std::numeric_limits<size_t>::max()))
+                *referenceGraph.lock() = graph;
+        } catch (Error & e) {
+            debug("cannot rebuild reference graph: %s", e.msg());
+        }
+    }
+
     /* While we're at it, vacuum the database. */
     //if (options.action == GCOptions::gcDeleteDead) vacuumDB();
 }
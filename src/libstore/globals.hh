@@ -132,6 +132,15 @@ public:
         "build dependencies if possible, rather than waiting for this host to "
         "upload them."};
 
+    Setting<uint64_t> copyBytesInFlight{this, 256 * 1024 * 1024, "copy-bytes-in-flight",
+        "The maximum total NAR size of the store paths that are copied "
+        "between stores at the same time. Bigger paths are copied on their own."};
+
+    Setting<bool> prefetchRemoteInputs{this, false, "prefetch-remote-inputs",
+        "Whether to start copying the inputs of a derivation to the build "
+        "machine it will probably be built on while its other inputs are "
+        "still being built."};
+
     Setting<off_t> reservedSize{this, 8 * 1024 * 1024, "gc-reserved-space",
         "Amount of reserved disk space for the garbage collector."};
 
@@ -318,6 +327,13 @@ public:
     Setting<Strings> allowedUsers{this, {"*"}, "allowed-users",
         "Which users or groups are allowed to connect to the daemon."};
 
+    Setting<bool> daemonThreaded{this, false, "daemon-threaded",
+        "Whether the daemon serves connections from threads sharing a single store, "
+        "rather than from a forked process per connection."};
+
+    Setting<unsigned int> daemonMaxThreads{this, 256, "daemon-max-threads",
+        "The maximum number of connections that a threaded daemon serves at the same time."};
+
     Setting<bool> printMissing{this, true, "print-missing",
         "Whether to print what paths need to be built or downloaded."};
 
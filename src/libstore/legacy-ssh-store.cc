@@ -6,6 +6,8 @@
 #include "worker-protocol.hh"
 #include "ssh.hh"
 #include "derivations.hh"
+#include "compression.hh"
+#include "sync.hh"
 
 namespace nix {
 
@@ -18,6 +20,7 @@ struct LegacySSHStore : public Store
     const Setting<bool> compress{this, false, "compress", "whether to compress the connection"};
     const Setting<Path> remoteProgram{this, "nix-store", "remote-program", "path to the nix-store executable on the remote system"};
     const Setting<std::string> remoteStore{this, "", "remote-store", "URI of the store on the remote system"};
+    const Setting<std::string> transportCompression{this, "", "transport-compression", "compression method (e.g. 'xz') for NARs sent to or from the remote system, if it supports it"};
 
     // Hack for getting remote build log output.
     const Setting<int> logFD{this, -1, "log-fd", "file descriptor to which SSH's stderr is connected"};
@@ -29,6 +32,12 @@ struct LegacySSHStore : public Store
         FdSource from;
         int remoteVersion;
         bool good = true;
+
+        /* The protocol extensions that both sides support. */
+        StringSet extensions;
+
+        /* Whether NARs are compressed on this connection. */
+        bool compressed = false;
     };
 
     std::string host;
@@ -37,6 +46,13 @@ struct LegacySSHStore : public Store
 
     SSHMaster master;
 
+    std::shared_ptr<StreamCompressor> compressor;
+
+    /* The protocol extensions agreed on when the last connection was
+       opened, so that they can be checked without taking a
+       connection. */
+    Sync<std::optional<StringSet>> extensions;
+
     LegacySSHStore(const string & host, const Params & params)
         : Store(params)
         , host(host)
@@ -53,6 +69,8 @@ struct LegacySSHStore : public Store
             compress,
             logFD)
     {
+        if (transportCompression != "")
+            compressor = std::make_shared<StreamCompressor>(transportCompression);
     }
 
     ref<Connection> openConnection()
@@ -75,6 +93,29 @@ struct LegacySSHStore : public Store
             if (GET_PROTOCOL_MAJOR(conn->remoteVersion) != 0x200)
                 throw Error("unsupported 'nix-store --serve' protocol version on '%s'", host);
 
+            /* Agree on the protocol extensions to use. */
+            conn->to << cmdExportPaths << SERVE_EXTENSIONS_MAGIC << PathSet();
+            conn->to.flush();
+            if (readInt(conn->from) == SERVE_EXTENSIONS_MAGIC) {
+                StringSet ours{"batched-copies", "compression"};
+                for (auto & method : streamCompressionMethods())
+                    ours.insert("compression:" + method);
+                for (auto & i : readStrings<StringSet>(conn->from))
+                    if (ours.count(i)) conn->extensions.insert(i);
+                conn->to << ours;
+                conn->to.flush();
+            }
+            *extensions.lock() = conn->extensions;
+
+            if (compressor
+                && conn->extensions.count("compression")
+                && conn->extensions.count("compression:" + compressor->method))
+            {
+                conn->to << cmdSetCompression << compressor->method;
+                conn->to.flush();
+                conn->compressed = readString(conn->from) == compressor->method;
+            }
+
         } catch (EndOfFile & e) {
             throw Error("cannot connect to '%1%'", host);
         }
@@ -87,6 +128,54 @@ struct LegacySSHStore : public Store
         return uriScheme + host;
     }
 
+    /* Send the NAR data that `fun' produces over `conn'. */
+    void sendNar(Connection & conn, std::function<void(Sink &)> fun)
+    {
+        if (conn.compressed)
+            (*compressor)(conn.to, fun);
+        else
+            fun(conn.to);
+    }
+
+    /* Call `fun' with a source for the NAR data received over `conn'. */
+    void receiveNar(Connection & conn, std::function<void(Source &)> fun)
+    {
+        if (!conn.compressed) return fun(conn.from);
+        auto source = makeFramedDecompressionSource(compressor->method, conn.from);
+        fun(*source);
+        source->drain();
+    }
+
+    /* Read the reply to cmdQueryPathInfos, which lists the valid
+       paths among those requested. */
+    std::map<Path, std::shared_ptr<const ValidPathInfo>> readPathInfos(Connection & conn)
+    {
+        std::map<Path, std::shared_ptr<const ValidPathInfo>> infos;
+
+        while (true) {
+            auto info = std::make_shared<ValidPathInfo>();
+            conn.from >> info->path;
+            if (info->path.empty()) break;
+            assertStorePath(info->path);
+
+            conn.from >> info->deriver;
+            info->references = readStorePaths<PathSet>(*this, conn.from);
+            readLongLong(conn.from); // download size
+            info->narSize = readLongLong(conn.from);
+
+            if (GET_PROTOCOL_MINOR(conn.remoteVersion) >= 4) {
+                auto s = readString(conn.from);
+                info->narHash = s.empty() ? Hash() : Hash(s);
+                conn.from >> info->ca;
+                info->sigs = readStrings<StringSet>(conn.from);
+            }
+
+            infos.emplace(info->path, info);
+        }
+
+        return infos;
+    }
+
     void queryPathInfoUncached(const Path & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override
     {
@@ -98,31 +187,26 @@ struct LegacySSHStore : public Store
             conn->to << cmdQueryPathInfos << PathSet{path};
             conn->to.flush();
 
-            auto info = std::make_shared<ValidPathInfo>();
-            conn->from >> info->path;
-            if (info->path.empty()) return callback(nullptr);
-            assert(path == info->path);
-
-            PathSet references;
-            conn->from >> info->deriver;
-            info->references = readStorePaths<PathSet>(*this, conn->from);
-            readLongLong(conn->from); // download size
-            info->narSize = readLongLong(conn->from);
-
-            if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 4) {
-                auto s = readString(conn->from);
-                info->narHash = s.empty() ? Hash() : Hash(s);
-                conn->from >> info->ca;
-                info->sigs = readStrings<StringSet>(conn->from);
-            }
+            auto infos = readPathInfos(*conn);
+            auto i = infos.find(path);
+            if (i == infos.end()) return callback(nullptr);
 
-            auto s = readString(conn->from);
-            assert(s == "");
-
-            callback(std::move(info));
+            callback(std::move(i->second));
         } catch (...) { callback.rethrow(); }
     }
 
+    std::map<Path, std::shared_ptr<const ValidPathInfo>> queryPathInfosUncached(const PathSet & paths) override
+    {
+        auto conn(connections->get());
+
+        debug("querying remote host '%s' for info on %d paths", host, paths.size());
+
+        conn->to << cmdQueryPathInfos << paths;
+        conn->to.flush();
+
+        return readPathInfos(*conn);
+    }
+
     void addToStore(const ValidPathInfo & info, Source & source,
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override
@@ -145,7 +229,7 @@ struct LegacySSHStore : public Store
                 << info.sigs
                 << info.ca;
             try {
-                copyNAR(source, conn->to);
+                sendNar(*conn, [&](Sink & sink) { copyNAR(source, sink); });
             } catch (...) {
                 conn->good = false;
                 throw;
@@ -178,13 +262,89 @@ struct LegacySSHStore : public Store
             throw Error("failed to add path '%s' to remote host '%s', info.path, host");
     }
 
+    bool wantsBatchedCopies() override
+    {
+        if (!*extensions.lock()) connect();
+        return (*extensions.lock())->count("batched-copies");
+    }
+
+    void addMultipleToStore(const std::vector<ref<const ValidPathInfo>> & infos,
+        std::function<void(const Path &, Sink &)> narFromPath,
+        RepairFlag repair, CheckSigsFlag checkSigs) override
+    {
+        if (!wantsBatchedCopies()) {
+            Store::addMultipleToStore(infos, narFromPath, repair, checkSigs);
+            return;
+        }
+
+        auto conn(connections->get());
+
+        debug("adding %d paths to remote host '%s'", infos.size(), host);
+
+        /* Send all paths without waiting for each to be imported, so
+           that the link stays busy while the remote side works. */
+        conn->to << cmdAddToStoreNars << infos.size();
+        try {
+            for (auto & info : infos) {
+                conn->to
+                    << info->path
+                    << info->deriver
+                    << info->narHash.to_string(Base16, false)
+                    << info->references
+                    << info->registrationTime
+                    << info->narSize
+                    << info->ultimate
+                    << info->sigs
+                    << info->ca;
+                sendNar(*conn, [&](Sink & sink) { narFromPath(info->path, sink); });
+            }
+            conn->to.flush();
+        } catch (...) {
+            conn->good = false;
+            throw;
+        }
+
+        if (readInt(conn->from) != 1)
+            throw Error("failed to add %d paths to remote host '%s'", infos.size(), host);
+    }
+
     void narFromPath(const Path & path, Sink & sink) override
     {
         auto conn(connections->get());
 
         conn->to << cmdDumpStorePath << path;
         conn->to.flush();
-        copyNAR(conn->from, sink);
+        receiveNar(*conn, [&](Source & source) { copyNAR(source, sink); });
+    }
+
+    void narsFromPaths(const Paths & paths,
+        std::function<void(const Path &, Source &)> callback) override
+    {
+        if (!wantsBatchedCopies()) {
+            Store::narsFromPaths(paths, callback);
+            return;
+        }
+
+        auto conn(connections->get());
+
+        conn->to << cmdDumpStorePaths << paths;
+        conn->to.flush();
+
+        /* The NARs arrive back to back; parse each one so that we
+           know where it ends. */
+        try {
+            for (auto & path : paths)
+                receiveNar(*conn, [&](Source & from) {
+                    auto source = sinkToSource([&](Sink & sink) {
+                        copyNAR(from, sink);
+                    });
+                    callback(path, *source);
+                    source->drain();
+                });
+        } catch (...) {
+            conn->good = false;
+            throw;
+        }
     }
 
     Path queryPathFromHashPart(const string & hashPart) override
@@ -4,6 +4,8 @@
 #include "pathlocks.hh"
 #include "worker-protocol.hh"
 #include "derivations.hh"
+#include "finally.hh"
+#include "reference-graph.hh"
 #include "nar-info.hh"
 #include "references.hh"
 
@@ -48,6 +50,32 @@
 namespace nix {
 
 
+/* Queries that are prepared both on the main database connection and
+   on the read-only connections. */
+static const char * queryPathInfoSQL =
+    "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;";
+static const char * queryReferencesSQL =
+    "select path from Refs join ValidPaths on reference = id where referrer = ?;";
+static const char * queryReferrersSQL =
+    "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);";
+static const char * queryClosureSQL =
+    "with recursive Closure(id) as (select id from ValidPaths where path = ? "
+    "union select reference from Refs join Closure on referrer = Closure.id) "
+    "select path from ValidPaths join Closure on ValidPaths.id = Closure.id;";
+static const char * queryReverseClosureSQL =
+    "with recursive Closure(id) as (select id from ValidPaths where path = ? "
+    "union select referrer from Refs join Closure on reference = Closure.id) "
+    "select path from ValidPaths join Closure on ValidPaths.id = Closure.id;";
+static const char * queryGraphStampSQL =
+    "select (select version from GraphVersion), (select seq from sqlite_sequence where name = 'ValidPaths');";
+static const char * queryPathsSinceSQL =
+    "select id, path from ValidPaths where id > ? order by id;";
+static const char * queryRefsSinceSQL =
+    "select referrer, reference from Refs where referrer > ?;";
+static const char * queryValidPathCountSQL =
+    "select count(*) from ValidPaths;";
+
+
 LocalStore::LocalStore(const Params & params)
     : Store(params)
     , LocalFSStore(params)
@@ -244,6 +272,41 @@ LocalStore::LocalStore(const Params & params)
 
     else openDB(*state, false);
 
+    /* Tables that older versions of Nix can do without are created
+       when missing rather than by a schema upgrade, so that those
+       versions can still open the database.  Rows of DerivationHashes
+       are deleted together with their path by SQLite, and so that
+       deletions by those versions are noticed as well, GraphVersion
+       is bumped by a trigger.  (Re-registering a valid path with
+       different references is not noticed when done by those
+       versions, since a trigger can't tell that from registering a
+       new path; graphs then miss the change until a path is next
+       deleted.)  Check for them first, so that opening the store
+       doesn't need a write transaction. */
+    bool haveAuxTables;
+    {
+        SQLiteStmt queryAuxTables(state->db,
+            "select count(*) from sqlite_master where "
+            "(type = 'table' and name in ('DerivationHashes', 'GraphVersion')) or "
+            "(type = 'trigger' and name = 'BumpGraphVersion')");
+        auto queryAuxTables_(queryAuxTables.use());
+        haveAuxTables = queryAuxTables_.next() && queryAuxTables_.getInt(0) == 3;
+    }
+    if (!haveAuxTables) {
+        SQLiteTxn txn(state->db);
+        state->db.exec(
+            "create table if not exists DerivationHashes ("
+            "drv integer primary key not null, "
+            "hash text not null, "
+            "foreign key (drv) references ValidPaths(id) on delete cascade)");
+        state->db.exec("create table if not exists GraphVersion (version integer not null)");
+        state->db.exec("insert into GraphVersion (version) select 0 where not exists (select 1 from GraphVersion)");
+        state->db.exec(
+            "create trigger if not exists BumpGraphVersion after delete on ValidPaths "
+            "begin update GraphVersion set version = version + 1; end");
+        txn.commit();
+    }
+
     /* Prepare SQL statements. */
     state->stmtRegisterValidPath.create(state->db,
         "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
@@ -251,12 +314,17 @@ LocalStore::LocalStore(const Params & params)
         "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
     state->stmtAddReference.create(state->db,
         "insert or replace into Refs (referrer, reference) values (?, ?);");
-    state->stmtQueryPathInfo.create(state->db,
-        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
-    state->stmtQueryReferences.create(state->db,
-        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
-    state->stmtQueryReferrers.create(state->db,
-        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+    state->stmtQueryPathInfo.create(state->db, queryPathInfoSQL);
+    state->stmtQueryReferences.create(state->db, queryReferencesSQL);
+    state->stmtQueryReferrers.create(state->db, queryReferrersSQL);
+    state->stmtQueryClosure.create(state->db, queryClosureSQL);
+    state->stmtQueryReverseClosure.create(state->db, queryReverseClosureSQL);
+    state->stmtQueryGraphStamp.create(state->db, queryGraphStampSQL);
+    state->stmtQueryPathsSince.create(state->db, queryPathsSinceSQL);
+    state->stmtQueryRefsSince.create(state->db, queryRefsSinceSQL);
+    state->stmtQueryValidPathCount.create(state->db, queryValidPathCountSQL);
+    state->stmtBumpGraphVersion.create(state->db,
+        "update GraphVersion set version = version + 1;");
     state->stmtInvalidatePath.create(state->db,
         "delete from ValidPaths where path = ?;");
     state->stmtAddDerivationOutput.create(state->db,
@@ -270,6 +338,15 @@ LocalStore::LocalStore(const Params & params)
     state->stmtQueryPathFromHashPart.create(state->db,
         "select path from ValidPaths where path >= ? limit 1;");
     state->stmtQueryValidPaths.create(state->db, "select path from ValidPaths");
+    state->stmtQueryDrvHashModulo.create(state->db,
+        "select h.hash from DerivationHashes h join ValidPaths v on h.drv = v.id where v.path = ?;");
+    state->stmtRegisterDrvHashModulo.create(state->db,
+        "insert or replace into DerivationHashes (drv, hash) values (?, ?);");
+
+    if (settings.useSQLiteWAL && maxReadConnections > 0)
+        readConnections = std::make_unique<Pool<ReadConnection>>(
+            maxReadConnections,
+            [this]() { return openReadConnection(); });
 }
 
 
@@ -392,6 +469,36 @@ void LocalStore::openDB(State & state, bool create)
 }
 
 
+ref<LocalStore::ReadConnection> LocalStore::openReadConnection()
+{
+    auto conn = make_ref<ReadConnection>();
+
+    /* Each connection is only used by one thread at a time, so
+       SQLite's own locking is unnecessary.  The WAL and shared-memory
+       files already exist, since the connection in `_state' is
+       open. */
+    string dbPath = dbDir + "/db.sqlite";
+    if (sqlite3_open_v2(dbPath.c_str(), &conn->db.db,
+            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0) != SQLITE_OK)
+        throw Error(format("cannot open Nix database '%1%'") % dbPath);
+
+    if (sqlite3_busy_timeout(conn->db, 60 * 60 * 1000) != SQLITE_OK)
+        throwSQLiteError(conn->db, "setting timeout");
+
+    conn->stmtQueryPathInfo.create(conn->db, queryPathInfoSQL);
+    conn->stmtQueryReferences.create(conn->db, queryReferencesSQL);
+    conn->stmtQueryReferrers.create(conn->db, queryReferrersSQL);
+    conn->stmtQueryClosure.create(conn->db, queryClosureSQL);
+    conn->stmtQueryReverseClosure.create(conn->db, queryReverseClosureSQL);
+    conn->stmtQueryGraphStamp.create(conn->db, queryGraphStampSQL);
+    conn->stmtQueryPathsSince.create(conn->db, queryPathsSinceSQL);
+    conn->stmtQueryRefsSince.create(conn->db, queryRefsSinceSQL);
+    conn->stmtQueryValidPathCount.create(conn->db, queryValidPathCountSQL);
+
+    return conn;
+}
+
+
 /* To improve purity, users may want to make the Nix store a read-only
    bind mount.  So make the Nix store writable for this process. */
 void LocalStore::makeStoreWritable()
@@ -798,16 +905,16 @@ uint64_t LocalStore::addValidPath(State & state,
        efficiently query whether a path is an output of some
        derivation. */
     if (isDerivation(info.path)) {
-        Derivation drv = readDerivation(realStoreDir + "/" + baseNameOf(info.path));
+        auto drv = readSharedDerivation(info.path, realStoreDir + "/" + baseNameOf(info.path));
 
         /* Verify that the output paths in the derivation are correct
            (i.e., follow the scheme for computing output paths from
            derivations).  Note that if this throws an error, then the
            DB transaction is rolled back, so the path validity
            registration above is undone. */
-        if (checkOutputs) checkDerivationOutputs(info.path, drv);
+        if (checkOutputs) checkDerivationOutputs(info.path, *drv);
 
-        for (auto & i : drv.outputs) {
+        for (auto & i : drv->outputs) {
             state.stmtAddDerivationOutput.use()
                 (id)
                 (i.first)
@@ -825,61 +932,98 @@ uint64_t LocalStore::addValidPath(State & state,
 }
 
 
-void LocalStore::queryPathInfoUncached(const Path & path,
-    Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
+static std::shared_ptr<ValidPathInfo> queryPathInfo_(
+    SQLiteStmt & stmtQueryPathInfo, SQLiteStmt & stmtQueryReferences, const Path & path)
 {
-    try {
-        auto info = std::make_shared<ValidPathInfo>();
-        info->path = path;
+    auto info = std::make_shared<ValidPathInfo>();
+    info->path = path;
 
-        assertStorePath(path);
+    /* Get the path info. */
+    auto useQueryPathInfo(stmtQueryPathInfo.use()(path));
 
-        callback(retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
-            auto state(_state.lock());
+    if (!useQueryPathInfo.next())
+        return std::shared_ptr<ValidPathInfo>();
+
+    info->id = useQueryPathInfo.getInt(0);
 
-            /* Get the path info. */
-            auto useQueryPathInfo(state->stmtQueryPathInfo.use()(path));
+    try {
+        info->narHash = Hash(useQueryPathInfo.getStr(1));
+    } catch (BadHash & e) {
+        throw Error("in valid-path entry for '%s': %s", path, e.what());
+    }
 
-            if (!useQueryPathInfo.next())
-                return std::shared_ptr<ValidPathInfo>();
+    info->registrationTime = useQueryPathInfo.getInt(2);
 
-            info->id = useQueryPathInfo.getInt(0);
+    auto s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 3);
+    if (s) info->deriver = s;
 
-            try {
-                info->narHash = Hash(useQueryPathInfo.getStr(1));
-            } catch (BadHash & e) {
-                throw Error("in valid-path entry for '%s': %s", path, e.what());
-            }
+    /* Note that narSize = NULL yields 0. */
+    info->narSize = useQueryPathInfo.getInt(4);
 
-            info->registrationTime = useQueryPathInfo.getInt(2);
+    info->ultimate = useQueryPathInfo.getInt(5) == 1;
 
-            auto s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 3);
-            if (s) info->deriver = s;
+    s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 6);
+    if (s) info->sigs = tokenizeString<StringSet>(s, " ");
 
-            /* Note that narSize = NULL yields 0. */
-            info->narSize = useQueryPathInfo.getInt(4);
+    s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 7);
+    if (s) info->ca = s;
 
-            info->ultimate = useQueryPathInfo.getInt(5) == 1;
+    /* Get the references. */
+    auto useQueryReferences(stmtQueryReferences.use()(info->id));
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 6);
-            if (s) info->sigs = tokenizeString<StringSet>(s, " ");
+    while (useQueryReferences.next())
+        info->references.insert(useQueryReferences.getStr(0));
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 7);
-            if (s) info->ca = s;
+    return info;
+}
 
-            /* Get the references. */
-            auto useQueryReferences(state->stmtQueryReferences.use()(info->id));
 
-            while (useQueryReferences.next())
-                info->references.insert(useQueryReferences.getStr(0));
+void LocalStore::queryPathInfoUncached(const Path & path,
+    Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
+{
+    try {
+        assertStorePath(path);
 
-            return info;
+        callback(retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
+            if (readConnections) {
+                auto conn(readConnections->get());
+                return queryPathInfo_(conn->stmtQueryPathInfo, conn->stmtQueryReferences, path);
+            }
+            auto state(_state.lock());
+            return queryPathInfo_(state->stmtQueryPathInfo, state->stmtQueryReferences, path);
         }));
 
     } catch (...) { callback.rethrow(); }
 }
 
 
+std::map<Path, std::shared_ptr<const ValidPathInfo>> LocalStore::queryPathInfosUncached(const PathSet & paths)
+{
+    return retrySQLite<std::map<Path, std::shared_ptr<const ValidPathInfo>>>([&]() {
+        std::map<Path, std::shared_ptr<const ValidPathInfo>> infos;
+
+        auto query = [&](SQLiteStmt & stmtQueryPathInfo, SQLiteStmt & stmtQueryReferences) {
+            for (auto & path : paths)
+                if (auto info = queryPathInfo_(stmtQueryPathInfo, stmtQueryReferences, path))
+                    infos.emplace(path, info);
+        };
+
+        if (readConnections) {
+            auto conn(readConnections->get());
+            /* Read all paths from the same snapshot. */
+            SQLiteTxn txn(conn->db);
+            query(conn->stmtQueryPathInfo, conn->stmtQueryReferences);
+            txn.commit();
+        } else {
+            auto state(_state.lock());
+            query(state->stmtQueryPathInfo, state->stmtQueryReferences);
+        }
+
+        return infos;
+    });
+}
+
+
 /* Update path info in the database. */
 void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
@@ -912,6 +1056,10 @@ bool LocalStore::isValidPath_(State & state, const Path & path)
 bool LocalStore::isValidPathUncached(const Path & path)
 {
     return retrySQLite<bool>([&]() {
+        if (readConnections) {
+            auto conn(readConnections->get());
+            return conn->stmtQueryPathInfo.use()(path).next();
+        }
         auto state(_state.lock());
         return isValidPath_(*state, path);
     });
@@ -939,25 +1087,271 @@ PathSet LocalStore::queryAllValidPaths()
 }
 
 
-void LocalStore::queryReferrers(State & state, const Path & path, PathSet & referrers)
+static void queryReferrers_(SQLiteStmt & stmtQueryReferrers, const Path & path, PathSet & referrers)
 {
-    auto useQueryReferrers(state.stmtQueryReferrers.use()(path));
+    auto useQueryReferrers(stmtQueryReferrers.use()(path));
 
     while (useQueryReferrers.next())
         referrers.insert(useQueryReferrers.getStr(0));
 }
 
 
+void LocalStore::queryReferrers(State & state, const Path & path, PathSet & referrers)
+{
+    queryReferrers_(state.stmtQueryReferrers, path, referrers);
+}
+
+
 void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 {
     assertStorePath(path);
     return retrySQLite<void>([&]() {
+        if (readConnections) {
+            auto conn(readConnections->get());
+            queryReferrers_(conn->stmtQueryReferrers, path, referrers);
+            return;
+        }
         auto state(_state.lock());
         queryReferrers(*state, path, referrers);
     });
 }
 
 
+std::map<Path, PathSet> LocalStore::queryReferrersOfPaths(const PathSet & paths)
+{
+    for (auto & path : paths) assertStorePath(path);
+
+    return retrySQLite<std::map<Path, PathSet>>([&]() {
+        std::map<Path, PathSet> referrers;
+
+        if (readConnections) {
+            auto conn(readConnections->get());
+            SQLiteTxn txn(conn->db);
+            for (auto & path : paths)
+                queryReferrers_(conn->stmtQueryReferrers, path, referrers[path]);
+            txn.commit();
+        } else {
+            auto state(_state.lock());
+            for (auto & path : paths)
+                queryReferrers(*state, path, referrers[path]);
+        }
+
+        return referrers;
+    });
+}
+
+
+/* Read the graph version counter and the highest path ID. */
+static void queryGraphStamp(SQLiteStmt & stmtQueryGraphStamp, uint64_t & version, uint64_t & maxId)
+{
+    version = maxId = 0;
+    auto use(stmtQueryGraphStamp.use());
+    if (use.next()) {
+        if (!use.isNull(0)) version = use.getInt(0);
+        if (!use.isNull(1)) maxId = use.getInt(1);
+    }
+}
+
+
+/* Read the paths with an ID higher than `id', and their references. */
+static void queryGraphSince(SQLiteStmt & stmtQueryPathsSince, SQLiteStmt & stmtQueryRefsSince,
+    uint64_t id, std::vector<ReferenceGraph::PathEntry> & paths, std::vector<ReferenceGraph::RefEntry> & refs)
+{
+    auto usePaths(stmtQueryPathsSince.use()(id));
+    while (usePaths.next())
+        paths.emplace_back(usePaths.getInt(0), usePaths.getStr(1));
+    auto useRefs(stmtQueryRefsSince.use()(id));
+    while (useRefs.next())
+        refs.emplace_back(useRefs.getInt(0), useRefs.getInt(1));
+}
+
+
+/* Compute closures from the reference graph, or with a single
+   recursive query per path while there is no usable snapshot. */
+void LocalStore::computeFSClosure(const PathSet & paths,
+    PathSet & out, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    /* Outputs and derivers aren't edges in the Refs table, so leave
+       those to the generic implementation. */
+    if (includeOutputs || includeDerivers) {
+        Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+        return;
+    }
+
+    for (auto & path : paths) assertStorePath(path);
+
+    {
+        auto graph(referenceGraph.lock());
+        if (updateReferenceGraph(*graph)) {
+            (*graph)->computeClosure(paths, out, flipDirection);
+            return;
+        }
+    }
+
+    auto closure = retrySQLite<PathSet>([&]() {
+        PathSet closure;
+
+        auto query = [&](SQLiteStmt & stmtQueryClosure) {
+            for (auto & path : paths) {
+                if (out.count(path) || closure.count(path)) continue;
+                auto use(stmtQueryClosure.use()(path));
+                bool valid = false;
+                while (use.next()) {
+                    closure.insert(use.getStr(0));
+                    valid = true;
+                }
+                if (!valid)
+                    throw InvalidPath("path '%s' is not valid", path);
+            }
+        };
+
+        if (readConnections) {
+            auto conn(readConnections->get());
+            SQLiteTxn txn(conn->db);
+            query(flipDirection ? conn->stmtQueryReverseClosure : conn->stmtQueryClosure);
+            txn.commit();
+        } else {
+            auto state(_state.lock());
+            query(flipDirection ? state->stmtQueryReverseClosure : state->stmtQueryClosure);
+        }
+
+        return closure;
+    });
+
+    out.insert(closure.begin(), closure.end());
+
+    /* Only one thread at a time rebuilds the graph; the others keep
+       using the database meanwhile. */
+    if (!buildingReferenceGraph.exchange(true)) {
+        Finally finally([&]() { buildingReferenceGraph = false; });
+        if (auto graph = buildReferenceGraph(closure.size())) {
+            auto graph_(referenceGraph.lock());
+            if (!*graph_) *graph_ = graph;
+        }
+    }
+}
+
+
+bool LocalStore::updateReferenceGraph(std::shared_ptr<ReferenceGraph> & graph)
+{
+    Path snapshotFile = dbDir + "/reference-graph";
+
+    return retrySQLite<bool>([&]() {
+
+        auto update = [&](SQLite & db, SQLiteStmt & stmtQueryGraphStamp,
+            SQLiteStmt & stmtQueryPathsSince, SQLiteStmt & stmtQueryRefsSince)
+        {
+            SQLiteTxn txn(db);
+
+            uint64_t version, maxId;
+            queryGraphStamp(stmtQueryGraphStamp, version, maxId);
+
+            /* Use the snapshot on disk if it's still valid.  Only its
+               header is read to tell whether it is. */
+            if (!graph || graph->version != version) {
+                graph.reset();
+                if (ReferenceGraph::readVersion(snapshotFile) == version) {
+                    try {
+                        auto snapshot = std::make_shared<ReferenceGraph>(storeDir, snapshotFile);
+                        if (snapshot->version == version && snapshot->maxId() <= maxId)
+                            graph = snapshot;
+                    } catch (Error & e) {
+                        warn("ignoring reference graph: %s", e.msg());
+                    }
+                }
+            }
+
+            /* Add the paths registered since the snapshot was taken.
+               If there are many of them, a new snapshot is needed
+               instead. */
+            if (graph && graph->maxId() < maxId) {
+                std::vector<ReferenceGraph::PathEntry> paths;
+                std::vector<ReferenceGraph::RefEntry> refs;
+                queryGraphSince(stmtQueryPathsSince, stmtQueryRefsSince, graph->maxId(), paths, refs);
+                if (graph->overlaySize() + paths.size() <= std::max((size_t) 1024, graph->snapshotSize() / 16))
+                    graph->addToOverlay(paths, refs);
+                else
+                    graph.reset();
+            }
+
+            txn.commit();
+            return (bool) graph;
+        };
+
+        if (readConnections) {
+            auto conn(readConnections->get());
+            return update(conn->db, conn->stmtQueryGraphStamp, conn->stmtQueryPathsSince, conn->stmtQueryRefsSince);
+        } else {
+            auto state(_state.lock());
+            return update(state->db, state->stmtQueryGraphStamp, state->stmtQueryPathsSince, state->stmtQueryRefsSince);
+        }
+    });
+}
+
+
+std::shared_ptr<ReferenceGraph> LocalStore::buildReferenceGraph(size_t work)
+{
+    Path snapshotFile = dbDir + "/reference-graph";
+
+    auto graph = retrySQLite<std::shared_ptr<ReferenceGraph>>([&]() {
+
+        auto build = [&](SQLite & db, SQLiteStmt & stmtQueryGraphStamp,
+            SQLiteStmt & stmtQueryPathsSince, SQLiteStmt & stmtQueryRefsSince,
+            SQLiteStmt & stmtQueryValidPathCount)
+            -> std::shared_ptr<ReferenceGraph>
+        {
+            SQLiteTxn txn(db);
+
+            /* Building takes a scan of the whole database, so don't
+               do it until a query has done a comparable amount of
+               work without the graph.  Path IDs are never reused, so
+               this is measured against the number of valid paths
+               rather than the highest ID. */
+            if (work < 1024) return nullptr;
+            {
+                auto use(stmtQueryValidPathCount.use());
+                if (use.next() && work < (uint64_t) use.getInt(0) / 16) return nullptr;
+            }
+
+            uint64_t version, maxId;
+            queryGraphStamp(stmtQueryGraphStamp, version, maxId);
+
+            std::vector<ReferenceGraph::PathEntry> paths;
+            std::vector<ReferenceGraph::RefEntry> refs;
+            queryGraphSince(stmtQueryPathsSince, stmtQueryRefsSince, 0, paths, refs);
+            txn.commit();
+
+            debug("created reference graph of %d paths and %d references", paths.size(), refs.size());
+            return std::make_shared<ReferenceGraph>(storeDir, version, paths, refs);
+        };
+
+        if (readConnections) {
+            auto conn(readConnections->get());
+            return build(conn->db, conn->stmtQueryGraphStamp, conn->stmtQueryPathsSince,
+                conn->stmtQueryRefsSince, conn->stmtQueryValidPathCount);
+        } else {
+            auto state(_state.lock());
+            return build(state->db, state->stmtQueryGraphStamp, state->stmtQueryPathsSince,
+                state->stmtQueryRefsSince, state->stmtQueryValidPathCount);
+        }
+    });
+
+    if (graph) {
+        try {
+            graph->write(snapshotFile);
+        } catch (SysError & e) {
+            debug("cannot write reference graph '%s': %s", snapshotFile, e.msg());
+#ifdef _WIN32
+        } catch (WinError & e) {
+            debug("cannot write reference graph '%s': %s", snapshotFile, e.msg());
+#endif
+        }
+    }
+
+    return graph;
+}
+
+
 PathSet LocalStore::queryValidDerivers(const Path & path)
 {
     assertStorePath(path);
@@ -1010,6 +1404,39 @@ StringSet LocalStore::queryDerivationOutputNames(const Path & path)
 }
 
 
+std::map<Path, Hash> LocalStore::queryDrvHashesModulo(const PathSet & drvPaths)
+{
+    return retrySQLite<std::map<Path, Hash>>([&]() {
+        auto state(_state.lock());
+
+        std::map<Path, Hash> res;
+        for (auto & drvPath : drvPaths) {
+            auto useQueryDrvHashModulo(state->stmtQueryDrvHashModulo.use()(drvPath));
+            if (useQueryDrvHashModulo.next())
+                res.emplace(drvPath, Hash(useQueryDrvHashModulo.getStr(0)));
+        }
+        return res;
+    });
+}
+
+
+void LocalStore::registerDrvHashModulo(const Path & drvPath, const Hash & hash)
+{
+    if (settings.readOnlyMode) return;
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+
+        if (!isValidPath_(*state, drvPath)) return;
+
+        state->stmtRegisterDrvHashModulo.use()
+            (queryValidPathId(*state, drvPath))
+            (hash.to_string(Base16))
+            .exec();
+    });
+}
+
+
 Path LocalStore::queryPathFromHashPart(const string & hashPart)
 {
     if (hashPart.size() != storePathHashLen) throw Error("invalid hash part");
@@ -1111,20 +1538,38 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
 
         SQLiteTxn txn(state->db);
         PathSet paths;
+        std::unordered_map<Path, const ValidPathInfo *> byPath;
+
+        /* Remember the IDs of the paths registered here, so that
+           references between them don't need a database lookup. */
+        std::unordered_map<Path, uint64_t> ids;
 
         for (auto & i : infos) {
             assert(i.narHash.type == htSHA256);
-            if (isValidPath_(*state, i.path))
+            auto use(state->stmtQueryPathInfo.use()(i.path));
+            if (use.next()) {
+                ids[i.path] = use.getInt(0);
                 updatePathInfo(*state, i);
-            else
-                addValidPath(*state, i, false);
+                /* Its references may change, which snapshots of the
+                   reference graph wouldn't notice otherwise. */
+                state->stmtBumpGraphVersion.use().exec();
+                /* A re-registered path may have been repaired. */
+                if (isDerivation(i.path)) invalidateDerivationCache(i.path);
+            } else
+                ids[i.path] = addValidPath(*state, i, false);
             paths.insert(i.path);
+            byPath[i.path] = &i;
         }
 
         for (auto & i : infos) {
-            auto referrer = queryValidPathId(*state, i.path);
-            for (auto & j : i.references)
-                state->stmtAddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
+            auto referrer = ids[i.path];
+            for (auto & j : i.references) {
+                auto k = ids.find(j);
+                state->stmtAddReference.use()
+                    (referrer)
+                    (k != ids.end() ? k->second : queryValidPathId(*state, j))
+                    .exec();
+            }
         }
 
         /* Check that the derivation outputs are correct.  We can't do
@@ -1133,21 +1578,92 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         for (auto & i : infos)
             if (isDerivation(i.path)) {
                 // FIXME: inefficient; we already loaded the derivation in addValidPath().
-                Derivation drv = readDerivation(realStoreDir + "/" + baseNameOf(i.path));
-                checkDerivationOutputs(i.path, drv);
+                checkDerivationOutputs(i.path, *readSharedDerivation(i.path, realStoreDir + "/" + baseNameOf(i.path)));
             }
 
         /* Do a topological sort of the paths.  This will throw an
            error if a cycle is detected and roll back the
            transaction.  Cycles can only occur when a derivation
-           has multiple outputs. */
-        topoSortPaths(paths);
+           has multiple outputs.  The references are taken from
+           `infos', since the new paths aren't visible outside of this
+           transaction. */
+        topoSortPaths(paths, [&](const Path & path) -> const PathSet & {
+            return byPath.at(path)->references;
+        });
 
         txn.commit();
     });
 }
 
 
+void LocalStore::registerValidPathBatched(const ValidPathInfo & info)
+{
+    auto reg = std::make_shared<PendingRegistration>(info);
+
+    registrationQueue.lock()->pending.push_back(reg);
+
+    while (true) {
+
+        std::vector<std::shared_ptr<PendingRegistration>> batch;
+
+        {
+            auto queue(registrationQueue.lock());
+            while (!reg->done && queue->committing)
+                queue.wait(registrationCommitted);
+            if (reg->done) break;
+
+            /* Nobody is committing, so commit everything that has
+               queued up so far, including our own registration. */
+            size_t maxBatch = std::max(1U, registrationBatchSize.get());
+            while (!queue->pending.empty() && batch.size() < maxBatch) {
+                batch.push_back(queue->pending.front());
+                queue->pending.pop_front();
+            }
+            queue->committing = true;
+        }
+
+        /* Let the next thread commit, even if we fail.  Registrations
+           of other threads that we haven't got to are put back, so
+           that they're retried. */
+        Finally finally([&]() {
+            {
+                auto queue(registrationQueue.lock());
+                queue->committing = false;
+                for (auto & r : batch)
+                    if (!r->done && r != reg) queue->pending.push_back(r);
+            }
+            registrationCommitted.notify_all();
+        });
+
+        ValidPathInfos infos;
+        for (auto & r : batch) infos.push_back(r->info);
+
+        try {
+            registerValidPaths(infos);
+        } catch (...) {
+            /* Retry the paths one by one, so that an invalid
+               registration only fails its own caller. */
+            if (batch.size() == 1)
+                batch[0]->exc = std::current_exception();
+            else
+                for (auto & r : batch)
+                    try {
+                        registerValidPath(r->info);
+                    } catch (...) {
+                        r->exc = std::current_exception();
+                    }
+        }
+
+        {
+            auto queue(registrationQueue.lock());
+            for (auto & r : batch) r->done = true;
+        }
+    }
+
+    if (reg->exc) std::rethrow_exception(reg->exc);
+}
+
+
 /* Invalidate a path.  The caller is responsible for checking that
    there are no referrers. */
 void LocalStore::invalidatePath(State & state, const Path & path)
@@ -1241,7 +1757,7 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 
             optimisePath(realPath); // FIXME: combine with hashPath()
 
-            registerValidPath(info);
+            registerValidPathBatched(info);
         }
 
         outputLock.setDeletion(true);
@@ -1303,7 +1819,7 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
             info.narHash = hash.first;
             info.narSize = hash.second;
             info.ca = makeFixedOutputCA(recursive, h);
-            registerValidPath(info);
+            registerValidPathBatched(info);
         }
 
         outputLock.setDeletion(true);
@@ -1371,7 +1887,7 @@ Path LocalStore::addTextToStore(const string & name, const string & s,
             info.narSize = sink.s->size();
             info.references = references;
             info.ca = "text:" + hash.to_string();
-            registerValidPath(info);
+            registerValidPathBatched(info);
         }
 
         outputLock.setDeletion(true);
@@ -3,11 +3,14 @@
 #include "sqlite.hh"
 
 #include "pathlocks.hh"
+#include "pool.hh"
 #include "store-api.hh"
 #include "sync.hh"
 #include "util.hh"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <future>
 #include <string>
 #include <unordered_set>
@@ -25,6 +28,10 @@ const int nixSchemaVersion = 10;
 
 struct Derivation;
 
+struct RootsCache;
+
+class ReferenceGraph;
+
 
 struct OptimiseStats
 {
@@ -59,12 +66,21 @@ private:
         SQLiteStmt stmtQueryPathInfo;
         SQLiteStmt stmtQueryReferences;
         SQLiteStmt stmtQueryReferrers;
+        SQLiteStmt stmtQueryClosure;
+        SQLiteStmt stmtQueryReverseClosure;
+        SQLiteStmt stmtQueryGraphStamp;
+        SQLiteStmt stmtQueryPathsSince;
+        SQLiteStmt stmtQueryRefsSince;
+        SQLiteStmt stmtQueryValidPathCount;
+        SQLiteStmt stmtBumpGraphVersion;
         SQLiteStmt stmtInvalidatePath;
         SQLiteStmt stmtAddDerivationOutput;
         SQLiteStmt stmtQueryValidDerivers;
         SQLiteStmt stmtQueryDerivationOutputs;
         SQLiteStmt stmtQueryPathFromHashPart;
         SQLiteStmt stmtQueryValidPaths;
+        SQLiteStmt stmtQueryDrvHashModulo;
+        SQLiteStmt stmtRegisterDrvHashModulo;
 
         /* The file to which we write our temporary roots. */
 #ifndef _WIN32
@@ -93,6 +109,56 @@ private:
 
     Sync<State, std::recursive_mutex> _state;
 
+    /* A read-only connection to the Nix database.  Queries use a pool
+       of these rather than the connection in `_state', so concurrent
+       readers don't serialise on a single lock.  This requires WAL
+       mode, in which readers don't block the writer or each other. */
+    struct ReadConnection
+    {
+        SQLite db;
+        SQLiteStmt stmtQueryPathInfo;
+        SQLiteStmt stmtQueryReferences;
+        SQLiteStmt stmtQueryReferrers;
+        SQLiteStmt stmtQueryClosure;
+        SQLiteStmt stmtQueryReverseClosure;
+        SQLiteStmt stmtQueryGraphStamp;
+        SQLiteStmt stmtQueryPathsSince;
+        SQLiteStmt stmtQueryRefsSince;
+        SQLiteStmt stmtQueryValidPathCount;
+    };
+
+    std::unique_ptr<Pool<ReadConnection>> readConnections;
+
+    /* The reference graph used by computeFSClosure(), brought up to
+       date with the database before every use.  See
+       reference-graph.hh.  Null while there is no usable snapshot. */
+    Sync<std::shared_ptr<ReferenceGraph>> referenceGraph;
+
+    /* Whether a thread is building a new reference graph. */
+    std::atomic<bool> buildingReferenceGraph{false};
+
+    /* A path registration queued by registerValidPathBatched(),
+       waiting to be committed as part of a group transaction. */
+    struct PendingRegistration
+    {
+        ValidPathInfo info;
+        bool done = false;
+        std::exception_ptr exc;
+        PendingRegistration(const ValidPathInfo & info) : info(info) { }
+    };
+
+    struct RegistrationQueue
+    {
+        std::list<std::shared_ptr<PendingRegistration>> pending;
+
+        /* Whether some thread is currently committing a batch. */
+        bool committing = false;
+    };
+
+    Sync<RegistrationQueue> registrationQueue;
+
+    std::condition_variable registrationCommitted;
+
 public:
 
     PathSetting realStoreDir_;
@@ -112,6 +178,12 @@ private:
         settings.requireSigs,
         "require-sigs", "whether store paths should have a trusted signature on import"};
 
+    Setting<unsigned int> maxReadConnections{(Store*) this, 8,
+        "read-connections", "maximum number of read-only database connections used for concurrent queries (0 to disable)"};
+
+    Setting<unsigned int> registrationBatchSize{(Store*) this, 4096,
+        "registration-batch-size", "maximum number of paths registered in a single group-commit transaction"};
+
     const PublicKeys & getPublicKeys();
 
 public:
@@ -139,14 +211,28 @@ public:
     void queryPathInfoUncached(const Path & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
+    std::map<Path, std::shared_ptr<const ValidPathInfo>> queryPathInfosUncached(const PathSet & paths) override;
+
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
+    std::map<Path, PathSet> queryReferrersOfPaths(const PathSet & paths) override;
+
+    using Store::computeFSClosure;
+
+    void computeFSClosure(const PathSet & paths,
+        PathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     PathSet queryValidDerivers(const Path & path) override;
 
     PathSet queryDerivationOutputs(const Path & path) override;
 
     StringSet queryDerivationOutputNames(const Path & path) override;
 
+    std::map<Path, Hash> queryDrvHashesModulo(const PathSet & drvPaths) override;
+
+    void registerDrvHashModulo(const Path & drvPath, const Hash & hash) override;
+
     Path queryPathFromHashPart(const string & hashPart) override;
 
     PathSet querySubstitutablePaths(const PathSet & paths) override;
@@ -181,6 +267,25 @@ public:
 
     void addTempRoot(const Path & path) override;
 
+#ifndef _WIN32
+    /* The temporary roots of one client of a process that serves many
+       (i.e. the threaded daemon).  They are kept in a file of their
+       own, which is removed when the TempRootsFile is destroyed, so
+       they are released when the client goes away rather than when
+       the process exits.  The temporary roots added by a thread go to
+       the file of its innermost TempRootsScope. */
+    struct TempRootsFile;
+
+    std::shared_ptr<TempRootsFile> createTempRootsFile();
+
+    struct TempRootsScope
+    {
+        TempRootsFile * prev;
+        TempRootsScope(TempRootsFile * file);
+        ~TempRootsScope();
+    };
+#endif
+
     void addIndirectRoot(const Path & path) override;
 
     void syncWithGC() override;
@@ -220,6 +325,15 @@ public:
 
     void registerValidPaths(const ValidPathInfos & infos);
 
+    /* Like registerValidPath(), but concurrent callers are grouped
+       together: the registrations that queue up while one transaction
+       is being committed are committed by the next caller in a single
+       transaction.  A caller thus waits for at most the commit in
+       progress plus its own.  Since every caller waits until its path
+       has been committed, references registered by earlier calls are
+       always valid before their referrers. */
+    void registerValidPathBatched(const ValidPathInfo & info);
+
     unsigned int getProtocol() override;
 
     void vacuumDB();
@@ -240,6 +354,22 @@ private:
 
     void openDB(State & state, bool create);
 
+    ref<ReadConnection> openReadConnection();
+
+    /* Bring `graph' up to date with the database, loading the snapshot
+       if necessary.  Returns false (and resets `graph') if there is no
+       usable snapshot, i.e. none at all, a stale one, or one that
+       too many paths have been registered since. */
+    bool updateReferenceGraph(std::shared_ptr<ReferenceGraph> & graph);
+
+    /* Build a reference graph from the database and write it as the
+       new snapshot.  Since this scans the whole database, it's only
+       done if the caller has just had to visit `work' paths without a
+       graph, where `work' is a sizeable fraction of the valid paths,
+       so that small queries don't pay for it.  Returns null
+       otherwise. */
+    std::shared_ptr<ReferenceGraph> buildReferenceGraph(size_t work);
+
     void makeStoreWritable();
 
     uint64_t queryValidPathId(State & state, const Path & path);
@@ -280,7 +410,15 @@ private:
     AutoCloseWindowsHandle openGCLock(LockType lockType);
 #endif
 
-    void findRoots(const Path & path, unsigned char type, Roots & roots);
+    /* Create the temporary roots file `fnTempRoots', holding a read
+       lock on it. */
+#ifndef _WIN32
+    AutoCloseFD openTempRootsFile(const Path & fnTempRoots);
+#else
+    AutoCloseWindowsHandle openTempRootsFile(const Path & fnTempRoots);
+#endif
+
+    void findRoots(const Path & path, unsigned char type, Roots & roots, RootsCache & cache);
 
     void findRootsNoTemp(Roots & roots, bool censor);
 
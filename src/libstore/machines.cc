@@ -1,9 +1,12 @@
 #include "machines.hh"
 #include "util.hh"
 #include "globals.hh"
+#include "pathlocks.hh"
 
 #include <algorithm>
 
+#include <fcntl.h>
+
 namespace nix {
 
 Machine::Machine(decltype(storeUri) storeUri,
@@ -97,4 +100,205 @@ Machines getMachines()
     return machines;
 }
 
+double MachineStats::estimateCompletionTime(const Machine & machine,
+    unsigned int load, uint64_t transferBytes) const
+{
+    /* Without measurements, assume that a build takes a minute at
+       speed factor 1 and that copying runs at 10 MiB/s.  The prior is
+       blended with the measured build time, so a few unusually long
+       or short builds don't dominate. */
+    const double defaultBuildTime = 60;
+    const double defaultBandwidth = 10 * 1024 * 1024;
+    const double priorWeight = 3;
+
+    double prior = defaultBuildTime / machine.speedFactor;
+    double n = std::min((double) builds, 20.0);
+    double expectedBuildTime = (prior * priorWeight + buildTime * n) / (priorWeight + n);
+
+    /* Running builds compete for the machine's resources. */
+    double contention = 1.0 + (double) load / std::max(1U, machine.maxJobs);
+
+    double rate = bandwidth > 0 ? bandwidth : defaultBandwidth;
+
+    return transferBytes / rate + expectedBuildTime * contention;
+}
+
+std::string escapeUri(std::string uri)
+{
+    std::replace(uri.begin(), uri.end(), '/', '_');
+    return uri;
+}
+
+static Path statsFileFor(const Path & currentLoad, const Machine & machine)
+{
+    return fmt("%s/%s.stats", currentLoad, escapeUri(machine.storeUri));
+}
+
+MachineStats readMachineStats(const Path & currentLoad, const Machine & machine)
+{
+    MachineStats stats;
+
+    auto statsFile = statsFileFor(currentLoad, machine);
+    if (!pathExists(statsFile)) return stats;
+
+    try {
+        for (auto & line : tokenizeString<Strings>(readFile(statsFile), "\n")) {
+            auto tokens = tokenizeString<std::vector<string>>(line);
+            if (tokens.size() != 2) continue;
+            if (tokens[0] == "builds") stats.builds = std::stoull(tokens[1]);
+            else if (tokens[0] == "build-time") stats.buildTime = std::stod(tokens[1]);
+            else if (tokens[0] == "bytes-copied") stats.bytesCopied = std::stoull(tokens[1]);
+            else if (tokens[0] == "bandwidth") stats.bandwidth = std::stod(tokens[1]);
+            else if (tokens[0] == "bytes-avoided") stats.bytesAvoided = std::stoull(tokens[1]);
+        }
+    } catch (std::exception & e) {
+        /* Stale or corrupt statistics aren't worth failing over. */
+        debug("ignoring builder statistics in '%s': %s", statsFile, e.what());
+        return MachineStats();
+    }
+
+    return stats;
+}
+
+void recordMachineStats(const Path & currentLoad, const Machine & machine,
+    double buildTime, uint64_t bytesCopied, double copyTime, uint64_t bytesAvoided)
+{
+    const double alpha = 0.3;
+
+    auto statsFile = statsFileFor(currentLoad, machine);
+
+    auto lock = openLockFile(statsFile + ".lock", true);
+    lockFile(lock.get(), ltWrite, true);
+
+    auto stats = readMachineStats(currentLoad, machine);
+
+    stats.buildTime = stats.builds ? alpha * buildTime + (1 - alpha) * stats.buildTime : buildTime;
+    stats.builds++;
+
+    /* Small copies mostly measure latency, not bandwidth. */
+    if (bytesCopied >= 1024 * 1024 && copyTime > 0) {
+        double rate = bytesCopied / copyTime;
+        stats.bandwidth = stats.bandwidth > 0 ? alpha * rate + (1 - alpha) * stats.bandwidth : rate;
+    }
+    stats.bytesCopied += bytesCopied;
+    stats.bytesAvoided += bytesAvoided;
+
+    auto tmpFile = statsFile + ".tmp";
+    writeFile(tmpFile, fmt("builds %d\nbuild-time %f\nbytes-copied %d\nbandwidth %f\nbytes-avoided %d\n",
+        stats.builds, stats.buildTime, stats.bytesCopied, stats.bandwidth, stats.bytesAvoided));
+#ifndef _WIN32
+    if (rename(tmpFile.c_str(), statsFile.c_str()) == -1)
+        throw PosixError("renaming '%s' to '%s'", tmpFile, statsFile);
+#else
+    if (!MoveFileExW(pathW(tmpFile).c_str(), pathW(statsFile).c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+        throw WinError("MoveFileExW '%1%' '%2%'", tmpFile, statsFile);
+#endif
+}
+
+static Path presentFileFor(const Path & currentLoad, const Machine & machine)
+{
+    return fmt("%s/%s.present", currentLoad, escapeUri(machine.storeUri));
+}
+
+PathSet readPresentPaths(const Path & currentLoad, const Machine & machine)
+{
+    auto presentFile = presentFileFor(currentLoad, machine);
+    if (!pathExists(presentFile)) return {};
+    return tokenizeString<PathSet>(readFile(presentFile), "\n");
+}
+
+void recordPresentPaths(const Path & currentLoad, const Machine & machine,
+    const PathSet & present, const PathSet & absent)
+{
+    /* Bound the size of the file; when it gets too big, start over
+       from what we know now. */
+    const size_t maxPaths = 1 << 16;
+
+    auto presentFile = presentFileFor(currentLoad, machine);
+
+    auto lock = openLockFile(presentFile + ".lock", true);
+    lockFile(lock.get(), ltWrite, true);
+
+    auto paths = readPresentPaths(currentLoad, machine);
+    if (paths.size() + present.size() > maxPaths) paths.clear();
+    for (auto & path : absent) paths.erase(path);
+    paths.insert(present.begin(), present.end());
+
+    auto tmpFile = presentFile + ".tmp";
+    writeFile(tmpFile, concatStringsSep("\n", paths) + "\n");
+#ifndef _WIN32
+    if (rename(tmpFile.c_str(), presentFile.c_str()) == -1)
+        throw PosixError("renaming '%s' to '%s'", tmpFile, presentFile);
+#else
+    if (!MoveFileExW(pathW(tmpFile).c_str(), pathW(presentFile).c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+        throw WinError("MoveFileExW '%1%' '%2%'", tmpFile, presentFile);
+#endif
+}
+
+unsigned int countBusySlots(const Path & currentLoad, const Machine & machine)
+{
+    /* The build hook holds a write lock on the slot file of every slot
+       in use.  Only test for that with a shared lock, and don't create
+       slot files, so that this neither takes a slot nor requires
+       write access.  Slot files that don't exist or that we can't open
+       are taken to be free. */
+    unsigned int busy = 0;
+    for (unsigned long long slot = 0; slot < machine.maxJobs; ++slot) {
+        auto slotFile = fmt("%s/%s-%d", currentLoad, escapeUri(machine.storeUri), slot);
+#ifndef _WIN32
+        AutoCloseFD fd = open(slotFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) continue;
+#else
+        if (!pathExists(slotFile)) continue;
+        AutoCloseWindowsHandle fd;
+        try {
+            fd = openLockFile(slotFile, false);
+        } catch (WinError & e) {
+            continue;
+        }
+#endif
+        if (!lockFile(fd.get(), ltRead, false)) busy++;
+    }
+    return busy;
+}
+
+double estimateBuildTime(const Path & currentLoad, const Machine & machine,
+    unsigned int load, const std::map<Path, uint64_t> & inputClosure)
+{
+    uint64_t transferBytes = 0;
+    auto present = readPresentPaths(currentLoad, machine);
+    for (auto & i : inputClosure)
+        if (!present.count(i.first)) transferBytes += i.second;
+    auto time = readMachineStats(currentLoad, machine)
+        .estimateCompletionTime(machine, load, transferBytes);
+    debug("expecting a build on '%s' to take %.1f seconds, copying %d bytes",
+        machine.storeUri, time, transferBytes);
+    return time;
+}
+
+const Machine * predictMachine(const Machines & machines, const Path & currentLoad,
+    const std::string & system, const std::set<string> & requiredFeatures,
+    const std::map<Path, uint64_t> & inputClosure)
+{
+    const Machine * bestMachine = nullptr;
+    double bestTime = 0;
+
+    for (auto & m : machines) {
+        if (!m.enabled
+            || std::find(m.systemTypes.begin(), m.systemTypes.end(), system) == m.systemTypes.end()
+            || !m.allSupported(requiredFeatures)
+            || !m.mandatoryMet(requiredFeatures))
+            continue;
+        auto time = estimateBuildTime(currentLoad, m, countBusySlots(currentLoad, m), inputClosure);
+        if (!bestMachine || time < bestTime
+            || (time == bestTime && m.speedFactor > bestMachine->speedFactor))
+        {
+            bestMachine = &m;
+            bestTime = time;
+        }
+    }
+
+    return bestMachine;
+}
+
 }
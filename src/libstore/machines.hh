@@ -36,4 +36,65 @@ void parseMachines(const std::string & s, Machines & machines);
 
 Machines getMachines();
 
+/* Measurements of a remote builder, recorded by the build hook in its
+   `current-load' directory so that later invocations can use them to
+   choose a builder. */
+struct MachineStats
+{
+    /* The number of builds done on the machine, and the exponential
+       moving average of their duration in seconds. */
+    uint64_t builds = 0;
+    double buildTime = 0;
+
+    /* The number of bytes copied to the machine, and the exponential
+       moving average of the transfer rate in bytes per second. */
+    uint64_t bytesCopied = 0;
+    double bandwidth = 0;
+
+    /* The number of bytes that didn't have to be copied because the
+       machine already had them. */
+    uint64_t bytesAvoided = 0;
+
+    /* Estimate the number of seconds it takes to copy `transferBytes'
+       to `machine' and to build there while `load' other builds are
+       running on it. */
+    double estimateCompletionTime(const Machine & machine,
+        unsigned int load, uint64_t transferBytes) const;
+};
+
+/* Turn a store URI into something usable as a file name. */
+std::string escapeUri(std::string uri);
+
+MachineStats readMachineStats(const Path & currentLoad, const Machine & machine);
+
+/* Record a build of `buildTime' seconds on `machine', before which
+   `bytesCopied' bytes were copied to it in `copyTime' seconds and
+   `bytesAvoided' bytes were already present. */
+void recordMachineStats(const Path & currentLoad, const Machine & machine,
+    double buildTime, uint64_t bytesCopied, double copyTime, uint64_t bytesAvoided);
+
+/* Return the store paths known to be valid on `machine'.  This is only
+   a hint: the machine may have garbage-collected them since. */
+PathSet readPresentPaths(const Path & currentLoad, const Machine & machine);
+
+/* Update the paths known to be valid on `machine'. */
+void recordPresentPaths(const Path & currentLoad, const Machine & machine,
+    const PathSet & present, const PathSet & absent);
+
+/* Return the number of build slots of `machine' that are in use. */
+unsigned int countBusySlots(const Path & currentLoad, const Machine & machine);
+
+/* Estimate how long a build on `machine' takes while `load' other
+   builds are running on it, given the NAR sizes of the paths in its
+   input closure.  Paths known to be present on the machine don't
+   count towards the copying time. */
+double estimateBuildTime(const Path & currentLoad, const Machine & machine,
+    unsigned int load, const std::map<Path, uint64_t> & inputClosure);
+
+/* Return the machine that the build hook would most likely choose for
+   a derivation, or nullptr if none of the machines can build it. */
+const Machine * predictMachine(const Machines & machines, const Path & currentLoad,
+    const std::string & system, const std::set<string> & requiredFeatures,
+    const std::map<Path, uint64_t> & inputClosure);
+
 }
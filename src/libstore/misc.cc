@@ -240,6 +240,19 @@ void Store::queryMissing(const PathSet & targets,
 
 
 Paths Store::topoSortPaths(const PathSet & paths)
+{
+    auto infos = queryPathInfos(paths);
+
+    return topoSortPaths(paths, [&](const Path & path) -> const PathSet & {
+        static const PathSet noReferences;
+        auto info = infos.find(path);
+        return info == infos.end() ? noReferences : info->second->references;
+    });
+}
+
+
+Paths Store::topoSortPaths(const PathSet & paths,
+    std::function<const PathSet & (const Path &)> getReferences)
 {
     Paths sorted;
     PathSet visited, parents;
@@ -253,13 +266,7 @@ Paths Store::topoSortPaths(const PathSet & paths)
         if (!visited.insert(path).second) return;
         parents.insert(path);
 
-        PathSet references;
-        try {
-            references = queryPathInfo(path)->references;
-        } catch (InvalidPath &) {
-        }
-
-        for (auto & i : references)
+        for (auto & i : getReferences(path))
             /* Don't traverse into paths that don't exist.  That can
                happen due to substitutes for non-existent paths. */
             if (i != path && paths.find(i) != paths.end())
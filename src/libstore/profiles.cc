@@ -36,35 +36,217 @@ static int parseName(const string & profileName, const string & name)
 }
 
 
-// TODO: make a Windows native
-Generations findGenerations(Path profile, int & curGen)
+/* Each profile has an index of its generations (number, target and
+   creation time), stored in `<dir>/.generations/<profile>', so that
+   listing them doesn't take a readlink() of every generation link.
+   The index is only a cache.  It records the device, inode and status
+   change time of the profile directory, which changes whenever a
+   generation link is created, removed or replaced; while those are
+   unchanged, the index is used as is.  Otherwise it's checked against
+   the directory listing, so generation links added or removed behind
+   our back are picked up, and every entry records the inode and
+   status change time of its link, so a link that was replaced is read
+   again.  The index is kept in a subdirectory so that rewriting it
+   doesn't change the profile directory itself. */
+static Path indexFileOf(const Path & profileDir, const string & profileName)
 {
-    Generations gens;
+    return profileDir + "/.generations/" + profileName;
+}
 
-    Path profileDir = dirOf(profile);
-    string profileName = baseNameOf(profile);
 
-    for (auto & i : readDirectory(profileDir)) {
-        int n;
-        auto name = i.name();
-        if ((n = parseName(profileName, name)) != -1) {
-            Generation gen;
-            gen.path = profileDir + "/" + name;
-            gen.number = n;
-            struct stat st;
+struct IndexEntry
+{
+    Generation gen;
+    uint64_t ino = 0, ctime = 0;
+};
+
+
+struct Index
+{
+    uint64_t dev = 0, ino = 0, ctime = 0; /* of the profile directory */
+    std::map<int, IndexEntry> entries;
+};
+
+
+static Index readIndex(const Path & indexFile)
+{
+    Index index;
+
+    string contents;
+    try {
+        contents = readFile(indexFile);
+    } catch (SysError & e) {
+        return index;
+#ifdef _WIN32
+    } catch (WinError & e) {
+        return index;
+#endif
+    }
+
+    auto lines = tokenizeString<Strings>(contents, "\n");
+    if (lines.empty()) return index;
+    auto header = tokenizeString<std::vector<string>>(lines.front(), "\t");
+    if (header.size() != 4
+        || header[0] != "3"
+        || !string2Int(header[1], index.dev)
+        || !string2Int(header[2], index.ino)
+        || !string2Int(header[3], index.ctime))
+        return {};
+    lines.pop_front();
+
+    for (auto & line : lines) {
+        auto fields = tokenizeString<std::vector<string>>(line, "\t");
+        IndexEntry entry;
+        long long creationTime;
+        if (fields.size() != 5
+            || !string2Int(fields[0], entry.gen.number)
+            || !string2Int(fields[1], creationTime)
+            || !string2Int(fields[2], entry.ino)
+            || !string2Int(fields[3], entry.ctime))
+            return {};
+        entry.gen.creationTime = creationTime;
+        entry.gen.target = fields[4];
+        index.entries[entry.gen.number] = entry;
+    }
+
+    return index;
+}
+
+
+static void writeIndex(const Path & indexFile, const Index & index)
+{
+    string s = fmt("3\t%d\t%d\t%d\n", index.dev, index.ino, index.ctime);
+    for (auto & i : index.entries)
+        s += fmt("%d\t%d\t%d\t%d\t%s\n", i.first, (long long) i.second.gen.creationTime,
+            i.second.ino, i.second.ctime, i.second.gen.target);
+
+    createDirs(dirOf(indexFile));
+#ifndef _WIN32
+    Path tmpFile = fmt("%s.tmp.%d", indexFile, getpid());
+#else
+    Path tmpFile = fmt("%s.tmp.%d", indexFile, GetCurrentProcessId());
+#endif
+    writeFile(tmpFile, s);
 #ifndef _WIN32
-            if (lstat(gen.path.c_str(), &st) != 0)
+    if (rename(tmpFile.c_str(), indexFile.c_str()) == -1)
+        throw PosixError("cannot rename '%s' to '%s'", tmpFile, indexFile);
 #else
-            if (stat(gen.path.c_str(), &st) != 0)
+    if (!MoveFileExW(pathW(tmpFile).c_str(), pathW(indexFile).c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+        throw WinError("MoveFileExW '%1%' '%2%'", tmpFile, indexFile);
+#endif
+}
+
+
+/* Return the generations of `profileName' in `profileDir'.  If the
+   directory hasn't changed since the index was written, the index is
+   returned as is.  Otherwise the directory is listed by calling
+   `listDir', and the index is used for the generation links that
+   haven't changed since they were indexed.  Generation links that
+   can't be read (for instance because they were removed in the
+   meantime) are skipped.  If the index is out of date and
+   `updateIndex' is set, it is rewritten. */
+static Generations findGenerations(const Path & profileDir, const string & profileName,
+    std::function<StringSet()> listDir, bool updateIndex)
+{
+    Generations gens;
+
+    auto indexFile = indexFileOf(profileDir, profileName);
+    auto indexed = readIndex(indexFile);
+
+    Index index;
+#ifndef _WIN32
+    /* Get the status of the directory before listing it, so that we
+       never record a status that's newer than the listing.  A
+       directory changed in the second we started could change again
+       without its status change time changing on file systems with
+       coarse timestamps, so then we don't record its status. */
+    auto startTime = time(0);
+    struct stat st;
+    if (stat(profileDir.c_str(), &st) == -1)
+        throw PosixError("getting status of '%1%'", profileDir);
+    if (st.st_ctime < startTime) {
+        index.dev = st.st_dev;
+        index.ino = st.st_ino;
+        index.ctime = statusChangeTime(st);
+    }
 #endif
-                throw PosixError(format("statting '%1%'") % gen.path);
-            gen.creationTime = st.st_mtime;
+    /* On Windows, the status change time of a directory is its
+       creation time, so the directory status is never recorded. */
+
+    if (index.ctime && index.dev == indexed.dev && index.ino == indexed.ino && index.ctime == indexed.ctime) {
+        for (auto & i : indexed.entries) {
+            auto gen = i.second.gen;
+            gen.path = profileDir + "/" + profileName + "-" + std::to_string(i.first) + "-link";
             gens.push_back(gen);
         }
+        return gens;
     }
 
+    bool dirty = index.dev != indexed.dev || index.ino != indexed.ino || index.ctime != indexed.ctime;
+
+    for (auto & name : listDir()) {
+        int n;
+        if ((n = parseName(profileName, name)) == -1) continue;
+        Path path = profileDir + "/" + name;
+
+        IndexEntry entry;
+        try {
+            auto st = lstatPath(path);
+            entry.ino = st.st_ino;
+            entry.ctime = statusChangeTime(st);
+            auto j = indexed.entries.find(n);
+            if (j != indexed.entries.end() && j->second.ino == entry.ino && j->second.ctime == entry.ctime)
+                entry.gen = j->second.gen;
+            else {
+                entry.gen.number = n;
+                entry.gen.creationTime = st.st_mtime;
+                entry.gen.target = readLink(path);
+                dirty = true;
+            }
+        } catch (Error & e) {
+            debug("skipping generation link '%s': %s", path, e.msg());
+            dirty = true;
+            continue;
+        }
+
+        entry.gen.path = path;
+        gens.push_back(entry.gen);
+        index.entries[n] = entry;
+    }
+
+    /* Generations that have disappeared. */
+    if (index.entries.size() != indexed.entries.size()) dirty = true;
+
     gens.sort(cmpGensByNumber);
 
+    if (dirty && updateIndex) {
+        try {
+            writeIndex(indexFile, index);
+        } catch (SysError & e) {
+            debug("cannot update generation index '%s': %s", indexFile, e.msg());
+#ifdef _WIN32
+        } catch (WinError & e) {
+            debug("cannot update generation index '%s': %s", indexFile, e.msg());
+#endif
+        }
+    }
+
+    return gens;
+}
+
+
+Generations findGenerations(Path profile, int & curGen)
+{
+    Path profileDir = dirOf(profile);
+    string profileName = baseNameOf(profile);
+
+    Generations gens = findGenerations(profileDir, profileName, [&]() {
+        StringSet names;
+        for (auto & i : readDirectory(profileDir))
+            names.insert(i.name());
+        return names;
+    }, true);
+
     curGen = pathExists(profile)
         ? parseName(profileName, readLink(profile))
         : -1;
@@ -73,6 +255,34 @@ Generations findGenerations(Path profile, int & curGen)
 }
 
 
+std::map<string, Generations> findIndexedGenerations(const Path & dir, const StringSet & names)
+{
+    std::map<string, Generations> res;
+
+    if (!names.count(".generations")) return res;
+
+    try {
+        for (auto & i : readDirectory(dir + "/.generations")) {
+            auto profileName = i.name();
+            if (profileName.find(".tmp.") != string::npos) continue;
+            res[profileName] = findGenerations(dir, profileName, [&]() { return names; }, false);
+        }
+    } catch (Error & e) {
+        debug("ignoring generation indices in '%s': %s", dir, e.msg());
+        res.clear();
+    }
+
+    return res;
+}
+
+
+static void updateIndex(const Path & profile)
+{
+    int dummy;
+    findGenerations(profile, dummy);
+}
+
+
 static void makeName(const Path & profile, unsigned int num,
     Path & outLink)
 {
@@ -117,6 +327,8 @@ Path createGeneration(ref<LocalFSStore> store, Path profile, Path outPath)
     makeName(profile, num + 1, generation);
     store->addPermRoot(outPath, generation, false, true);
 
+    updateIndex(profile);
+
     return generation;
 }
 
@@ -133,6 +345,7 @@ void deleteGeneration(const Path & profile, unsigned int gen)
     Path generation;
     makeName(profile, gen, generation);
     removeFile(generation);
+    updateIndex(profile);
 }
 
 
@@ -142,7 +355,9 @@ static void deleteGeneration2(const Path & profile, unsigned int gen, bool dryRu
         printInfo(format("would remove generation %1%") % gen);
     else {
         printInfo(format("removing generation %1%") % gen);
-        deleteGeneration(profile, gen);
+        Path generation;
+        makeName(profile, gen, generation);
+        removeFile(generation);
     }
 }
 
@@ -162,6 +377,8 @@ void deleteGenerations(const Path & profile, const std::set<unsigned int> & gens
         if (gensToDelete.find(i.number) == gensToDelete.end()) continue;
         deleteGeneration2(profile, i.number, dryRun);
     }
+
+    if (!dryRun) updateIndex(profile);
 }
 
 void deleteGenerationsGreaterThan(const Path & profile, int max, bool dryRun)
@@ -186,6 +403,8 @@ void deleteGenerationsGreaterThan(const Path & profile, int max, bool dryRun)
             deleteGeneration2(profile, i->number, dryRun);
         }
     }
+
+    if (!dryRun) updateIndex(profile);
 }
 
 void deleteOldGenerations(const Path & profile, bool dryRun)
@@ -199,6 +418,8 @@ void deleteOldGenerations(const Path & profile, bool dryRun)
     for (auto & i : gens)
         if (i.number != curGen)
             deleteGeneration2(profile, i.number, dryRun);
+
+    if (!dryRun) updateIndex(profile);
 }
 
 
@@ -223,6 +444,8 @@ void deleteGenerationsOlderThan(const Path & profile, time_t t, bool dryRun)
                time. */
             canDelete = true;
         }
+
+    if (!dryRun) updateIndex(profile);
 }
 
 
@@ -13,6 +13,7 @@ struct Generation
 {
     int number;
     Path path;
+    Path target;
     time_t creationTime;
     Generation()
     {
@@ -31,6 +32,13 @@ typedef list<Generation> Generations;
    profile, sorted by generation number. */
 Generations findGenerations(Path profile, int & curGen);
 
+/* Returns the generations of the profiles in directory `dir' that
+   have a generation index, given the names of the entries of `dir'.
+   This lets the garbage collector find roots without reading every
+   generation link.  Unlike findGenerations(), this doesn't update the
+   indices. */
+std::map<string, Generations> findIndexedGenerations(const Path & dir, const StringSet & names);
+
 class LocalFSStore;
 
 Path createGeneration(ref<LocalFSStore> store, Path profile, Path outPath);
@@ -0,0 +1,404 @@
+#include "reference-graph.hh"
+#include "store-api.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include <fcntl.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+
+namespace nix {
+
+
+/* The layout of a snapshot is the header, followed by
+
+     uint64_t ids[nrNodes];             path IDs, ascending
+     uint64_t nameOffsets[nrNodes + 1]; offsets into `names'
+     uint32_t fwdStart[nrNodes + 1];    start of each node's references
+     uint32_t fwdEdges[nrEdges];
+     uint32_t revStart[nrNodes + 1];    start of each node's referrers
+     uint32_t revEdges[nrEdges];
+     uint32_t byName[nrNodes];          nodes sorted by name
+     char names[namesSize];             base names of the paths
+
+   in native byte order. */
+struct GraphHeader
+{
+    uint64_t magic;
+    uint64_t version;
+    uint64_t maxId;
+    uint64_t nrNodes;
+    uint64_t nrEdges;
+    uint64_t namesSize;
+};
+
+static const uint64_t graphMagic = 0x314850524758494eULL; // "NIXGRPH1"
+
+
+/* The size of a snapshot.  The caller must ensure that the counts
+   fit in 32 bits (and `namesSize' in the file) to avoid overflow. */
+static uint64_t snapshotFileSize(uint64_t nrNodes, uint64_t nrEdges, uint64_t namesSize)
+{
+    return sizeof(GraphHeader)
+        + sizeof(uint64_t) * (nrNodes + nrNodes + 1)
+        + sizeof(uint32_t) * ((nrNodes + 1) * 2 + nrEdges * 2 + nrNodes)
+        + namesSize;
+}
+
+
+ReferenceGraph::ReferenceGraph(const Path & storeDir, uint64_t version,
+    const std::vector<PathEntry> & paths, const std::vector<RefEntry> & refs)
+    : storeDir(storeDir)
+{
+    auto prefixSize = storeDir.size() + 1;
+
+    uint64_t namesSize = 0;
+    for (auto & i : paths) namesSize += i.second.size() - prefixSize;
+
+    if (paths.size() >= std::numeric_limits<Node>::max() || refs.size() >= std::numeric_limits<uint32_t>::max())
+        throw Error("the Nix store is too large for a reference graph snapshot");
+
+    auto findNode = [&](uint64_t id) {
+        auto i = std::lower_bound(paths.begin(), paths.end(), PathEntry{id, ""},
+            [](const PathEntry & a, const PathEntry & b) { return a.first < b.first; });
+        assert(i != paths.end() && i->first == id);
+        return (Node) (i - paths.begin());
+    };
+
+    std::vector<std::pair<Node, Node>> edges;
+    edges.reserve(refs.size());
+    for (auto & i : refs)
+        edges.emplace_back(findNode(i.first), findNode(i.second));
+
+    GraphHeader header;
+    header.magic = graphMagic;
+    header.version = version;
+    header.maxId = paths.empty() ? 0 : paths.back().first;
+    header.nrNodes = paths.size();
+    header.nrEdges = edges.size();
+    header.namesSize = namesSize;
+
+    buffer.reserve(snapshotFileSize(header.nrNodes, header.nrEdges, namesSize));
+
+    auto append = [&](const void * p, size_t n) {
+        buffer.append((const char *) p, n);
+    };
+
+    append(&header, sizeof(header));
+
+    for (auto & i : paths)
+        append(&i.first, sizeof(uint64_t));
+
+    uint64_t offset = 0;
+    for (auto & i : paths) {
+        append(&offset, sizeof(offset));
+        offset += i.second.size() - prefixSize;
+    }
+    append(&offset, sizeof(offset));
+
+    /* Write the edges grouped by their first component, preceded by
+       the start of each group. */
+    auto appendRows = [&](std::vector<std::pair<Node, Node>> & edges) {
+        std::sort(edges.begin(), edges.end());
+        uint32_t pos = 0;
+        for (Node node = 0; node <= paths.size(); node++) {
+            while (pos < edges.size() && edges[pos].first < node) pos++;
+            append(&pos, sizeof(pos));
+        }
+        for (auto & i : edges)
+            append(&i.second, sizeof(Node));
+    };
+
+    appendRows(edges);
+    for (auto & i : edges) std::swap(i.first, i.second);
+    appendRows(edges);
+
+    std::vector<Node> sorted(paths.size());
+    for (Node node = 0; node < paths.size(); node++) sorted[node] = node;
+    std::sort(sorted.begin(), sorted.end(), [&](Node a, Node b) {
+        return paths[a].second < paths[b].second;
+    });
+    append(sorted.data(), sizeof(Node) * sorted.size());
+
+    for (auto & i : paths)
+        buffer.append(i.second, prefixSize, string::npos);
+
+    data = buffer.data();
+    size = buffer.size();
+    parse();
+}
+
+
+ReferenceGraph::ReferenceGraph(const Path & storeDir, const Path & file)
+    : storeDir(storeDir)
+{
+#ifndef _WIN32
+    AutoCloseFD fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw PosixError("opening reference graph '%s'", file);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw PosixError("statting reference graph '%s'", file);
+
+    size = st.st_size;
+    if (size < sizeof(GraphHeader))
+        throw Error("reference graph '%s' is truncated", file);
+
+    auto p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (p == MAP_FAILED)
+        throw PosixError("mapping reference graph '%s'", file);
+    data = (const char *) p;
+    mapped = true;
+#else
+    buffer = readFile(file);
+    data = buffer.data();
+    size = buffer.size();
+    if (size < sizeof(GraphHeader))
+        throw Error("reference graph '%s' is truncated", file);
+#endif
+
+    auto header = (const GraphHeader *) data;
+    if (header->magic != graphMagic
+        || header->nrNodes >= std::numeric_limits<Node>::max()
+        || header->nrEdges >= std::numeric_limits<uint32_t>::max()
+        || header->namesSize > size
+        || snapshotFileSize(header->nrNodes, header->nrEdges, header->namesSize) != size)
+        throw Error("reference graph '%s' is malformed", file);
+
+    parse();
+    check(file);
+}
+
+
+std::optional<uint64_t> ReferenceGraph::readVersion(const Path & file)
+{
+    GraphHeader header;
+    try {
+#ifndef _WIN32
+        AutoCloseFD fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) return {};
+        readFull(fd.get(), (unsigned char *) &header, sizeof(header));
+#else
+        if (!pathExists(file)) return {};
+        auto s = readFile(file);
+        if (s.size() < sizeof(header)) return {};
+        memcpy(&header, s.data(), sizeof(header));
+#endif
+    } catch (EndOfFile &) {
+        return {};
+    }
+    if (header.magic != graphMagic) return {};
+    return header.version;
+}
+
+
+ReferenceGraph::~ReferenceGraph()
+{
+#ifndef _WIN32
+    if (mapped) munmap((void *) data, size);
+#endif
+}
+
+
+void ReferenceGraph::parse()
+{
+    auto header = (const GraphHeader *) data;
+    version = header->version;
+    snapshotMaxId = overlayMaxId = header->maxId;
+    nrNodes = header->nrNodes;
+    nrEdges = header->nrEdges;
+
+    auto p = data + sizeof(GraphHeader);
+    auto take64 = [&](size_t n) {
+        auto res = (const uint64_t *) p;
+        p += sizeof(uint64_t) * n;
+        return res;
+    };
+    auto take32 = [&](size_t n) {
+        auto res = (const uint32_t *) p;
+        p += sizeof(uint32_t) * n;
+        return res;
+    };
+
+    ids = take64(nrNodes);
+    nameOffsets = take64(nrNodes + 1);
+    fwdStart = take32(nrNodes + 1);
+    fwdEdges = take32(nrEdges);
+    revStart = take32(nrNodes + 1);
+    revEdges = take32(nrEdges);
+    byName = take32(nrNodes);
+    names = p;
+}
+
+
+void ReferenceGraph::check(const Path & file) const
+{
+    auto namesSize = ((const GraphHeader *) data)->namesSize;
+
+    auto checkRows = [&](const uint32_t * start, const uint32_t * edges) {
+        if (start[0] != 0 || start[nrNodes] != nrEdges) return false;
+        for (uint64_t node = 0; node < nrNodes; node++)
+            if (start[node] > start[node + 1]) return false;
+        for (uint64_t i = 0; i < nrEdges; i++)
+            if (edges[i] >= nrNodes) return false;
+        return true;
+    };
+
+    bool ok =
+        nameOffsets[0] == 0
+        && nameOffsets[nrNodes] == namesSize
+        && (nrNodes == 0 || ids[nrNodes - 1] == snapshotMaxId)
+        && checkRows(fwdStart, fwdEdges)
+        && checkRows(revStart, revEdges);
+
+    for (uint64_t node = 0; ok && node < nrNodes; node++)
+        ok = nameOffsets[node] <= nameOffsets[node + 1]
+            && (node == 0 || ids[node - 1] < ids[node])
+            && byName[node] < nrNodes;
+
+    for (uint64_t i = 1; ok && i < nrNodes; i++)
+        ok = name(byName[i - 1]) < name(byName[i]);
+
+    if (!ok)
+        throw Error("reference graph '%s' is malformed", file);
+}
+
+
+void ReferenceGraph::write(const Path & file) const
+{
+#ifndef _WIN32
+    Path tmpFile = fmt("%s.tmp.%d", file, getpid());
+#else
+    Path tmpFile = fmt("%s.tmp.%d", file, GetCurrentProcessId());
+#endif
+    writeFile(tmpFile, string(data, size));
+#ifndef _WIN32
+    if (rename(tmpFile.c_str(), file.c_str()) == -1)
+        throw PosixError("cannot rename '%s' to '%s'", tmpFile, file);
+#else
+    if (!MoveFileExW(pathW(tmpFile).c_str(), pathW(file).c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+        throw WinError("MoveFileExW '%1%' '%2%'", tmpFile, file);
+#endif
+}
+
+
+std::string_view ReferenceGraph::name(Node node) const
+{
+    if (node < nrNodes)
+        return std::string_view(names + nameOffsets[node], nameOffsets[node + 1] - nameOffsets[node]);
+    return overlayNames[node - nrNodes];
+}
+
+
+std::optional<ReferenceGraph::Node> ReferenceGraph::findId(uint64_t id) const
+{
+    if (id > snapshotMaxId) {
+        auto i = overlayById.find(id);
+        if (i == overlayById.end()) return {};
+        return i->second;
+    }
+    auto i = std::lower_bound(ids, ids + nrNodes, id);
+    if (i == ids + nrNodes || *i != id) return {};
+    return (Node) (i - ids);
+}
+
+
+std::optional<ReferenceGraph::Node> ReferenceGraph::findPath(const Path & path) const
+{
+    if (path.size() <= storeDir.size() + 1
+        || path.compare(0, storeDir.size(), storeDir) != 0
+        || path[storeDir.size()] != '/')
+        return {};
+
+    std::string_view baseName(path.data() + storeDir.size() + 1, path.size() - storeDir.size() - 1);
+
+    auto i = std::lower_bound(byName, byName + nrNodes, baseName,
+        [&](Node node, std::string_view s) { return name(node) < s; });
+    if (i != byName + nrNodes && name(*i) == baseName) return *i;
+
+    auto j = overlayByName.find(string(baseName));
+    if (j != overlayByName.end()) return j->second;
+
+    return {};
+}
+
+
+void ReferenceGraph::addToOverlay(const std::vector<PathEntry> & paths, const std::vector<RefEntry> & refs)
+{
+    auto prefixSize = storeDir.size() + 1;
+
+    for (auto & i : paths) {
+        assert(i.first > overlayMaxId);
+        Node node = nrNodes + overlayNames.size();
+        overlayNames.push_back(string(i.second, prefixSize));
+        overlayByName.emplace(overlayNames.back(), node);
+        overlayById.emplace(i.first, node);
+        overlayRefs.emplace_back();
+        overlayMaxId = i.first;
+    }
+
+    for (auto & i : refs) {
+        auto referrer = findId(i.first);
+        auto reference = findId(i.second);
+        assert(referrer && *referrer >= nrNodes && reference);
+        overlayRefs[*referrer - nrNodes].push_back(*reference);
+        overlayReferrers[*reference].push_back(*referrer);
+    }
+}
+
+
+void ReferenceGraph::computeClosure(const PathSet & paths, PathSet & out, bool reverse) const
+{
+    std::vector<bool> visited(nrNodes + overlayNames.size(), false);
+    std::vector<Node> todo;
+
+    for (auto & path : paths) {
+        auto node = findPath(path);
+        if (!node)
+            throw InvalidPath("path '%s' is not valid", path);
+        if (!visited[*node]) {
+            visited[*node] = true;
+            todo.push_back(*node);
+        }
+    }
+
+    auto visit = [&](Node node) {
+        if (visited[node]) return;
+        visited[node] = true;
+        todo.push_back(node);
+    };
+
+    while (!todo.empty()) {
+        auto node = todo.back();
+        todo.pop_back();
+
+        out.insert(storeDir + "/" + string(name(node)));
+
+        if (node < nrNodes) {
+            auto start = reverse ? revStart : fwdStart;
+            auto edges = reverse ? revEdges : fwdEdges;
+            for (auto i = start[node]; i < start[node + 1]; i++)
+                visit(edges[i]);
+        }
+
+        if (reverse) {
+            auto i = overlayReferrers.find(node);
+            if (i != overlayReferrers.end())
+                for (auto referrer : i->second) visit(referrer);
+        } else if (node >= nrNodes)
+            for (auto reference : overlayRefs[node - nrNodes]) visit(reference);
+    }
+}
+
+
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "types.hh"
+
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+
+namespace nix {
+
+
+/* The reference graph of a Nix store in compressed sparse row form:
+   the references and referrers of every valid path are stored as
+   contiguous ranges of node numbers, so computing a closure takes a
+   few array lookups per path rather than a database query.
+
+   A graph consists of a snapshot, which is written to disk and
+   mmap()ed by later processes, and an in-memory overlay of the paths
+   registered since the snapshot was taken.  Because paths are
+   numbered in the order in which they were registered, and the
+   references of a path are registered together with it, the overlay
+   can be brought up to date by querying the paths and references with
+   an ID higher than any seen so far.  Anything else, such as deleting a
+   path, makes the snapshot stale; this is detected by the caller through
+   a version counter kept in the database.  The one exception is an
+   older version of Nix re-registering an existing path with different
+   references, which doesn't bump the counter. */
+class ReferenceGraph
+{
+public:
+
+    typedef uint32_t Node;
+
+    /* A path as stored in the database: its ID and its path. */
+    typedef std::pair<uint64_t, Path> PathEntry;
+
+    /* A reference from one path ID to another. */
+    typedef std::pair<uint64_t, uint64_t> RefEntry;
+
+    /* The value of the database's graph version counter when the
+       snapshot was taken. */
+    uint64_t version = 0;
+
+    /* The highest path ID in the snapshot. */
+    uint64_t snapshotMaxId = 0;
+
+    /* Build a snapshot from the given paths, which must be sorted by
+       ID, and references. */
+    ReferenceGraph(const Path & storeDir, uint64_t version,
+        const std::vector<PathEntry> & paths, const std::vector<RefEntry> & refs);
+
+    /* Map the snapshot in `file'.  Throws if it is missing or
+       malformed. */
+    ReferenceGraph(const Path & storeDir, const Path & file);
+
+    /* Return the version of the snapshot in `file' without mapping
+       it, or nothing if it doesn't exist or has no valid header. */
+    static std::optional<uint64_t> readVersion(const Path & file);
+
+    ~ReferenceGraph();
+
+    ReferenceGraph(const ReferenceGraph &) = delete;
+    ReferenceGraph & operator = (const ReferenceGraph &) = delete;
+
+    /* Write the snapshot (not the overlay) to `file'. */
+    void write(const Path & file) const;
+
+    /* The highest path ID in the graph, including the overlay. */
+    uint64_t maxId() const { return overlayMaxId; }
+
+    size_t snapshotSize() const { return nrNodes; }
+
+    size_t overlaySize() const { return overlayNames.size(); }
+
+    /* Add paths registered after the ones already in the graph, and
+       the references of those paths. */
+    void addToOverlay(const std::vector<PathEntry> & paths, const std::vector<RefEntry> & refs);
+
+    /* Add the closure of `paths' under the references relation (or
+       the referrers relation if `reverse' is set) to `out'.  Throws
+       InvalidPath if one of `paths' is not in the graph. */
+    void computeClosure(const PathSet & paths, PathSet & out, bool reverse) const;
+
+private:
+
+    const Path storeDir;
+
+    /* The snapshot, either mmap()ed or built in memory. */
+    std::string buffer;
+    const char * data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+
+    uint64_t nrNodes = 0, nrEdges = 0;
+    const uint64_t * ids = nullptr;
+    const uint64_t * nameOffsets = nullptr;
+    const uint32_t * fwdStart = nullptr, * fwdEdges = nullptr;
+    const uint32_t * revStart = nullptr, * revEdges = nullptr;
+    const uint32_t * byName = nullptr;
+    const char * names = nullptr;
+
+    /* The overlay.  Overlay nodes are numbered after the snapshot's. */
+    uint64_t overlayMaxId = 0;
+    std::vector<string> overlayNames;
+    std::unordered_map<string, Node> overlayByName;
+    std::unordered_map<uint64_t, Node> overlayById;
+    std::vector<std::vector<Node>> overlayRefs;
+    std::unordered_map<Node, std::vector<Node>> overlayReferrers;
+
+    void parse();
+
+    /* Throw if the snapshot read from `file' is inconsistent, so that
+       a corrupt file can't cause out-of-bounds accesses. */
+    void check(const Path & file) const;
+
+    std::string_view name(Node node) const;
+
+    std::optional<Node> findId(uint64_t id) const;
+
+    std::optional<Node> findPath(const Path & path) const;
+};
+
+
+}
@@ -8,6 +8,7 @@
 #include "derivations.hh"
 #include "pool.hh"
 #include "finally.hh"
+#include "compression.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -23,7 +24,11 @@
 #include <unistd.h>
 #endif
 
+#include <condition_variable>
 #include <cstring>
+#include <future>
+#include <queue>
+#include <thread>
 
 namespace nix {
 
@@ -61,6 +66,8 @@ RemoteStore::RemoteStore(const Params & params)
             }
             ))
 {
+    if (transportCompression != "")
+        compressor = std::make_shared<StreamCompressor>(transportCompression);
 }
 
 
@@ -168,10 +175,24 @@ void RemoteStore::initConnection(Connection & conn)
         }
 
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 11)
-            conn.to << false;
-
-        auto ex = conn.processStderr();
+            conn.to << WORKER_EXTENSIONS_MAGIC;
+
+        /* A daemon that supports protocol extensions sends its
+           extensions and asks for ours. */
+        StringSet ours{"multiplex", "bulk-queries", "drv-hashes", "compression"};
+        for (auto & method : streamCompressionMethods())
+            ours.insert("compression:" + method);
+        StringSink theirs, sink;
+        sink << ours;
+        StringSource source(*sink.s);
+        auto ex = conn.processStderr(&theirs, &source);
         if (ex) std::rethrow_exception(ex);
+
+        if (!theirs.s->empty()) {
+            StringSource source2(*theirs.s);
+            for (auto & i : readStrings<StringSet>(source2))
+                if (ours.count(i)) conn.extensions.insert(i);
+        }
     }
     catch (Error & e) {
         throw Error("cannot open connection to remote store '%s': %s", getUri(), e.what());
@@ -181,6 +202,16 @@ void RemoteStore::initConnection(Connection & conn)
 }
 
 
+std::string RemoteStore::getCompression(Connection & conn)
+{
+    if (!compressor
+        || !conn.extensions.count("compression")
+        || !conn.extensions.count("compression:" + compressor->method))
+        return "";
+    return compressor->method;
+}
+
+
 void RemoteStore::setOptions(Connection & conn)
 {
     conn.to << wopSetOptions
@@ -263,8 +294,289 @@ ConnectionHandle RemoteStore::getConnection()
 }
 
 
+static std::exception_ptr processStderr_(Source & from, BufferedSink * to,
+    Sink * sink, Source * source);
+
+
+/* In multiplexed mode (see processMultiplexed() in daemon.cc), every
+   request carries an id, and the daemon answers requests in whatever
+   order they complete.  Any thread may send a request at any time; a
+   reader thread matches each reply to its request.  Handlers of
+   asynchronous requests are run on separate dispatcher threads, so
+   that they can issue further requests and wait for them without
+   blocking the reader.  An asynchronous request sent by a handler is
+   performed synchronously on the handler's thread, so a handler never
+   waits for a reply that needs a dispatcher itself; additional
+   dispatchers (up to a limit) only let handlers run in parallel.
+
+   The dispatch state is shared with the dispatcher threads, since the
+   multiplexer may be destroyed by one of its own handlers. */
+struct RemoteStore::Multiplexer
+{
+    typedef std::function<void(std::exception_ptr, std::string &&)> Handler;
+
+    struct Request
+    {
+        Handler handler;
+        bool async;
+    };
+
+    struct State
+    {
+        uint64_t nextId = 1;
+        std::map<uint64_t, Request> pending;
+        std::exception_ptr failure;
+    };
+
+    struct Dispatch
+    {
+        std::queue<std::function<void()>> queue;
+        bool quit = false;
+        size_t idle = 0;
+        std::vector<std::thread> threads;
+    };
+
+    struct Dispatcher
+    {
+        Sync<Dispatch> dispatch_;
+        std::condition_variable wakeup;
+    };
+
+    /* The dispatcher that the current thread belongs to, if any. */
+    static thread_local Dispatcher * currentDispatcher;
+
+    const size_t maxDispatchers = 64;
+
+    ref<Connection> conn;
+    std::mutex writeLock;
+    Sync<State> state_;
+    std::shared_ptr<Dispatcher> dispatcher_ = std::make_shared<Dispatcher>();
+    std::thread readerThread;
+
+    Multiplexer(ref<Connection> conn) : conn(conn)
+    {
+        conn->to << wopMultiplex;
+        auto ex = conn->processStderr();
+        if (ex) std::rethrow_exception(ex);
+        readerThread = std::thread([this]() { reader(); });
+    }
+
+    ~Multiplexer()
+    {
+        /* Leave multiplexed mode. The daemon acknowledges this after
+           it has answered all outstanding requests. */
+        try {
+            std::lock_guard<std::mutex> lock(writeLock);
+            conn->to << 0;
+            conn->to.flush();
+        } catch (...) {
+            ignoreException();
+        }
+
+        readerThread.join();
+
+        std::vector<std::thread> threads;
+        {
+            auto dispatch(dispatcher_->dispatch_.lock());
+            dispatch->quit = true;
+            std::swap(threads, dispatch->threads);
+        }
+        dispatcher_->wakeup.notify_all();
+        /* A dispatcher running this destructor exits by itself once
+           its handler returns; it only touches the shared state. */
+        for (auto & thr : threads)
+            if (thr.get_id() == std::this_thread::get_id())
+                thr.detach();
+            else
+                thr.join();
+    }
+
+    void deliver(Request && req, std::exception_ptr ex, std::string && reply)
+    {
+        if (!req.async) {
+            req.handler(ex, std::move(reply));
+            return;
+        }
+        {
+            auto dispatch(dispatcher_->dispatch_.lock());
+            dispatch->queue.push(
+                [handler{std::move(req.handler)}, ex, reply{std::move(reply)}]() mutable {
+                    handler(ex, std::move(reply));
+                });
+            if (!dispatch->idle && !dispatch->quit && dispatch->threads.size() < maxDispatchers) {
+                /* The new thread counts as idle from the start, so
+                   that a burst of replies doesn't start a thread
+                   for each. */
+                dispatch->idle++;
+                dispatch->threads.emplace_back([d{dispatcher_}]() { dispatcher(d); });
+            }
+        }
+        dispatcher_->wakeup.notify_one();
+    }
+
+    /* Fail all pending and future requests. */
+    void fail(std::exception_ptr ex)
+    {
+        std::map<uint64_t, Request> pending;
+        {
+            auto state(state_.lock());
+            if (!state->failure) state->failure = ex;
+            std::swap(pending, state->pending);
+        }
+        for (auto & i : pending)
+            deliver(std::move(i.second), ex, "");
+    }
+
+    void reader()
+    {
+        try {
+            while (true) {
+                auto id = readNum<uint64_t>(conn->from);
+                if (id == 0) break;
+                auto reply = readString(conn->from);
+                Request req;
+                {
+                    auto state(state_.lock());
+                    auto i = state->pending.find(id);
+                    if (i == state->pending.end())
+                        throw Error("got a reply to unknown request %d from Nix daemon", id);
+                    req = std::move(i->second);
+                    state->pending.erase(i);
+                }
+                deliver(std::move(req), nullptr, std::move(reply));
+            }
+            fail(std::make_exception_ptr(Error("multiplexed connection to Nix daemon was closed")));
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    }
+
+    static void dispatcher(std::shared_ptr<Dispatcher> d)
+    {
+        currentDispatcher = d.get();
+        bool first = true;
+        while (true) {
+            std::function<void()> fun;
+            {
+                auto dispatch(d->dispatch_.lock());
+                if (!first) dispatch->idle++;
+                first = false;
+                while (dispatch->queue.empty() && !dispatch->quit)
+                    dispatch.wait(d->wakeup);
+                dispatch->idle--;
+                if (dispatch->queue.empty()) return;
+                fun = std::move(dispatch->queue.front());
+                dispatch->queue.pop();
+            }
+            try {
+                fun();
+            } catch (...) {
+                ignoreException();
+            }
+        }
+    }
+
+    /* Send a request. `handler' is called with the raw reply of the
+       operation, or with an exception if the connection failed. */
+    void send(unsigned int op, const std::string & args, Handler && handler, bool async)
+    {
+        if (async && currentDispatcher == dispatcher_.get()) {
+            std::exception_ptr ex;
+            std::string reply;
+            try {
+                reply = call(op, args);
+            } catch (...) {
+                ex = std::current_exception();
+            }
+            handler(ex, std::move(reply));
+            return;
+        }
+
+        uint64_t id;
+        {
+            auto state(state_.lock());
+            if (state->failure) std::rethrow_exception(state->failure);
+            id = state->nextId++;
+            state->pending.emplace(id, Request{std::move(handler), async});
+        }
+        try {
+            std::lock_guard<std::mutex> lock(writeLock);
+            conn->to << id << op << args;
+            conn->to.flush();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    }
+
+    /* Send a request and wait for its reply. */
+    std::string call(unsigned int op, const std::string & args)
+    {
+        auto promise = std::make_shared<std::promise<std::string>>();
+        auto future = promise->get_future();
+        send(op, args, [promise](std::exception_ptr ex, std::string && reply) {
+            if (ex)
+                promise->set_exception(ex);
+            else
+                promise->set_value(std::move(reply));
+        }, false);
+        return future.get();
+    }
+};
+
+
+thread_local RemoteStore::Multiplexer::Dispatcher * RemoteStore::Multiplexer::currentDispatcher = nullptr;
+
+
+std::shared_ptr<RemoteStore::Multiplexer> RemoteStore::getMultiplexer()
+{
+    if (!multiplex) return nullptr;
+
+    auto state(multiplexer_.lock());
+
+    if (state->mux) {
+        if (!state->mux->state_.lock()->failure) return state->mux;
+        /* The connection broke; fall back to ordinary connections,
+           which report errors per operation. */
+        return nullptr;
+    }
+
+    if (state->tried) return nullptr;
+    state->tried = true;
+
+    {
+        auto conn(getConnection());
+        if (!conn->extensions.count("multiplex")) return nullptr;
+    }
+
+    state->mux = std::make_shared<Multiplexer>(openConnectionWrapper());
+    return state->mux;
+}
+
+
+/* Wrap the reply of a multiplexed request as a source, after checking
+   that the operation succeeded. */
+struct MultiplexedReply
+{
+    std::string data;
+    StringSource from;
+
+    MultiplexedReply(std::string && data) : data(std::move(data)), from(this->data)
+    {
+        auto ex = processStderr_(from, nullptr, nullptr, nullptr);
+        if (ex) std::rethrow_exception(ex);
+    }
+};
+
+
 bool RemoteStore::isValidPathUncached(const Path & path)
 {
+    if (auto mux = getMultiplexer()) {
+        StringSink args;
+        args << path;
+        MultiplexedReply reply(mux->call(wopIsValidPath, *args.s));
+        return readInt(reply.from);
+    }
+
     auto conn(getConnection());
     conn->to << wopIsValidPath << path;
     conn.processStderr();
@@ -274,6 +586,13 @@ bool RemoteStore::isValidPathUncached(const Path & path)
 
 PathSet RemoteStore::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
+    if (auto mux = getMultiplexer()) {
+        StringSink args;
+        args << paths;
+        MultiplexedReply reply(mux->call(wopQueryValidPaths, *args.s));
+        return readStorePaths<PathSet>(*this, reply.from);
+    }
+
     auto conn(getConnection());
     if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 12) {
         PathSet res;
@@ -358,10 +677,51 @@ void RemoteStore::querySubstitutablePathInfos(const PathSet & paths,
 }
 
 
+static std::shared_ptr<ValidPathInfo> readPathInfo(Store & store,
+    const Path & path, Source & from, unsigned int daemonVersion)
+{
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 17) {
+        bool valid; from >> valid;
+        if (!valid) throw InvalidPath(format("path '%s' is not valid") % path);
+    }
+    auto info = std::make_shared<ValidPathInfo>();
+    info->path = path;
+    info->deriver = readString(from);
+    if (info->deriver != "") store.assertStorePath(info->deriver);
+    info->narHash = Hash(readString(from), htSHA256);
+    info->references = readStorePaths<PathSet>(store, from);
+    from >> info->registrationTime >> info->narSize;
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 16) {
+        from >> info->ultimate;
+        info->sigs = readStrings<StringSet>(from);
+        from >> info->ca;
+    }
+    return info;
+}
+
+
 void RemoteStore::queryPathInfoUncached(const Path & path,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
     try {
+        /* On a multiplexed connection, don't wait for the reply, so
+           that callers like computeFSClosure() can have many queries
+           in flight. */
+        if (auto mux = getMultiplexer()) {
+            StringSink args;
+            args << path;
+            auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
+            mux->send(wopQueryPathInfo, *args.s,
+                [this, path, callbackPtr](std::exception_ptr ex, std::string && data) {
+                    try {
+                        if (ex) std::rethrow_exception(ex);
+                        MultiplexedReply reply(std::move(data));
+                        (*callbackPtr)(readPathInfo(*this, path, reply.from, PROTOCOL_VERSION));
+                    } catch (...) { callbackPtr->rethrow(); }
+                }, true);
+            return;
+        }
+
         std::shared_ptr<ValidPathInfo> info;
         {
             auto conn(getConnection());
@@ -374,31 +734,54 @@ void RemoteStore::queryPathInfoUncached(const Path & path,
                     throw InvalidPath(e.what());
                 throw;
             }
-            if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 17) {
-                bool valid; conn->from >> valid;
-                if (!valid) throw InvalidPath(format("path '%s' is not valid") % path);
-            }
-            info = std::make_shared<ValidPathInfo>();
-            info->path = path;
-            info->deriver = readString(conn->from);
-            if (info->deriver != "") assertStorePath(info->deriver);
-            info->narHash = Hash(readString(conn->from), htSHA256);
-            info->references = readStorePaths<PathSet>(*this, conn->from);
-            conn->from >> info->registrationTime >> info->narSize;
-            if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 16) {
-                conn->from >> info->ultimate;
+            info = readPathInfo(*this, path, conn->from, conn->daemonVersion);
+        }
+        callback(std::move(info));
+    } catch (...) { callback.rethrow(); }
+}
+
+
+std::map<Path, std::shared_ptr<const ValidPathInfo>> RemoteStore::queryPathInfosUncached(const PathSet & paths)
+{
+    {
+        auto conn(getConnection());
+        if (conn->extensions.count("bulk-queries")) {
+            conn->to << wopQueryPathInfos << paths;
+            conn.processStderr();
+            std::map<Path, std::shared_ptr<const ValidPathInfo>> infos;
+            size_t count = readNum<size_t>(conn->from);
+            for (size_t n = 0; n < count; n++) {
+                auto info = std::make_shared<ValidPathInfo>();
+                info->path = readStorePath(*this, conn->from);
+                info->deriver = readString(conn->from);
+                if (info->deriver != "") assertStorePath(info->deriver);
+                info->narHash = Hash(readString(conn->from), htSHA256);
+                info->references = readStorePaths<PathSet>(*this, conn->from);
+                conn->from >> info->registrationTime >> info->narSize >> info->ultimate;
                 info->sigs = readStrings<StringSet>(conn->from);
                 conn->from >> info->ca;
+                infos.emplace(info->path, info);
             }
+            return infos;
         }
-        callback(std::move(info));
-    } catch (...) { callback.rethrow(); }
+    }
+
+    return Store::queryPathInfosUncached(paths);
 }
 
 
 void RemoteStore::queryReferrers(const Path & path,
     PathSet & referrers)
 {
+    if (auto mux = getMultiplexer()) {
+        StringSink args;
+        args << path;
+        MultiplexedReply reply(mux->call(wopQueryReferrers, *args.s));
+        PathSet referrers2 = readStorePaths<PathSet>(*this, reply.from);
+        referrers.insert(referrers2.begin(), referrers2.end());
+        return;
+    }
+
     auto conn(getConnection());
     conn->to << wopQueryReferrers << path;
     conn.processStderr();
@@ -407,6 +790,45 @@ void RemoteStore::queryReferrers(const Path & path,
 }
 
 
+std::map<Path, PathSet> RemoteStore::queryReferrersOfPaths(const PathSet & paths)
+{
+    {
+        auto conn(getConnection());
+        if (conn->extensions.count("bulk-queries")) {
+            conn->to << wopQueryReferrersOfPaths << paths;
+            conn.processStderr();
+            std::map<Path, PathSet> referrers;
+            size_t count = readNum<size_t>(conn->from);
+            for (size_t n = 0; n < count; n++) {
+                auto path = readStorePath(*this, conn->from);
+                referrers[path] = readStorePaths<PathSet>(*this, conn->from);
+            }
+            return referrers;
+        }
+    }
+
+    return Store::queryReferrersOfPaths(paths);
+}
+
+
+void RemoteStore::computeFSClosure(const PathSet & paths,
+    PathSet & out, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    {
+        auto conn(getConnection());
+        if (conn->extensions.count("bulk-queries")) {
+            conn->to << wopQueryClosure << paths << flipDirection << includeOutputs << includeDerivers;
+            conn.processStderr();
+            auto closure = readStorePaths<PathSet>(*this, conn->from);
+            out.insert(closure.begin(), closure.end());
+            return;
+        }
+    }
+
+    Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+}
+
+
 PathSet RemoteStore::queryValidDerivers(const Path & path)
 {
     auto conn(getConnection());
@@ -425,6 +847,22 @@ PathSet RemoteStore::queryDerivationOutputs(const Path & path)
 }
 
 
+std::map<Path, Hash> RemoteStore::queryDrvHashesModulo(const PathSet & drvPaths)
+{
+    auto conn(getConnection());
+    if (!conn->extensions.count("drv-hashes")) return {};
+    conn->to << wopQueryDrvHashesModulo << drvPaths;
+    conn.processStderr();
+    std::map<Path, Hash> res;
+    size_t count = readNum<size_t>(conn->from);
+    for (size_t n = 0; n < count; n++) {
+        auto drvPath = readStorePath(*this, conn->from);
+        res.emplace(drvPath, Hash(readString(conn->from)));
+    }
+    return res;
+}
+
+
 PathSet RemoteStore::queryDerivationOutputNames(const Path & path)
 {
     auto conn(getConnection());
@@ -479,9 +917,18 @@ void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
                  << info.references << info.registrationTime << info.narSize
                  << info.ultimate << info.sigs << info.ca
                  << repair << !checkSigs;
+        auto compression = getCompression(*conn.handle);
+        if (conn->extensions.count("compression"))
+            conn->to << compression;
         bool tunnel = GET_PROTOCOL_MINOR(conn->daemonVersion) >= 21;
         if (!tunnel) copyNAR(source, conn->to);
-        conn.processStderr(0, tunnel ? &source : nullptr);
+        if (tunnel && compression != "") {
+            auto compressed = sinkToSource([&](Sink & sink) {
+                (*compressor)(sink, [&](Sink & sink2) { copyNAR(source, sink2); });
+            });
+            conn.processStderr(0, compressed.get());
+        } else
+            conn.processStderr(0, tunnel ? &source : nullptr);
     }
 }
 
@@ -750,10 +1197,13 @@ static Logger::Fields readFields(Source & from)
 }
 
 
-std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source * source)
+/* Process the stderr messages of an operation read from `from', up to
+   and including STDERR_LAST or STDERR_ERROR.  `to' is where data
+   requested by the daemon (STDERR_READ) is sent; it may be null if
+   the operation doesn't read from the client. */
+static std::exception_ptr processStderr_(Source & from, BufferedSink * to,
+    Sink * sink, Source * source)
 {
-    to.flush();
-
     while (true) {
 
         auto msg = readNum<uint64_t>(from);
@@ -765,11 +1215,11 @@ std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source *
         }
 
         else if (msg == STDERR_READ) {
-            if (!source) throw Error("no source");
+            if (!source || !to) throw Error("no source");
             size_t len = readNum<size_t>(from);
             auto buf = std::make_unique<unsigned char[]>(len);
-            writeString(buf.get(), source->read(buf.get(), len), to);
-            to.flush();
+            writeString(buf.get(), source->read(buf.get(), len), *to);
+            to->flush();
         }
 
         else if (msg == STDERR_ERROR) {
@@ -813,6 +1263,13 @@ std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source *
     return nullptr;
 }
 
+
+std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source * source)
+{
+    to.flush();
+    return processStderr_(from, &to, sink, source);
+}
+
 static std::string uriScheme = "unix://";
 
 static RegisterStoreImplementation regStore([](
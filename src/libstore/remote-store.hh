@@ -13,6 +13,7 @@ class Pipe;
 class Pid;
 struct FdSink;
 struct FdSource;
+struct StreamCompressor;
 template<typename T> class Pool;
 struct ConnectionHandle;
 
@@ -29,6 +30,12 @@ public:
     const Setting<unsigned int> maxConnectionAge{(Store*) this, std::numeric_limits<unsigned int>::max(),
             "max-connection-age", "number of seconds to reuse a connection"};
 
+    const Setting<bool> multiplex{(Store*) this, true,
+            "multiplex", "whether to send queries concurrently over a single multiplexed connection"};
+
+    const Setting<std::string> transportCompression{(Store*) this, "",
+            "transport-compression", "compression method (e.g. 'xz') for NARs sent to or from the daemon, if it supports it"};
+
     virtual bool sameMachine() = 0;
 
     RemoteStore(const Params & params);
@@ -47,12 +54,22 @@ public:
 
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
+    std::map<Path, PathSet> queryReferrersOfPaths(const PathSet & paths) override;
+
+    using Store::computeFSClosure;
+
+    void computeFSClosure(const PathSet & paths,
+        PathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     PathSet queryValidDerivers(const Path & path) override;
 
     PathSet queryDerivationOutputs(const Path & path) override;
 
     StringSet queryDerivationOutputNames(const Path & path) override;
 
+    std::map<Path, Hash> queryDrvHashesModulo(const PathSet & drvPaths) override;
+
     Path queryPathFromHashPart(const string & hashPart) override;
 
     PathSet querySubstitutablePaths(const PathSet & paths) override;
@@ -106,6 +123,8 @@ public:
 
 protected:
 
+    std::map<Path, std::shared_ptr<const ValidPathInfo>> queryPathInfosUncached(const PathSet & paths) override;
+
     struct Connection
     {
 #ifndef _WIN32
@@ -116,6 +135,10 @@ protected:
         unsigned int daemonVersion;
         std::chrono::time_point<std::chrono::steady_clock> startTime;
 
+        /* The protocol extensions agreed on with the daemon (see
+           WORKER_EXTENSIONS_MAGIC). */
+        StringSet extensions;
+
         virtual ~Connection();
 
         std::exception_ptr processStderr(Sink * sink = 0, Source * source = 0);
@@ -135,10 +158,32 @@ protected:
 
     friend struct ConnectionHandle;
 
+    std::shared_ptr<StreamCompressor> compressor;
+
+    /* Return the compression method to use for NARs sent over `conn',
+       or an empty string if they're not to be compressed. */
+    std::string getCompression(Connection & conn);
+
+    /* A dedicated connection in multiplexed mode, on which many
+       queries can be in flight at the same time. */
+    struct Multiplexer;
+
+    /* Return the multiplexed connection, or nullptr if the daemon
+       doesn't support it or multiplexing is disabled. */
+    std::shared_ptr<Multiplexer> getMultiplexer();
+
 private:
 
     std::atomic_bool failed{false};
 
+    struct MultiplexerState
+    {
+        bool tried = false;
+        std::shared_ptr<Multiplexer> mux;
+    };
+
+    Sync<MultiplexerState> multiplexer_;
+
 };
 
 class UDSRemoteStore : public LocalFSStore, public RemoteStore
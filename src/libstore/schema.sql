@@ -40,3 +40,30 @@ create table if not exists DerivationOutputs (
 );
 
 create index if not exists IndexDerivationOutputs on DerivationOutputs(path);
+
+-- The result of hashDerivationModulo() for derivations, so that it
+-- doesn't have to be recomputed over the whole derivation graph.  This
+-- table is optional: it's created when missing, without a schema
+-- upgrade, and older versions of Nix ignore it.
+create table if not exists DerivationHashes (
+    drv  integer primary key not null,
+    hash text not null,
+    foreign key (drv) references ValidPaths(id) on delete cascade
+);
+
+-- A counter that is incremented whenever existing parts of the
+-- reference graph change, i.e. when paths are deleted or registered
+-- again.  Snapshots of the graph record it to tell whether they're
+-- still valid.  New paths don't change it, since they can be
+-- detected by their IDs.  Like DerivationHashes, it is created when
+-- missing, without a schema upgrade.
+create table if not exists GraphVersion (
+    version integer not null
+);
+
+insert into GraphVersion (version) select 0 where not exists (select 1 from GraphVersion);
+
+create trigger if not exists BumpGraphVersion after delete on ValidPaths
+  begin
+    update GraphVersion set version = version + 1;
+  end;
@@ -9,6 +9,18 @@ namespace nix {
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
+/* Protocol extensions of this version of Nix are negotiated rather
+   than tied to protocol versions, since upstream Nix assigns meanings
+   to later versions independently.  A client that supports extensions
+   sends cmdExportPaths with this value in place of the obsolete flag
+   and no paths, to which other servers reply with an empty export (a
+   zero).  A server that supports extensions instead replies with this
+   value and the names of its extensions, and then reads the client's.
+   Extensions are used only if both sides listed them.  With the
+   "compression" extension, the client may ask for any of the methods
+   listed as "compression:<method>" with cmdSetCompression. */
+#define SERVE_EXTENSIONS_MAGIC 0x6e787465
+
 typedef enum {
     cmdQueryValidPaths = 1,
     cmdQueryPathInfos = 2,
@@ -19,6 +31,12 @@ typedef enum {
     cmdQueryClosure = 7,
     cmdBuildDerivation = 8,
     cmdAddToStoreNar = 9,
+
+    /* Commands of protocol extensions, numbered well clear of
+       upstream's. */
+    cmdAddToStoreNars = 1001, // extension "batched-copies"
+    cmdDumpStorePaths = 1002, // extension "batched-copies"
+    cmdSetCompression = 1003, // extension "compression"
 } ServeCommand;
 
 }
@@ -5,6 +5,7 @@
 #include "worker-protocol.hh"
 #include "pool.hh"
 #include "ssh.hh"
+#include "compression.hh"
 
 namespace nix {
 
@@ -69,9 +70,15 @@ private:
 void SSHStore::narFromPath(const Path & path, Sink & sink)
 {
     auto conn(connections->get());
+    auto compression = getCompression(*conn);
     conn->to << wopNarFromPath << path;
+    if (conn->extensions.count("compression"))
+        conn->to << compression;
     conn->processStderr();
-    copyNAR(conn->from, sink);
+    if (compression != "")
+        decompressFrames(compression, conn->from, sink);
+    else
+        copyNAR(conn->from, sink);
 }
 
 ref<FSAccessor> SSHStore::getFSAccessor()
@@ -6,7 +6,9 @@
 #include "thread-pool.hh"
 #include "json.hh"
 #include "derivations.hh"
+#include "finally.hh"
 
+#include <condition_variable>
 #include <future>
 
 
@@ -402,6 +404,95 @@ void Store::queryPathInfo(const Path & storePath,
 }
 
 
+std::map<Path, ref<const ValidPathInfo>> Store::queryPathInfos(const PathSet & paths)
+{
+    std::map<Path, ref<const ValidPathInfo>> infos;
+    PathSet missing;
+
+    for (auto & path : paths) {
+        assertStorePath(path);
+        auto res = state.lock()->pathInfoCache.get(storePathToHash(path));
+        if (res) {
+            stats.narInfoReadAverted++;
+            if (*res) infos.emplace(path, ref<const ValidPathInfo>(*res));
+        } else
+            missing.insert(path);
+    }
+
+    if (missing.empty()) return infos;
+
+    auto found = queryPathInfosUncached(missing);
+
+    auto state_(state.lock());
+    for (auto & path : missing) {
+        auto i = found.find(path);
+        auto info = i == found.end() ? nullptr : i->second;
+        state_->pathInfoCache.upsert(storePathToHash(path), info);
+        if (info)
+            infos.emplace(path, ref<const ValidPathInfo>(info));
+        else
+            stats.narInfoMissing++;
+    }
+
+    return infos;
+}
+
+
+std::map<Path, std::shared_ptr<const ValidPathInfo>> Store::queryPathInfosUncached(const PathSet & paths)
+{
+    struct State
+    {
+        size_t left;
+        std::map<Path, std::shared_ptr<const ValidPathInfo>> infos;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{paths.size()});
+
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    auto doQuery = [&](const Path & path) {
+        checkInterrupt();
+        queryPathInfo(path, {[path, &state_, &wakeup](std::future<ref<const ValidPathInfo>> fut) {
+            auto state(state_.lock());
+            try {
+                state->infos.emplace(path, fut.get().get_ptr());
+            } catch (InvalidPath &) {
+            } catch (...) {
+                state->exc = std::current_exception();
+            }
+            assert(state->left);
+            if (!--state->left)
+                wakeup.notify_one();
+        }});
+    };
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(doQuery, path));
+
+    pool.process();
+
+    while (true) {
+        auto state(state_.lock());
+        if (!state->left) {
+            if (state->exc) std::rethrow_exception(state->exc);
+            return std::move(state->infos);
+        }
+        state.wait(wakeup);
+    }
+}
+
+
+std::map<Path, PathSet> Store::queryReferrersOfPaths(const PathSet & paths)
+{
+    std::map<Path, PathSet> referrers;
+    for (auto & path : paths)
+        queryReferrers(path, referrers[path]);
+    return referrers;
+}
+
+
 PathSet Store::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
     struct State
@@ -666,7 +757,98 @@ void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePa
         act.progress(nrDone, missing.size(), nrRunning, nrFailed);
     };
 
-    ThreadPool pool;
+    srcStore->queryPathInfos(missing);
+
+    /* If either side has a high-latency transport, stream the paths
+       in topological order rather than copying them concurrently,
+       which would cost a round trip per path.  This requires NAR
+       hashes, and gives up on the first failure. */
+    if ((srcStore->wantsBatchedCopies() || dstStore->wantsBatchedCopies()) && !settings.keepGoing) {
+        std::vector<ref<const ValidPathInfo>> infos;
+        std::map<Path, ref<const ValidPathInfo>> infosByPath;
+        auto sorted = srcStore->topoSortPaths(missing);
+        for (auto i = sorted.rbegin(); i != sorted.rend(); ++i) {
+            auto info = srcStore->queryPathInfo(*i);
+            if (!info->narHash) break;
+            if (info->ultimate) {
+                auto info2 = make_ref<ValidPathInfo>(*info);
+                info2->ultimate = false;
+                info = info2;
+            }
+            bytesExpected += info->narSize;
+            infos.push_back(info);
+            infosByPath.emplace(*i, info);
+        }
+
+        if (infos.size() == missing.size()) {
+            act.setExpected(actCopyPath, bytesExpected);
+            nrRunning = missing.size();
+            showProgress();
+
+            /* Send the paths in batches that fit in the budget of
+               bytes in flight (see below), so that no more than that
+               is sent ahead of what the other side has taken in.  A
+               path bigger than the budget goes in a batch of its
+               own. */
+            const uint64_t budgetLimit = std::max((uint64_t) settings.copyBytesInFlight, (uint64_t) 1);
+            std::vector<ref<const ValidPathInfo>> batch;
+            uint64_t batchSize = 0;
+
+            auto flush = [&]() {
+                if (batch.empty()) return;
+                if (dstStore->wantsBatchedCopies())
+                    dstStore->addMultipleToStore(batch, [&](const Path & storePath, Sink & sink) {
+                        checkInterrupt();
+                        srcStore->narFromPath(storePath, sink);
+                        nrRunning--;
+                        nrDone++;
+                        showProgress();
+                    }, repair, checkSigs);
+                else {
+                    Paths paths;
+                    for (auto & info : batch) paths.push_back(info->path);
+                    srcStore->narsFromPaths(paths,
+                        [&](const Path & storePath, Source & source) {
+                            checkInterrupt();
+                            dstStore->addToStore(*infosByPath.at(storePath), source, repair, checkSigs);
+                            nrRunning--;
+                            nrDone++;
+                            showProgress();
+                        });
+                }
+                batch.clear();
+                batchSize = 0;
+            };
+
+            for (auto & info : infos) {
+                if (batchSize + info->narSize > budgetLimit) flush();
+                batch.push_back(info);
+                batchSize += info->narSize;
+            }
+            flush();
+
+            return;
+        }
+
+        bytesExpected = 0;
+    }
+
+    /* NARs may be held in memory while they're being copied, so the
+       paths copied at the same time must fit in a budget.  Many small
+       paths can go in parallel, but a path at least as big as the
+       budget is copied on its own.  Since that, rather than the number
+       of threads, bounds memory use, the pool can be larger than the
+       number of cores, which helps when copying is latency-bound. */
+    const uint64_t budgetLimit = std::max((uint64_t) settings.copyBytesInFlight, (uint64_t) 1);
+    struct Budget
+    {
+        uint64_t free;
+        size_t copying = 0;
+    };
+    Sync<Budget> budget_{Budget{budgetLimit}};
+    std::condition_variable budgetFreed;
+
+    ThreadPool pool(std::max(std::thread::hardware_concurrency(), 16U));
 
     processGraph<Path>(pool,
         PathSet(missing.begin(), missing.end()),
@@ -690,6 +872,24 @@ void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePa
             checkInterrupt();
 
             if (!dstStore->isValidPath(storePath)) {
+                auto need = std::min(std::max(srcStore->queryPathInfo(storePath)->narSize, (uint64_t) 1), budgetLimit);
+                {
+                    auto budget(budget_.lock());
+                    while (budget->free < need) budget.wait(budgetFreed);
+                    budget->free -= need;
+                    budget->copying++;
+                    debug("copying '%s' (%d paths and %d bytes in flight)",
+                        storePath, budget->copying, budgetLimit - budget->free);
+                }
+                Finally release([&]() {
+                    {
+                        auto budget(budget_.lock());
+                        budget->free += need;
+                        budget->copying--;
+                    }
+                    budgetFreed.notify_all();
+                });
+
                 MaintainCount<decltype(nrRunning)> mc(nrRunning);
                 showProgress();
                 try {
@@ -852,6 +1052,31 @@ void Store::addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
     addToStore(info, source, repair, checkSigs, accessor);
 }
 
+void Store::addMultipleToStore(const std::vector<ref<const ValidPathInfo>> & infos,
+    std::function<void(const Path &, Sink &)> narFromPath,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    for (auto & info : infos) {
+        auto source = sinkToSource([&](Sink & sink) {
+            narFromPath(info->path, sink);
+        }, [&]() {
+            throw EndOfFile("NAR for '%s' is incomplete", info->path);
+        });
+        addToStore(*info, *source, repair, checkSigs);
+    }
+}
+
+void Store::narsFromPaths(const Paths & paths,
+    std::function<void(const Path &, Source &)> callback)
+{
+    for (auto & path : paths) {
+        auto source = sinkToSource([&](Sink & sink) {
+            narFromPath(path, sink);
+        });
+        callback(path, *source);
+    }
+}
+
 }
 
 
@@ -14,6 +14,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
+#include <optional>
 #include <string>
 
 
@@ -363,11 +364,21 @@ public:
     void queryPathInfo(const Path & path,
         Callback<ref<const ValidPathInfo>> callback) noexcept;
 
+    /* Bulk version of queryPathInfo(). Invalid paths are omitted from
+       the result. */
+    std::map<Path, ref<const ValidPathInfo>> queryPathInfos(const PathSet & paths);
+
 protected:
 
     virtual void queryPathInfoUncached(const Path & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept = 0;
 
+    /* Query the info of paths that are not in the path info cache.
+       The default implementation issues a queryPathInfo() for each
+       path concurrently; stores that can answer a whole set at once
+       should override it. */
+    virtual std::map<Path, std::shared_ptr<const ValidPathInfo>> queryPathInfosUncached(const PathSet & paths);
+
 public:
 
     /* Queries the set of incoming FS references for a store path.
@@ -375,6 +386,9 @@ public:
     virtual void queryReferrers(const Path & path, PathSet & referrers)
     { unsupported("queryReferrers"); }
 
+    /* Bulk version of queryReferrers(). */
+    virtual std::map<Path, PathSet> queryReferrersOfPaths(const PathSet & paths);
+
     /* Return all currently valid derivations that have `path' as an
        output.  (Note that the result of `queryDeriver()' is the
        derivation that was actually used to produce `path', which may
@@ -389,6 +403,17 @@ public:
     virtual StringSet queryDerivationOutputNames(const Path & path)
     { unsupported("queryDerivationOutputNames"); }
 
+    /* Return the results of hashDerivationModulo() that the store
+       has recorded for the valid derivations among `drvPaths'. */
+    virtual std::map<Path, Hash> queryDrvHashesModulo(const PathSet & drvPaths)
+    { return {}; }
+
+    /* Record the result of hashDerivationModulo() for `drvPath'.
+       Stores that cannot trust the caller to have computed it
+       correctly ignore this. */
+    virtual void registerDrvHashModulo(const Path & drvPath, const Hash & hash)
+    { }
+
     /* Query the full store path given the hash part of a valid store
        path, or "" if the path doesn't exist. */
     virtual Path queryPathFromHashPart(const string & hashPart) = 0;
@@ -414,6 +439,19 @@ public:
         RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs,
         std::shared_ptr<FSAccessor> accessor = 0);
 
+    /* Import a number of paths, sorted topologically (references
+       first), whose NARs are written to a sink by `narFromPath'.  The
+       default calls addToStore() for each path; stores with a
+       high-latency transport stream them in one go. */
+    virtual void addMultipleToStore(const std::vector<ref<const ValidPathInfo>> & infos,
+        std::function<void(const Path &, Sink &)> narFromPath,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs);
+
+    /* Whether copyPaths() should transfer paths to or from this store
+       with addMultipleToStore() and narsFromPaths() rather than one
+       path at a time. */
+    virtual bool wantsBatchedCopies() { return false; }
+
     /* Copy the contents of a path to the store and register the
        validity the resulting path.  The resulting path is returned.
        The function object `filter' can be used to exclude files (see
@@ -437,6 +475,12 @@ public:
     /* Write a NAR dump of a store path. */
     virtual void narFromPath(const Path & path, Sink & sink) = 0;
 
+    /* Call `callback' with a source yielding the NAR dump of each of
+       the given paths, in order.  The callback doesn't have to consume
+       the entire NAR. */
+    virtual void narsFromPaths(const Paths & paths,
+        std::function<void(const Path &, Source &)> callback);
+
     /* For each path, if it's a derivation, build it.  Building a
        derivation means ensuring that the output paths are valid.  If
        they are already valid, this is a no-op.  Otherwise, validity
@@ -546,6 +590,10 @@ public:
        ensurePath(). */
     Derivation derivationFromPath(const Path & drvPath);
 
+    /* Like derivationFromPath(), but without copying the cached
+       parse. */
+    std::shared_ptr<const Derivation> sharedDerivationFromPath(const Path & drvPath);
+
     /* Place in `out' the set of all store paths in the file system
        closure of `storePath'; that is, all paths than can be directly
        or indirectly reached from it.  `out' is not cleared.  If
@@ -572,6 +620,11 @@ public:
        relation.  If p refers to q, then p preceeds q in this list. */
     Paths topoSortPaths(const PathSet & paths);
 
+    /* Likewise, but under the references returned by `getReferences'
+       rather than those recorded in the store. */
+    static Paths topoSortPaths(const PathSet & paths,
+        std::function<const PathSet & (const Path &)> getReferences);
+
     /* Export multiple paths in the format expected by ‘nix-store
        --import’. */
     void exportPaths(const Paths & paths, Sink & sink);
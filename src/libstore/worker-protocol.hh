@@ -10,6 +10,19 @@ namespace nix {
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
+/* Protocol extensions of this version of Nix are negotiated rather
+   than tied to protocol versions, since upstream Nix assigns meanings
+   to later versions independently.  A client that supports extensions
+   sends this value in place of the obsolete `reserveSpace' flag, which
+   daemons ignore.  A daemon that supports extensions then sends the
+   names of its extensions as STDERR_WRITE data, and reads the
+   client's through STDERR_READ.  Extensions are used only if both
+   sides listed them.  With the "compression" extension,
+   wopNarFromPath and wopAddToStoreNar carry the compression method of
+   the NAR, which is empty or one of those listed as
+   "compression:<method>". */
+#define WORKER_EXTENSIONS_MAGIC 0x6e787465
+
 
 typedef enum {
     wopIsValidPath = 1,
@@ -49,6 +62,14 @@ typedef enum {
     wopNarFromPath = 38,
     wopAddToStoreNar = 39,
     wopQueryMissing = 40,
+
+    /* Operations of protocol extensions, numbered well clear of
+       upstream's. */
+    wopMultiplex = 1001, // extension "multiplex"
+    wopQueryPathInfos = 1002, // extension "bulk-queries"
+    wopQueryClosure = 1003, // extension "bulk-queries"
+    wopQueryReferrersOfPaths = 1004, // extension "bulk-queries"
+    wopQueryDrvHashesModulo = 1005, // extension "drv-hashes"
 } WorkerOp;
 
 
@@ -63,6 +63,17 @@ static void dumpContents(const Path & path, size_t size,
         throw WinError("CreateFileW when dumpContents '%1%'", path);
 #endif
 
+#ifndef _WIN32
+    /* When dumping to a file descriptor (e.g. the daemon socket or
+       the stdout of 'nix-store --serve'), let the kernel copy the
+       contents. */
+    if (auto fdSink = dynamic_cast<FdSink *>(&sink)) {
+        fdSink->writeFromFd(fd.get(), size);
+        writePadding(size, sink);
+        return;
+    }
+#endif
+
     std::vector<unsigned char> buf(65536);
     size_t left = size;
 
@@ -13,6 +13,7 @@
 #include <brotli/encode.h>
 #endif
 
+#include <chrono>
 #include <iostream>
 
 namespace nix {
@@ -234,7 +235,7 @@ struct XzCompressionSink : CompressionSink
     lzma_stream strm = LZMA_STREAM_INIT;
     bool finished = false;
 
-    XzCompressionSink(Sink & nextSink, bool parallel) : nextSink(nextSink)
+    XzCompressionSink(Sink & nextSink, bool parallel, int level) : nextSink(nextSink)
     {
         lzma_ret ret;
         bool done = false;
@@ -244,7 +245,7 @@ struct XzCompressionSink : CompressionSink
             lzma_mt mt_options = {};
             mt_options.flags = 0;
             mt_options.timeout = 300; // Using the same setting as the xz cmd line
-            mt_options.preset = LZMA_PRESET_DEFAULT;
+            mt_options.preset = level == -1 ? LZMA_PRESET_DEFAULT : level;
             mt_options.filters = NULL;
             mt_options.check = LZMA_CHECK_CRC64;
             mt_options.threads = lzma_cputhreads();
@@ -261,7 +262,7 @@ struct XzCompressionSink : CompressionSink
         }
 
         if (!done)
-            ret = lzma_easy_encoder(&strm, 6, LZMA_CHECK_CRC64);
+            ret = lzma_easy_encoder(&strm, level == -1 ? 6 : level, LZMA_CHECK_CRC64);
 
         if (ret != LZMA_OK)
             throw CompressionError("unable to initialise lzma encoder");
@@ -312,10 +313,10 @@ struct BzipCompressionSink : ChunkedCompressionSink
     bz_stream strm;
     bool finished = false;
 
-    BzipCompressionSink(Sink & nextSink) : nextSink(nextSink)
+    BzipCompressionSink(Sink & nextSink, int level) : nextSink(nextSink)
     {
         memset(&strm, 0, sizeof(strm));
-        int ret = BZ2_bzCompressInit(&strm, 9, 0, 30);
+        int ret = BZ2_bzCompressInit(&strm, level == -1 ? 9 : level, 0, 30);
         if (ret != BZ_OK)
             throw CompressionError("unable to initialise bzip2 encoder");
 
@@ -367,11 +368,13 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     BrotliEncoderState *state;
     bool finished = false;
 
-    BrotliCompressionSink(Sink & nextSink) : nextSink(nextSink)
+    BrotliCompressionSink(Sink & nextSink, int level) : nextSink(nextSink)
     {
         state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
         if (!state)
             throw CompressionError("unable to initialise brotli encoder");
+        if (level != -1)
+            BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, level);
     }
 
     ~BrotliCompressionSink()
@@ -414,17 +417,17 @@ struct BrotliCompressionSink : ChunkedCompressionSink
 };
 #endif
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel, int level)
 {
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return make_ref<XzCompressionSink>(nextSink, parallel);
+        return make_ref<XzCompressionSink>(nextSink, parallel, level);
     else if (method == "bzip2")
-        return make_ref<BzipCompressionSink>(nextSink);
+        return make_ref<BzipCompressionSink>(nextSink, level);
 #ifndef _WIN32
     else if (method == "br")
-        return make_ref<BrotliCompressionSink>(nextSink);
+        return make_ref<BrotliCompressionSink>(nextSink, level);
 #endif
     else
         throw UnknownCompressionMethod(format("unknown compression method '%s'") % method);
@@ -439,4 +442,101 @@ ref<std::string> compress(const std::string & method, const std::string & in, co
     return ssink.s;
 }
 
+StringSet streamCompressionMethods()
+{
+#ifndef _WIN32
+    return {"xz", "bzip2", "br"};
+#else
+    return {"xz", "bzip2"};
+#endif
+}
+
+/* Splits the data written to it into frames of at most the buffer
+   size, each preceded by its length.  The end is marked by an empty
+   frame. */
+struct FramedSink : BufferedSink
+{
+    Sink & to;
+
+    FramedSink(Sink & to) : BufferedSink(64 * 1024), to(to) { }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        to << len;
+        to(data, len);
+    }
+
+    void finish()
+    {
+        flush();
+        to << 0;
+    }
+};
+
+StreamCompressor::StreamCompressor(const std::string & method)
+    : method(method)
+{
+    /* Start fast; the level goes up if the link turns out to be the
+       bottleneck. */
+    if (method == "xz") { minLevel = 0; maxLevel = 9; level = 1; }
+    else if (method == "bzip2") { minLevel = 1; maxLevel = 9; level = 1; }
+    else if (method == "br") { minLevel = 0; maxLevel = 11; level = 2; }
+    else throw UnknownCompressionMethod("unknown compression method '%s'", method);
+}
+
+void StreamCompressor::operator () (Sink & sink, std::function<void(Sink &)> fun)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    std::chrono::duration<double> linkTime(0);
+
+    FramedSink framed(sink);
+    LambdaSink timed([&](const unsigned char * data, size_t len) {
+        auto before = Clock::now();
+        framed(data, len);
+        linkTime += Clock::now() - before;
+    });
+
+    auto start = Clock::now();
+    auto compressor = makeCompressionSink(method, timed, false, level);
+    fun(*compressor);
+    compressor->finish();
+    auto before = Clock::now();
+    framed.finish();
+    linkTime += Clock::now() - before;
+
+    /* Don't adapt to transfers that are too short to tell. */
+    std::chrono::duration<double> total = Clock::now() - start;
+    if (total.count() < 0.1) return;
+
+    auto linkShare = linkTime / total;
+    if (linkShare > 0.6 && level < maxLevel) level++;
+    else if (linkShare < 0.2 && level > minLevel) level--;
+    else return;
+
+    debug("%s compression level is now %d (%.0f%% of %.1f s spent on the link)",
+        method, (int) level, linkShare * 100, total.count());
+}
+
+void decompressFrames(const std::string & method, Source & source, Sink & sink)
+{
+    auto decompressor = makeDecompressionSink(method, sink);
+    std::vector<unsigned char> buf;
+    while (true) {
+        auto len = readNum<size_t>(source);
+        if (!len) break;
+        buf.resize(len);
+        source(buf.data(), len);
+        (*decompressor)(buf.data(), len);
+    }
+    decompressor->finish();
+}
+
+std::unique_ptr<Source> makeFramedDecompressionSource(const std::string & method, Source & source)
+{
+    return sinkToSource([&source, method](Sink & sink) {
+        decompressFrames(method, source, sink);
+    });
+}
+
 }
@@ -4,6 +4,7 @@
 #include "types.hh"
 #include "serialise.hh"
 
+#include <atomic>
 #include <string>
 
 namespace nix {
@@ -19,7 +20,43 @@ ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & ne
 
 ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false);
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
+/* Return a sink that compresses to `nextSink'.  A `level' of -1
+   means the method's default. */
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false, int level = -1);
+
+/* Return the compression methods that can be used by
+   StreamCompressor. */
+StringSet streamCompressionMethods();
+
+/* Compresses data sent over a connection.  The compressed data is
+   split into length-prefixed frames so that the receiver can tell
+   where it ends.  The level is adapted to the link: it goes up while
+   most of the time is spent waiting for the link, and down while most
+   of it is spent compressing. */
+struct StreamCompressor
+{
+    const std::string method;
+
+    StreamCompressor(const std::string & method);
+
+    /* Compress the data that `fun' writes to its argument, and send
+       it to `sink'. */
+    void operator () (Sink & sink, std::function<void(Sink &)> fun);
+
+    int getLevel() { return level; }
+
+private:
+    int minLevel, maxLevel;
+    std::atomic<int> level;
+};
+
+/* Decompress the frames written by a StreamCompressor from `source'
+   into `sink'. */
+void decompressFrames(const std::string & method, Source & source, Sink & sink);
+
+/* Return a source yielding the decompressed contents of the frames in
+   `source'.  Drain it before reading anything else from `source'. */
+std::unique_ptr<Source> makeFramedDecompressionSource(const std::string & method, Source & source);
 
 MakeError(UnknownCompressionMethod, Error);
 
@@ -4,6 +4,11 @@
 #include <cstring>
 #include <cerrno>
 #include <memory>
+#include <vector>
+
+#if __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <boost/coroutine2/coroutine.hpp>
 
@@ -56,9 +61,8 @@ static void warnLargeDump()
 }
 
 
-void FdSink::write(const unsigned char * data, size_t len)
+void FdSink::checkWarn()
 {
-    written += len;
     static bool warned = false;
     if (warn && !warned) {
         if (written > threshold) {
@@ -66,6 +70,13 @@ void FdSink::write(const unsigned char * data, size_t len)
             warned = true;
         }
     }
+}
+
+
+void FdSink::write(const unsigned char * data, size_t len)
+{
+    written += len;
+    checkWarn();
     try {
 #ifndef  _WIN32
         writeFull(fd, data, len);
@@ -79,6 +90,47 @@ void FdSink::write(const unsigned char * data, size_t len)
 }
 
 
+#ifndef _WIN32
+void FdSink::writeFromFd(int srcFd, size_t len)
+{
+    flush();
+
+    written += len;
+    checkWarn();
+
+#if __linux__
+    while (len > 0) {
+        checkInterrupt();
+        auto n = sendfile(fd, srcFd, nullptr, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* The descriptors don't support sendfile(); copy the
+               remainder by hand. */
+            if (errno == EINVAL || errno == ENOSYS) break;
+            _good = false;
+            throw PosixError("writing to file");
+        }
+        if (n == 0) throw EndOfFile("unexpected end-of-file");
+        len -= n;
+    }
+#endif
+
+    std::vector<unsigned char> buf(65536);
+    while (len > 0) {
+        auto n = std::min(len, buf.size());
+        readFull(srcFd, buf.data(), n);
+        try {
+            writeFull(fd, buf.data(), n);
+        } catch (SysError & e) {
+            _good = false;
+            throw;
+        }
+        len -= n;
+    }
+}
+#endif
+
+
 bool FdSink::good()
 {
     return _good;
@@ -123,10 +123,19 @@ struct FdSink : BufferedSink
 
     void write(const unsigned char * data, size_t len) override;
 
+#ifndef _WIN32
+    /* Write `len' bytes read from `srcFd' (at its current offset).
+       Where possible, the kernel copies the data directly, without
+       it passing through user space. */
+    void writeFromFd(int srcFd, size_t len);
+#endif
+
     bool good() override;
 
 private:
     bool _good = true;
+
+    void checkWarn();
 };
 
 
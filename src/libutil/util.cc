@@ -565,6 +565,18 @@ struct stat lstatPath(const Path & path)
 }
 
 
+uint64_t statusChangeTime(const struct stat & st)
+{
+#if defined(__APPLE__)
+    return (uint64_t) st.st_ctimespec.tv_sec * 1000000000 + st.st_ctimespec.tv_nsec;
+#elif defined(_WIN32)
+    return (uint64_t) st.st_ctime * 1000000000;
+#else
+    return (uint64_t) st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+}
+
+
 #ifndef _WIN32
 bool pathExists(const Path & path)
 {
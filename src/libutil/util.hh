@@ -83,6 +83,10 @@ bool isDirOrInDir(const Path & path, const Path & dir);
 // TODO: deprecate on Windows
 struct stat lstatPath(const Path & path);
 
+/* Return the status change time in `st' in nanoseconds, or in whole
+   seconds if the platform doesn't record it more precisely. */
+uint64_t statusChangeTime(const struct stat & st);
+
 /* Return true iff the given path exists. */
 bool pathExists(const Path & path);
 
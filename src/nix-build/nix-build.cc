@@ -263,6 +263,7 @@ static void _main(int argc, char * * argv)
 
     auto state = std::make_unique<EvalState>(myArgs.searchPath, store);
     state->repair = repair;
+    state->writeDerivationsAsync();
 
     auto autoArgs = myArgs.getAutoArgs(*state);
 
@@ -335,9 +336,15 @@ static void _main(int argc, char * * argv)
         }
     }
 
+    /* Report errors writing derivations here, since the writer's
+       destructor can only ignore them. */
+    state->flushDerivations();
+
     state->printStats();
 
     auto buildPaths = [&](const PathSet & paths) {
+        state->flushDerivations();
+
         /* Note: we do this even when !printMissing to efficiently
            fetch binary cache data. */
         unsigned long long downloadSize, narSize;
@@ -358,7 +365,9 @@ static void _main(int argc, char * * argv)
             throw UsageError("nix-shell requires a single derivation");
 
         auto & drvInfo = drvs.front();
-        auto drv = store->derivationFromPath(drvInfo.queryDrvPath());
+        auto drvPath = drvInfo.queryDrvPath();
+        state->flushDerivations();
+        auto drv = store->derivationFromPath(drvPath);
 
         PathSet pathsToBuild;
 
@@ -7,6 +7,7 @@
 #include "globals.hh"
 #include "derivations.hh"
 #include "finally.hh"
+#include "sync.hh"
 #endif
 
 #include "legacy.hh"
@@ -15,6 +16,8 @@
 #ifndef _WIN32
 
 #include <algorithm>
+#include <condition_variable>
+#include <thread>
 
 #include <cstring>
 #include <unistd.h>
@@ -166,9 +169,22 @@ static void daemonLoop(char * * argv)
     if (chdir("/") == -1)
         throw PosixError("cannot change current directory");
 
+    bool threaded = settings.daemonThreaded;
+
     /* Get rid of children automatically; don't let them become
-       zombies. */
-    setSigChldAction(true);
+       zombies.  In threaded mode, there are no connection processes,
+       and builds need to wait for their own children. */
+    setSigChldAction(!threaded);
+
+    /* In threaded mode, all connections share one store and its
+       database connections.  Its path info cache stays off, as in
+       forking mode, since builds and garbage collection happen in
+       other processes and would leave it stale. */
+    std::shared_ptr<Store> sharedStore;
+    if (threaded) {
+        initThreadedMode();
+        sharedStore = openUncachedStore();
+    }
 
     AutoCloseFD fdSocket;
 
@@ -186,10 +202,24 @@ static void daemonLoop(char * * argv)
         fdSocket = createUnixDomainSocket(settings.nixDaemonSocketFile, 0666);
     }
 
+    /* In threaded mode, the number of connections being served. */
+    struct Threads
+    {
+        Sync<unsigned int> count_{0};
+        std::condition_variable wakeup;
+    };
+    auto threads = std::make_shared<Threads>();
+
     /* Loop accepting connections. */
     while (1) {
 
         try {
+            if (threaded) {
+                auto count(threads->count_.lock());
+                while (*count >= std::max(1U, settings.daemonMaxThreads.get()))
+                    count.wait(threads->wakeup);
+            }
+
             /* Accept a connection. */
             struct sockaddr_un remoteAddr;
             socklen_t remoteAddrLen = sizeof(remoteAddr);
@@ -226,6 +256,25 @@ static void daemonLoop(char * * argv)
                 % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
                 % (peer.uidKnown ? user : "<unknown>"));
 
+            if (threaded) {
+                (*threads->count_.lock())++;
+                std::thread([store{ref<Store>(sharedStore)}, fd{remote.release()}, trusted, user, peer, threads]() {
+                    Finally done([&]() {
+                        (*threads->count_.lock())--;
+                        threads->wakeup.notify_one();
+                    });
+                    AutoCloseFD remote(fd);
+                    try {
+                        FdSource from(remote.get());
+                        FdSink to(remote.get());
+                        processConnection(store, from, to, trusted, user, peer.uid, true);
+                    } catch (std::exception & e) {
+                        printError("error processing connection: %s", e.what());
+                    }
+                }).detach();
+                continue;
+            }
+
             /* Fork a child to handle the connection. */
             ProcessOptions options;
             options.errorPrefix = "unexpected Nix daemon error: ";
@@ -271,6 +320,7 @@ static int _main(int argc, char * * argv)
 #ifndef _WIN32
     {
         auto stdio = false;
+        auto resume = false;
 
         parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
             if (*arg == "--daemon")
@@ -281,13 +331,20 @@ static int _main(int argc, char * * argv)
                 printVersion("nix-daemon");
             else if (*arg == "--stdio")
                 stdio = true;
+            else if (*arg == "--resume-connection")
+                resume = true; /* internal, see handOffConnection() */
             else return false;
             return true;
         });
 
         initPlugins();
 
-        if (stdio) {
+        if (resume) {
+            FdSource from(STDIN_FILENO);
+            FdSink to(STDOUT_FILENO);
+            FdSource state(resumeStateFd);
+            resumeConnection(from, to, state);
+        } else if (stdio) {
             if (getStoreType() == tDaemon) {
                 /* Forward on this connection to the real daemon */
                 auto socketPath = settings.nixDaemonSocketFile;
@@ -2,6 +2,7 @@
 #include "common-eval-args.hh"
 #include "derivations.hh"
 #include "eval.hh"
+#include "eval-inputs.hh"
 #include "get-drvs.hh"
 #include "globals.hh"
 #include "names.hh"
@@ -14,6 +15,7 @@
 #include "value-to-json.hh"
 #include "xml-writer.hh"
 #include "legacy.hh"
+#include "finally.hh"
 
 #include <cerrno>
 #include <ctime>
@@ -21,6 +23,8 @@
 #include <iostream>
 #include <sstream>
 
+#include <nlohmann/json.hpp>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #ifndef _MSC_VER
@@ -102,6 +106,8 @@ static bool isNixExpr(const Path & path, struct stat & st)
 static void getAllExprs(EvalState & state,
     const Path & path, StringSet & attrs, Value & v)
 {
+    if (state.inputs) state.inputs->addFile(path);
+
     StringSet namesSorted;
     for (auto & i : readDirectory(path)) namesSorted.insert(i.name());
 
@@ -113,6 +119,8 @@ static void getAllExprs(EvalState & state,
 
         Path path2 = path + "/" + i;
 
+        if (state.inputs) state.inputs->addFile(path2);
+
         struct stat st;
         if (stat(path2.c_str(), &st) == -1)
             continue; // ignore dangling symlinks in ~/.nix-defexpr
@@ -172,16 +180,156 @@ static void loadSourceExpr(EvalState & state, const Path & path, Value & v)
 }
 
 
-static void loadDerivations(EvalState & state, Path nixExprPath,
+/* Selecting packages only requires their names, systems and a few
+   meta attributes.  These are kept in a package index in the user's
+   cache directory, which remains valid for as long as the inputs of
+   the evaluation that produced it (see EvalInputs) are unchanged. */
+static const unsigned int packageIndexVersion = 1;
+
+
+static Path getPackageIndexPath(EvalState & state,
+    const Path & nixExprPath, const string & pathPrefix)
+{
+    string key = fmt("%d\n%s\n%s\n%s\n%d%d", packageIndexVersion,
+        absPath(nixExprPath), pathPrefix, settings.thisSystem,
+        evalSettings.pureEval, evalSettings.restrictEval);
+    for (auto & i : state.getSearchPath())
+        key += "\n" + i.first + "=" + i.second;
+    return getCacheDir() + "/nix/package-index/"
+        + hashString(htSHA256, key).to_string(Base32, false) + ".json";
+}
+
+
+static bool readPackageIndex(EvalState & state, const Path & indexPath, DrvInfos & elems)
+{
+    if (!pathExists(indexPath)) return false;
+
+    try {
+        auto json = nlohmann::json::parse(readFile(indexPath));
+
+        if (json.value("version", 0U) != packageIndexVersion) return false;
+
+        EvalInputs inputs;
+        inputs.files = json["files"].get<std::map<Path, string>>();
+        inputs.envVars = json["envVars"].get<std::map<string, string>>();
+        if (!inputs.isUpToDate()) return false;
+
+        DrvInfos elems2;
+        for (auto & p : json["packages"]) {
+            DrvInfo elem(state, p["attrPath"].get<string>(), nullptr);
+            elem.setName(p["name"].get<string>());
+            elem.setSystem(p["system"].get<string>());
+            if (p.count("description")) {
+                Value * v = state.allocValue();
+                mkString(*v, p["description"].get<string>());
+                elem.setMeta("description", v);
+            }
+            if (p.count("priority")) {
+                Value * v = state.allocValue();
+                mkInt(*v, p["priority"].get<NixInt>());
+                elem.setMeta("priority", v);
+            }
+            elems2.push_back(elem);
+        }
+
+        elems.splice(elems.end(), elems2);
+        return true;
+
+    } catch (std::exception & e) {
+        debug("ignoring package index '%s': %s", indexPath, e.what());
+        return false;
+    }
+}
+
+
+static void writePackageIndex(EvalState & state, const Path & indexPath, DrvInfos & elems)
+{
+    /* Evaluate all indexed attributes before looking at the inputs,
+       since that may read more files or environment variables. */
+    auto packages = nlohmann::json::array();
+    for (auto & i : elems) {
+        nlohmann::json p;
+        p["attrPath"] = i.attrPath;
+        p["name"] = i.queryName();
+        p["system"] = i.querySystem();
+        /* Bad meta attributes shouldn't prevent the index from
+           being written. */
+        try {
+            auto descr = i.queryMetaString("description");
+            if (descr != "") p["description"] = descr;
+            if (i.queryMeta("priority")) p["priority"] = i.queryMetaInt("priority", 0);
+        } catch (Error & e) {
+            debug("ignoring meta attributes of '%s': %s", i.attrPath, e.msg());
+        }
+        packages.push_back(std::move(p));
+    }
+
+    auto & inputs(*state.inputs);
+    if (!inputs.impure.empty()) {
+        debug("not writing package index, since the evaluation used '%s'", inputs.impure);
+        return;
+    }
+
+    nlohmann::json json;
+    json["version"] = packageIndexVersion;
+    json["files"] = inputs.files;
+    json["envVars"] = inputs.envVars;
+    json["packages"] = std::move(packages);
+
+    createDirs(dirOf(indexPath));
+#ifndef _WIN32
+    Path tmpFile = fmt("%s.tmp.%d", indexPath, getpid());
+#else
+    Path tmpFile = fmt("%s.tmp.%d", indexPath, GetCurrentProcessId());
+#endif
+    writeFile(tmpFile, json.dump());
+#ifndef _WIN32
+    if (rename(tmpFile.c_str(), indexPath.c_str()) == -1)
+        throw PosixError("cannot rename '%s' to '%s'", tmpFile, indexPath);
+#else
+    if (!MoveFileExW(pathW(tmpFile).c_str(), pathW(indexPath).c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+        throw WinError("MoveFileExW '%1%' '%2%'", tmpFile, indexPath);
+#endif
+}
+
+
+/* Get the derivations in the Nix expression `nixExprPath'.  If
+   `useIndex' is set, they may come from the package index, in which
+   case they only provide their name, system and the meta attributes
+   `description' and `priority', and true is returned. */
+static bool loadDerivations(EvalState & state, Path nixExprPath,
     string systemFilter, Bindings & autoArgs,
-    const string & pathPrefix, DrvInfos & elems)
+    const string & pathPrefix, DrvInfos & elems, bool useIndex = false)
 {
-    Value vRoot;
-    loadSourceExpr(state, nixExprPath, vRoot);
+    /* Function arguments can't be part of the index key. */
+    if (!autoArgs.empty()) useIndex = false;
 
-    Value & v(*findAlongAttrPath(state, pathPrefix, autoArgs, vRoot));
+    Path indexPath = useIndex ? getPackageIndexPath(state, nixExprPath, pathPrefix) : "";
+    bool fromIndex = useIndex && readPackageIndex(state, indexPath, elems);
 
-    getDerivations(state, v, pathPrefix, autoArgs, elems, true);
+    if (!fromIndex) {
+        if (useIndex) state.inputs = std::make_shared<EvalInputs>();
+        Finally resetInputs([&]() { state.inputs.reset(); });
+
+        Value vRoot;
+        loadSourceExpr(state, nixExprPath, vRoot);
+
+        Value & v(*findAlongAttrPath(state, pathPrefix, autoArgs, vRoot));
+
+        getDerivations(state, v, pathPrefix, autoArgs, elems, true);
+
+        if (useIndex) {
+            /* Evaluating the indexed attributes may fail for some
+               packages, in which case we don't write an index and
+               leave it to the caller to report the error if it cares
+               about that package. */
+            try {
+                writePackageIndex(state, indexPath, elems);
+            } catch (Error & e) {
+                debug("not writing package index: %s", e.msg());
+            }
+        }
+    }
 
     /* Filter out all derivations not applicable to the current
        system. */
@@ -190,6 +338,28 @@ static void loadDerivations(EvalState & state, Path nixExprPath,
         if (systemFilter != "*" && i->querySystem() != systemFilter)
             elems.erase(i);
     }
+
+    return fromIndex;
+}
+
+
+/* Replace derivations that were loaded from the package index by the
+   actual derivations, looking them up by attribute path. */
+static void resolveIndexedDerivations(EvalState & state, const Path & nixExprPath,
+    Bindings & autoArgs, DrvInfos & elems)
+{
+    Value vRoot;
+    loadSourceExpr(state, nixExprPath, vRoot);
+
+    DrvInfos elems2;
+    for (auto & i : elems) {
+        auto drv = getDerivation(state, *findAlongAttrPath(state, i.attrPath, autoArgs, vRoot), false);
+        if (!drv) throw Error("attribute '%s' is no longer a derivation", i.attrPath);
+        drv->attrPath = i.attrPath;
+        elems2.push_back(*drv);
+    }
+
+    elems = elems2;
 }
 
 
@@ -334,13 +504,29 @@ static void queryInstSources(EvalState & state,
         case srcNixExprDrvs: {
 
             /* Load the derivations from the (default or specified)
-               Nix expression. */
+               Nix expression.  Selecting them only needs what's in
+               the package index; after that, look up the selected
+               ones.  Attribute paths don't always round-trip (e.g.
+               if an attribute name contains a dot), so fall back to
+               a full evaluation if that fails. */
             DrvInfos allElems;
-            loadDerivations(state, instSource.nixExprPath,
-                instSource.systemFilter, *instSource.autoArgs, "", allElems);
+            bool fromIndex = loadDerivations(state, instSource.nixExprPath,
+                instSource.systemFilter, *instSource.autoArgs, "", allElems, true);
 
             elems = filterBySelector(state, allElems, args, newestOnly);
 
+            if (fromIndex) {
+                try {
+                    resolveIndexedDerivations(state, instSource.nixExprPath, *instSource.autoArgs, elems);
+                } catch (Error & e) {
+                    debug("cannot use package index: %s", e.msg());
+                    allElems.clear();
+                    loadDerivations(state, instSource.nixExprPath,
+                        instSource.systemFilter, *instSource.autoArgs, "", allElems);
+                    elems = filterBySelector(state, allElems, args, newestOnly);
+                }
+            }
+
             break;
         }
 
@@ -924,10 +1110,15 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     if (source == sInstalled || compareVersions || printStatus)
         installedElems = queryInstalled(*globals.state, globals.profile);
 
+    /* The package index has everything needed, unless we have to
+       look at the outputs or all meta attributes. */
+    bool useIndex = !printStatus && !printDrvPath && !printOutPath
+        && !printMeta && !jsonOutput && !globals.prebuiltOnly;
+
     if (source == sAvailable || compareVersions)
         loadDerivations(*globals.state, globals.instSource.nixExprPath,
             globals.instSource.systemFilter, *globals.instSource.autoArgs,
-            attrPath, availElems);
+            attrPath, availElems, useIndex);
 
     DrvInfos elems_ = filterBySelector(*globals.state,
         source == sInstalled ? installedElems : availElems,
@@ -13,6 +13,7 @@
 
 #include <map>
 #include <iostream>
+#include <sstream>
 
 
 using namespace nix;
@@ -49,14 +50,20 @@ void processExpr(EvalState & state, const Strings & attrPaths,
                 vRes = v;
             else
                 state.autoCallFunction(autoArgs, v, vRes);
+            /* The result may contain the paths of derivations that
+               are still being written, so only print it once they
+               are in the store. */
+            std::ostringstream out;
             if (output == okXML)
-                printValueAsXML(state, strict, location, vRes, std::cout, context);
+                printValueAsXML(state, strict, location, vRes, out, context);
             else if (output == okJSON)
-                printValueAsJSON(state, strict, vRes, std::cout, context);
+                printValueAsJSON(state, strict, vRes, out, context);
             else {
                 if (strict) state.forceValueDeep(vRes);
-                std::cout << vRes << std::endl;
+                out << vRes << std::endl;
             }
+            state.flushDerivations();
+            std::cout << out.str();
         } else {
             DrvInfos drvs;
             getDerivations(state, v, "", autoArgs, drvs, false);
@@ -68,6 +75,10 @@ void processExpr(EvalState & state, const Strings & attrPaths,
                 if (outputName == "")
                     throw Error(format("derivation '%1%' lacks an 'outputName' attribute ") % drvPath);
 
+                /* Make sure the derivation is in the store before
+                   anybody can see its path. */
+                state.flushDerivations();
+
                 if (gcRoot == "")
                     printGCWarning();
                 else {
@@ -158,6 +169,7 @@ static int _main(int argc, char * * argv)
 
         auto state = std::make_unique<EvalState>(myArgs.searchPath, store);
         state->repair = repair;
+        state->writeDerivationsAsync();
 
         Bindings & autoArgs = *myArgs.getAutoArgs(*state);
 
@@ -187,6 +199,10 @@ static int _main(int argc, char * * argv)
                 evalOnly, outputKind, xmlOutputSourceLocation, e);
         }
 
+        /* Report errors writing derivations, which the writer's
+           destructor can only ignore. */
+        state->flushDerivations();
+
         state->printStats();
 
         return 0;
@@ -1,4 +1,5 @@
 #include "archive.hh"
+#include "compression.hh"
 #include "derivations.hh"
 #include "dotgraph.hh"
 #include "globals.hh"
@@ -331,19 +332,28 @@ static void opQuery(Strings opFlags, Strings opArgs)
         case qReferences:
         case qReferrers:
         case qReferrersClosure: {
-            PathSet paths;
+            PathSet args, paths;
             for (auto & i : opArgs) {
                 PathSet ps = maybeUseOutputs(store->followLinksToStorePath(i), useOutput, forceRealise);
-                for (auto & j : ps) {
-                    if (query == qRequisites) store->computeFSClosure(j, paths, false, includeOutputs);
-                    else if (query == qReferences) {
-                        for (auto & p : store->queryPathInfo(j)->references)
-                            paths.insert(p);
-                    }
-                    else if (query == qReferrers) store->queryReferrers(j, paths);
-                    else if (query == qReferrersClosure) store->computeFSClosure(j, paths, true);
+                args.insert(ps.begin(), ps.end());
+            }
+            /* Query all arguments at once, so that a remote store
+               can answer in a single round trip. */
+            if (query == qRequisites) store->computeFSClosure(args, paths, false, includeOutputs);
+            else if (query == qReferences) {
+                auto infos = store->queryPathInfos(args);
+                for (auto & j : args) {
+                    auto info = infos.find(j);
+                    if (info == infos.end())
+                        throw InvalidPath("path '%s' is not valid", j);
+                    paths.insert(info->second->references.begin(), info->second->references.end());
                 }
             }
+            else if (query == qReferrers) {
+                for (auto & j : store->queryReferrersOfPaths(args))
+                    paths.insert(j.second.begin(), j.second.end());
+            }
+            else if (query == qReferrersClosure) store->computeFSClosure(args, paths, true);
             Paths sorted = store->topoSortPaths(paths);
             for (Paths::reverse_iterator i = sorted.rbegin();
                  i != sorted.rend(); ++i)
@@ -827,6 +837,53 @@ static void opServe(Strings opFlags, Strings opArgs)
         settings.printRepeatedBuilds = false;
     };
 
+    /* The protocol extensions that both sides support. */
+    StringSet extensions;
+
+    /* Once the client has asked for it, NARs are compressed in both
+       directions. */
+    std::unique_ptr<StreamCompressor> compressor;
+
+    auto sendNar = [&](std::function<void(Sink &)> fun) {
+        if (compressor)
+            (*compressor)(out, fun);
+        else
+            fun(out);
+    };
+
+    auto receiveNar = [&](std::function<void(Source &)> fun) {
+        if (!compressor) return fun(in);
+        auto source = makeFramedDecompressionSource(compressor->method, in);
+        fun(*source);
+        source->drain();
+    };
+
+    auto addToStoreNar = [&]() {
+        ValidPathInfo info;
+        info.path = readStorePath(*store, in);
+        in >> info.deriver;
+        if (!info.deriver.empty())
+            store->assertStorePath(info.deriver);
+        info.narHash = Hash(readString(in), htSHA256);
+        info.references = readStorePaths<PathSet>(*store, in);
+        in >> info.registrationTime >> info.narSize >> info.ultimate;
+        info.sigs = readStrings<StringSet>(in);
+        in >> info.ca;
+
+        if (info.narSize == 0) {
+            throw Error("narInfo is too old and missing the narSize field");
+        }
+
+        receiveNar([&](Source & source) {
+            SizedSource sizedSource(source, info.narSize);
+
+            store->addToStore(info, sizedSource, NoRepair, NoCheckSigs);
+
+            // consume all the data that has been sent before continuing.
+            sizedSource.drainAll();
+        });
+    };
+
     while (true) {
         ServeCommand cmd;
         try {
@@ -890,20 +947,41 @@ static void opServe(Strings opFlags, Strings opArgs)
                 break;
             }
 
-            case cmdDumpStorePath:
-                store->narFromPath(readStorePath(*store, in), out);
+            case cmdDumpStorePath: {
+                auto path = readStorePath(*store, in);
+                sendNar([&](Sink & sink) { store->narFromPath(path, sink); });
+                break;
+            }
+
+            case cmdDumpStorePaths:
+                for (auto & path : readStorePaths<Paths>(*store, in))
+                    sendNar([&](Sink & sink) { store->narFromPath(path, sink); });
                 break;
 
             case cmdImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
-                store->importPaths(in, nullptr, NoCheckSigs); // FIXME: should we skip sig checking?
+                receiveNar([&](Source & source) {
+                    store->importPaths(source, nullptr, NoCheckSigs); // FIXME: should we skip sig checking?
+                });
                 out << 1; // indicate success
                 break;
             }
 
             case cmdExportPaths: {
-                readInt(in); // obsolete
-                store->exportPaths(readStorePaths<Paths>(*store, in), out);
+                auto magic = readInt(in); // obsolete, or SERVE_EXTENSIONS_MAGIC
+                auto paths = readStorePaths<Paths>(*store, in);
+                if (magic == SERVE_EXTENSIONS_MAGIC && paths.empty()) {
+                    StringSet ours{"batched-copies", "compression"};
+                    for (auto & method : streamCompressionMethods())
+                        ours.insert("compression:" + method);
+                    out << SERVE_EXTENSIONS_MAGIC << ours;
+                    out.flush();
+                    extensions.clear();
+                    for (auto & i : readStrings<StringSet>(in))
+                        if (ours.count(i)) extensions.insert(i);
+                    break;
+                }
+                sendNar([&](Sink & sink) { store->exportPaths(paths, sink); });
                 break;
             }
 
@@ -960,31 +1038,31 @@ static void opServe(Strings opFlags, Strings opArgs)
 
             case cmdAddToStoreNar: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
+                addToStoreNar();
+                out << 1; // indicate success
+                break;
+            }
 
-                ValidPathInfo info;
-                info.path = readStorePath(*store, in);
-                in >> info.deriver;
-                if (!info.deriver.empty())
-                    store->assertStorePath(info.deriver);
-                info.narHash = Hash(readString(in), htSHA256);
-                info.references = readStorePaths<PathSet>(*store, in);
-                in >> info.registrationTime >> info.narSize >> info.ultimate;
-                info.sigs = readStrings<StringSet>(in);
-                in >> info.ca;
-
-                if (info.narSize == 0) {
-                    throw Error("narInfo is too old and missing the narSize field");
-                }
-
-                SizedSource sizedSource(in, info.narSize);
-
-                store->addToStore(info, sizedSource, NoRepair, NoCheckSigs);
-
-                // consume all the data that has been sent before continuing.
-                sizedSource.drainAll();
-
+            case cmdAddToStoreNars: {
+                if (!writeAllowed) throw Error("importing paths is not allowed");
+                /* The client keeps sending while we import, so the
+                   paths are acknowledged together at the end. */
+                auto count = readNum<size_t>(in);
+                for (size_t i = 0; i < count; i++)
+                    addToStoreNar();
                 out << 1; // indicate success
+                break;
+            }
 
+            case cmdSetCompression: {
+                auto method = readString(in);
+                if (extensions.count("compression") && streamCompressionMethods().count(method)) {
+                    compressor = std::make_unique<StreamCompressor>(method);
+                    out << method;
+                } else {
+                    compressor.reset();
+                    out << "";
+                }
                 break;
             }
 
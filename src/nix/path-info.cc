@@ -99,6 +99,9 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 
         else {
 
+            /* Fetch all path infos up front. */
+            store->queryPathInfos(PathSet(storePaths.begin(), storePaths.end()));
+
             for (auto storePath : storePaths) {
                 auto info = store->queryPathInfo(storePath);
                 storePath = info->path; // FIXME: screws up padding
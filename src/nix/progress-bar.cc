@@ -5,6 +5,7 @@
 #include "names.hh"
 
 #include <atomic>
+#include <chrono>
 #include <map>
 #include <thread>
 
@@ -40,6 +41,7 @@ private:
         bool visible = true;
         ActivityId parent;
         std::optional<std::string> name;
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
     };
 
     struct ActivitiesByType
@@ -48,6 +50,15 @@ private:
         uint64_t done = 0;
         uint64_t expected = 0;
         uint64_t failed = 0;
+
+        /* When the first activity of this type started, and how many
+           have finished in how much time, for showing rates.  For
+           copies, these are reset when a new copy starts, along with
+           `doneBefore', the value of `done' at that time. */
+        std::optional<std::chrono::steady_clock::time_point> firstStart;
+        uint64_t finished = 0;
+        std::chrono::duration<double> finishedTime{0};
+        uint64_t doneBefore = 0;
     };
 
     struct State
@@ -143,7 +154,18 @@ public:
         i->type = type;
         i->parent = parent;
         state->its.emplace(act, i);
-        state->activitiesByType[type].its.emplace(act, i);
+
+        if (type == actCopyPaths) {
+            auto & copies = state->activitiesByType[actCopyPath];
+            copies.firstStart.reset();
+            copies.finished = 0;
+            copies.finishedTime = std::chrono::duration<double>(0);
+            copies.doneBefore = copies.done;
+        }
+
+        auto & actByType = state->activitiesByType[type];
+        actByType.its.emplace(act, i);
+        if (!actByType.firstStart) actByType.firstStart = i->startTime;
 
         if (type == actBuild) {
             auto name = storePathToName(getS(fields, 0));
@@ -214,6 +236,8 @@ public:
             auto & actByType = state->activitiesByType[i->second->type];
             actByType.done += i->second->done;
             actByType.failed += i->second->failed;
+            actByType.finished++;
+            actByType.finishedTime += std::chrono::steady_clock::now() - i->second->startTime;
 
             for (auto & j : i->second->expectedByType)
                 state->activitiesByType[j.first].expected -= j.second;
@@ -349,6 +373,26 @@ public:
         writeToStderr("\r" + filterANSIEscapes(line, false, width) + "\x1B[K");
     }
 
+    /* Return the overall rate at which paths are being copied, and
+       the average time a path takes. */
+    std::string getCopyRate(State & state)
+    {
+        auto & act = state.activitiesByType[actCopyPath];
+        if (!act.firstStart) return "";
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - *act.firstStart;
+        if (elapsed.count() < 1) return "";
+
+        uint64_t done = act.done - act.doneBefore;
+        for (auto & j : act.its)
+            done += j.second->done;
+
+        auto s = fmt(", %.1f MiB/s", done / elapsed.count() / (1024.0 * 1024.0));
+        if (act.finished)
+            s += fmt(", %.2f s/path", act.finishedTime.count() / act.finished);
+        return s;
+    }
+
     std::string getStatus(State & state)
     {
         auto MiB = 1024.0 * 1024.0;
@@ -409,7 +453,12 @@ public:
         if (!s1.empty() || !s2.empty()) {
             if (!res.empty()) res += ", ";
             if (s1.empty()) res += "0 copied"; else res += s1;
-            if (!s2.empty()) { res += " ("; res += s2; res += ')'; }
+            if (!s2.empty()) {
+                res += " (";
+                res += s2;
+                res += getCopyRate(state);
+                res += ')';
+            }
         }
 
         showActivity(actDownload, "%s MiB DL", "%.1f", MiB);
@@ -11,6 +11,12 @@
 
 #include <regex>
 #include <fstream>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+
+#include <sys/types.h>
+#include <sys/stat.h>
 
 using namespace nix;
 
@@ -29,6 +35,191 @@ std::string hilite(const std::string & s, const std::smatch & m, std::string pos
           + std::string(m.suffix());
 }
 
+/* An index of the package search cache.  It stores the searchable
+   fields of each package and, for each trigram (sequence of three
+   lower-cased bytes), the packages that contain it in one of those
+   fields.  A regex then only has to be tried on the packages that
+   contain all trigrams of a literal string that every match must
+   contain. */
+struct SearchIndex
+{
+    static constexpr uint64_t version = 1;
+
+    struct Entry
+    {
+        std::string attrPath, name, description;
+    };
+
+    std::vector<Entry> entries;
+
+    /* The numbers of the packages containing each trigram, as
+       varint-encoded differences. */
+    std::unordered_map<uint32_t, std::string> postings;
+
+    std::unordered_map<uint32_t, size_t> lastEntry;
+
+    static std::set<uint32_t> trigrams(const std::string & s)
+    {
+        std::set<uint32_t> res;
+        for (size_t i = 0; i + 3 <= s.size(); ++i)
+            res.insert(
+                (uint32_t) (unsigned char) tolower(s[i]) << 16
+                | (uint32_t) (unsigned char) tolower(s[i + 1]) << 8
+                | (uint32_t) (unsigned char) tolower(s[i + 2]));
+        return res;
+    }
+
+    void add(Entry && entry)
+    {
+        size_t n = entries.size();
+
+        auto ts = trigrams(entry.attrPath);
+        for (auto & s : {entry.name, entry.description}) {
+            auto ts2 = trigrams(s);
+            ts.insert(ts2.begin(), ts2.end());
+        }
+
+        for (auto t : ts) {
+            auto & posting = postings[t];
+            auto last = lastEntry.find(t);
+            size_t delta = last == lastEntry.end() ? n : n - last->second;
+            lastEntry[t] = n;
+            do {
+                posting += (char) ((delta & 0x7f) | (delta >= 0x80 ? 0x80 : 0));
+                delta >>= 7;
+            } while (delta);
+        }
+
+        entries.push_back(std::move(entry));
+    }
+
+    std::vector<size_t> lookup(uint32_t trigram) const
+    {
+        std::vector<size_t> res;
+        auto i = postings.find(trigram);
+        if (i == postings.end()) return res;
+        size_t n = 0, delta = 0, shift = 0;
+        for (unsigned char c : i->second) {
+            delta |= (size_t) (c & 0x7f) << shift;
+            shift += 7;
+            if (c & 0x80) continue;
+            n = res.empty() ? delta : n + delta;
+            res.push_back(n);
+            delta = shift = 0;
+        }
+        return res;
+    }
+
+    /* Return the literal strings of which any match of the extended
+       regex `re' must contain one, or nothing if that can't be
+       determined cheaply (i.e. if `re' is not an alternation of
+       literals, optionally anchored). */
+    static std::optional<std::vector<std::string>> requiredLiterals(const std::string & re)
+    {
+        std::vector<std::string> alts(1);
+        for (size_t i = 0; i < re.size(); ++i) {
+            char c = re[i];
+            if (c == '|')
+                alts.emplace_back();
+            else if (c == '\\' && i + 1 < re.size() && !isalnum((unsigned char) re[i + 1]))
+                alts.back() += re[++i];
+            else if (c == '^' && alts.back().empty())
+                continue;
+            else if (c == '$' && (i + 1 == re.size() || re[i + 1] == '|'))
+                continue;
+            else if (strchr(".[]()*+?{}\\^$", c))
+                return {};
+            else
+                alts.back() += c;
+        }
+        return alts;
+    }
+
+    /* Return the numbers of the packages that may match `re', or
+       nothing if any package may match. */
+    std::optional<std::set<size_t>> candidates(const std::string & re) const
+    {
+        auto literals = requiredLiterals(re);
+        if (!literals) return {};
+
+        std::set<size_t> res;
+
+        for (auto & literal : *literals) {
+            if (literal.size() < 3) return {};
+            std::optional<std::vector<size_t>> matches;
+            for (auto t : trigrams(literal)) {
+                auto posting = lookup(t);
+                if (matches) {
+                    std::vector<size_t> both;
+                    std::set_intersection(matches->begin(), matches->end(),
+                        posting.begin(), posting.end(), std::back_inserter(both));
+                    matches = std::move(both);
+                } else
+                    matches = std::move(posting);
+            }
+            res.insert(matches->begin(), matches->end());
+        }
+
+        return res;
+    }
+
+    /* The index belongs to the cache file with the given size and
+       modification time. */
+    static std::string cacheStamp(const Path & cacheFile)
+    {
+        struct stat st;
+        if (stat(cacheFile.c_str(), &st) == -1)
+            throw PosixError("getting status of '%s'", cacheFile);
+        return fmt("%d %d", (uint64_t) st.st_size, (uint64_t) st.st_mtime);
+    }
+
+    void write(const Path & indexFile, const Path & cacheFile) const
+    {
+        StringSink sink;
+        sink << "nix-search-index" << version << cacheStamp(cacheFile) << entries.size();
+        for (auto & e : entries)
+            sink << e.attrPath << e.name << e.description;
+        sink << postings.size();
+        for (auto & p : postings)
+            sink << p.first << p.second;
+        writeFile(indexFile, *sink.s);
+    }
+
+    static std::optional<SearchIndex> read(const Path & indexFile, const Path & cacheFile)
+    {
+        if (!pathExists(indexFile)) return {};
+
+        try {
+            auto contents = readFile(indexFile);
+            StringSource source(contents);
+            if (readString(source) != "nix-search-index"
+                || readNum<uint64_t>(source) != version
+                || readString(source) != cacheStamp(cacheFile))
+                return {};
+
+            SearchIndex index;
+            auto count = readNum<size_t>(source);
+            index.entries.reserve(count);
+            for (size_t n = 0; n < count; ++n) {
+                Entry e;
+                e.attrPath = readString(source);
+                e.name = readString(source);
+                e.description = readString(source);
+                index.entries.push_back(std::move(e));
+            }
+            count = readNum<size_t>(source);
+            for (size_t n = 0; n < count; ++n) {
+                auto t = readNum<uint32_t>(source);
+                index.postings[t] = readString(source);
+            }
+            return index;
+        } catch (Error & e) {
+            debug("ignoring search index '%s': %s", indexFile, e.msg());
+            return {};
+        }
+    }
+};
+
 struct CmdSearch : SourceExprCommand, MixJSON
 {
     std::vector<std::string> res;
@@ -111,7 +302,64 @@ struct CmdSearch : SourceExprCommand, MixJSON
 
         bool fromCache = false;
 
-        std::map<std::string, std::string> results;
+        /* Maps attribute paths to the rank and text of the result.
+           Lower ranks are better. */
+        std::map<std::string, std::pair<unsigned int, std::string>> results;
+
+        SearchIndex newIndex;
+
+        auto matchPackage = [&](const std::string & attrPath, const std::string & fullName, std::string description) {
+            std::smatch attrPathMatch;
+            std::smatch descriptionMatch;
+            std::smatch nameMatch;
+            unsigned int found = 0, rank = 0;
+
+            DrvName parsed(fullName);
+            std::string name = parsed.name;
+
+            std::replace(description.begin(), description.end(), '\n', ' ');
+
+            for (auto &regex : regexes) {
+                std::regex_search(attrPath, attrPathMatch, regex);
+                std::regex_search(name, nameMatch, regex);
+                std::regex_search(description, descriptionMatch, regex);
+
+                if (!attrPathMatch.empty()
+                    || !nameMatch.empty()
+                    || !descriptionMatch.empty())
+                {
+                    found++;
+                }
+
+                /* Rank matches of the whole name first, then matches
+                   at the start of the name, then other matches of the
+                   name or attribute path, then the rest. */
+                rank +=
+                    !nameMatch.empty() && nameMatch.position() == 0 && (size_t) nameMatch.length() == name.size() ? 0 :
+                    !nameMatch.empty() && nameMatch.position() == 0 ? 1 :
+                    !nameMatch.empty() || !attrPathMatch.empty() ? 2 : 3;
+            }
+
+            if (found == res.size()) {
+                if (json) {
+
+                    auto jsonElem = jsonOut->object(attrPath);
+
+                    jsonElem.attr("pkgName", parsed.name);
+                    jsonElem.attr("version", parsed.version);
+                    jsonElem.attr("description", description);
+
+                } else {
+                    auto name2 = hilite(name, nameMatch, "\e[0;2m")
+                        + std::string(parsed.fullName, parsed.name.length());
+                    results[attrPath] = {rank, fmt(
+                        "* %s (%s)\n  %s\n",
+                        wrap("\x1B[0;1m", hilite(attrPath, attrPathMatch, "\x1B[0;1m")),
+                        wrap("\x1B[0;2m", hilite(name2, nameMatch, "\x1B[0;2m")),
+                        hilite(description, descriptionMatch, ANSI_NORMAL))};
+                }
+            }
+        };
 
         std::function<void(Value *, std::string, bool, JSONObject *)> doExpr;
 
@@ -119,8 +367,6 @@ struct CmdSearch : SourceExprCommand, MixJSON
             debug("at attribute '%s'", attrPath);
 
             try {
-                unsigned int found = 0;
-
                 state->forceValue(*v);
 
                 if (v->type == tLambda && toplevel) {
@@ -133,50 +379,15 @@ struct CmdSearch : SourceExprCommand, MixJSON
                 if (state->isDerivation(*v)) {
 
                     DrvInfo drv(*state, attrPath, v->attrs);
-                    std::string description;
-                    std::smatch attrPathMatch;
-                    std::smatch descriptionMatch;
-                    std::smatch nameMatch;
-                    std::string name;
-
-                    DrvName parsed(drv.queryName());
-
-                    for (auto &regex : regexes) {
-                        std::regex_search(attrPath, attrPathMatch, regex);
-
-                        name = parsed.name;
-                        std::regex_search(name, nameMatch, regex);
-
-                        description = drv.queryMetaString("description");
-                        std::replace(description.begin(), description.end(), '\n', ' ');
-                        std::regex_search(description, descriptionMatch, regex);
-
-                        if (!attrPathMatch.empty()
-                            || !nameMatch.empty()
-                            || !descriptionMatch.empty())
-                        {
-                            found++;
-                        }
-                    }
-
-                    if (found == res.size()) {
-                        if (json) {
+                    std::string description = drv.queryMetaString("description");
 
-                            auto jsonElem = jsonOut->object(attrPath);
+                    matchPackage(attrPath, drv.queryName(), description);
 
-                            jsonElem.attr("pkgName", parsed.name);
-                            jsonElem.attr("version", parsed.version);
-                            jsonElem.attr("description", description);
-
-                        } else {
-                            auto name = hilite(parsed.name, nameMatch, "\e[0;2m")
-                                + std::string(parsed.fullName, parsed.name.length());
-                            results[attrPath] = fmt(
-                                "* %s (%s)\n  %s\n",
-                                wrap("\x1B[0;1m", hilite(attrPath, attrPathMatch, "\x1B[0;1m")),
-                                wrap("\x1B[0;2m", hilite(name, nameMatch, "\x1B[0;2m")),
-                                hilite(description, descriptionMatch, ANSI_NORMAL));
-                        }
+                    if (writeCache) {
+                        /* Index the description as it is matched. */
+                        auto indexed = description;
+                        std::replace(indexed.begin(), indexed.end(), '\n', ' ');
+                        newIndex.add({attrPath, drv.queryName(), indexed});
                     }
 
                     if (cache) {
@@ -226,17 +437,50 @@ struct CmdSearch : SourceExprCommand, MixJSON
         };
 
         Path jsonCacheFileName = getCacheDir() + "/nix/package-search.json";
+        Path indexFileName = getCacheDir() + "/nix/package-search.idx";
 
         if (useCache && pathExists(jsonCacheFileName)) {
 
             warn("using cached results; pass '-u' to update the cache");
 
-            Value vRoot;
-            parseJSON(*state, readFile(jsonCacheFileName), vRoot);
+            if (auto index = SearchIndex::read(indexFileName, jsonCacheFileName)) {
+
+                /* Only look at the packages that can match every
+                   regex. */
+                std::optional<std::set<size_t>> candidates;
+                for (auto & re : res) {
+                    auto matches = index->candidates(re);
+                    if (!matches) continue;
+                    if (candidates) {
+                        std::set<size_t> both;
+                        std::set_intersection(candidates->begin(), candidates->end(),
+                            matches->begin(), matches->end(), std::inserter(both, both.end()));
+                        candidates = std::move(both);
+                    } else
+                        candidates = std::move(matches);
+                }
+
+                if (candidates)
+                    for (auto n : *candidates) {
+                        auto & e = index->entries[n];
+                        matchPackage(e.attrPath, e.name, e.description);
+                    }
+                else
+                    for (auto & e : index->entries)
+                        matchPackage(e.attrPath, e.name, e.description);
+            }
+
+            else {
+                Value vRoot;
+                parseJSON(*state, readFile(jsonCacheFileName), vRoot);
+
+                fromCache = true;
 
-            fromCache = true;
+                doExpr(&vRoot, "", true, nullptr);
 
-            doExpr(&vRoot, "", true, nullptr);
+                if (writeCache)
+                    newIndex.write(indexFileName, jsonCacheFileName);
+            }
         }
 
         else {
@@ -275,6 +519,7 @@ struct CmdSearch : SourceExprCommand, MixJSON
                 if (!MoveFileExW(pathW(tmpFile).c_str(), pathW(jsonCacheFileName).c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
                     throw WinError("MoveFileExW '%1%' '%2%'", tmpFile, jsonCacheFileName);
 #endif
+                newIndex.write(indexFileName, jsonCacheFileName);
             }
         }
 
@@ -283,7 +528,12 @@ struct CmdSearch : SourceExprCommand, MixJSON
 #ifndef _WIN32
         RunPager pager;
 #endif
-        for (auto el : results) std::cout << el.second << "\n";
+        std::vector<std::pair<unsigned int, std::string>> ranked;
+        for (auto & el : results) ranked.push_back({el.second.first, el.first});
+        std::stable_sort(ranked.begin(), ranked.end(),
+            [](auto & a, auto & b) { return a.first < b.first; });
+
+        for (auto & el : ranked) std::cout << results[el.second].second << "\n";
 
     }
 };
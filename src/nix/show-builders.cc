@@ -0,0 +1,85 @@
+#include "command.hh"
+#include "common-args.hh"
+#include "shared.hh"
+#include "globals.hh"
+#include "machines.hh"
+#include "store-api.hh"
+#include "json.hh"
+
+using namespace nix;
+
+struct CmdShowBuilders : StoreCommand, MixJSON
+{
+    std::string name() override
+    {
+        return "show-builders";
+    }
+
+    std::string description() override
+    {
+        return "show the state of the remote builders";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To show how busy the remote builders are and what has been measured of them:",
+                "nix show-builders"
+            },
+        };
+    }
+
+    void run(ref<Store> store) override
+    {
+        /* The build hook keeps its state in the state directory of the
+           store that builds, which is the default one for a store
+           accessed through the daemon. */
+        auto store2 = store.dynamic_pointer_cast<LocalFSStore>();
+        auto currentLoad = (store2 ? (Path) store2->stateDir : settings.nixStateDir) + "/current-load";
+        bool haveLoad = pathExists(currentLoad);
+
+        std::unique_ptr<JSONList> jsonList;
+        if (json) jsonList = std::make_unique<JSONList>(std::cout);
+
+        for (auto & m : getMachines()) {
+            auto busy = haveLoad ? countBusySlots(currentLoad, m) : 0;
+            auto stats = haveLoad ? readMachineStats(currentLoad, m) : MachineStats();
+            auto expected = stats.estimateCompletionTime(m, busy, 0);
+
+            if (json) {
+                auto obj = jsonList->object();
+                obj.attr("uri", m.storeUri);
+                {
+                    auto systems = obj.list("systems");
+                    for (auto & s : m.systemTypes) systems.elem(s);
+                }
+                obj.attr("enabled", m.enabled);
+                obj.attr("maxJobs", m.maxJobs);
+                obj.attr("speedFactor", m.speedFactor);
+                obj.attr("busySlots", busy);
+                obj.attr("builds", stats.builds);
+                obj.attr("buildTime", stats.buildTime);
+                obj.attr("bytesCopied", stats.bytesCopied);
+                obj.attr("bandwidth", stats.bandwidth);
+                obj.attr("bytesAvoided", stats.bytesAvoided);
+                obj.attr("expectedBuildTime", expected);
+            } else {
+                std::cout << m.storeUri << "\n";
+                std::cout << fmt("  systems:        %s\n", concatStringsSep(",", Strings(m.systemTypes.begin(), m.systemTypes.end())));
+                std::cout << fmt("  slots in use:   %d/%d\n", busy, m.maxJobs);
+                std::cout << fmt("  speed factor:   %d\n", m.speedFactor);
+                std::cout << fmt("  builds:         %d\n", stats.builds);
+                if (stats.builds)
+                    std::cout << fmt("  build time:     %.1f s (average)\n", stats.buildTime);
+                if (stats.bandwidth > 0)
+                    std::cout << fmt("  bandwidth:      %.1f MiB/s\n", stats.bandwidth / (1024 * 1024));
+                std::cout << fmt("  copied:         %.1f MiB (%.1f MiB already present)\n",
+                    stats.bytesCopied / (1024.0 * 1024.0), stats.bytesAvoided / (1024.0 * 1024.0));
+                std::cout << fmt("  next build:     %.1f s (expected, excluding copying)\n", expected);
+            }
+        }
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdShowBuilders>());
@@ -110,8 +110,10 @@ struct CmdWhyDepends : SourceExprCommand
 
         std::map<Path, Node> graph;
 
-        for (auto & path : closure)
-            graph.emplace(path, Node{path, store->queryPathInfo(path)->references});
+        /* Query the closure at once, so that a remote store can
+           answer in a single round trip. */
+        for (auto & i : store->queryPathInfos(closure))
+            graph.emplace(i.first, Node{i.first, i.second->references});
 
         // Transpose the graph.
         for (auto & node : graph)
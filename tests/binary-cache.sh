@@ -16,6 +16,16 @@ outPath=$(nix-build dependencies.nix --no-out-link)
 
 nix copy --to file://$cacheDir $outPath
 
+# A budget smaller than any path makes paths go one at a time.
+cacheDir2=$TEST_ROOT/binary-cache-2
+rm -rf $cacheDir2
+nix copy --option copy-bytes-in-flight 1 --to file://$cacheDir2 $outPath -vvvv 2>&1 \
+    | grep -o '([0-9]* paths and [0-9]* bytes in flight)' > $TEST_ROOT/in-flight
+[ "$(sort -u $TEST_ROOT/in-flight)" = "(1 paths and 1 bytes in flight)" ]
+[ "$(wc -l < $TEST_ROOT/in-flight)" = "$(ls $cacheDir/*.narinfo | wc -l)" ]
+[ "$(ls $cacheDir2/*.narinfo | wc -l)" = "$(ls $cacheDir/*.narinfo | wc -l)" ]
+rm -rf $cacheDir2
+
 
 basicTests() {
 
@@ -26,3 +26,8 @@ cat $outPath/foobar | grep FOOBAR
 p=$(readlink -f $outPath/input-2)
 (! nix path-info --store $TEST_ROOT/store0 --all | grep dependencies.builder1.sh)
 nix path-info --store $TEST_ROOT/store1 --all | grep dependencies.builder1.sh
+
+# The build hook records statistics about the builders it used.
+nix show-builders --json \
+  --builders "$TEST_ROOT/store0; $TEST_ROOT/store1 - - 1 1 foo" \
+  | grep -q '"builds":[1-9]'
@@ -50,3 +50,14 @@ nix-collect-garbage
 
 # Check that the output has been GC'd.
 if test -e $outPath/foobar; then false; fi
+
+# Root discovery reuses what it read in earlier runs from directories
+# that haven't changed since, but must notice roots that were removed.
+outPath=$(nix-build dependencies.nix -o $TEST_ROOT/indirect)
+sleep 1
+nix-store --gc --print-roots | grep $outPath
+test -e "$NIX_STATE_DIR"/gc-roots-cache
+nix-store --gc --print-roots | grep $outPath
+rm $TEST_ROOT/indirect
+nix-collect-garbage
+if test -e $outPath/foobar; then false; fi
@@ -0,0 +1,4 @@
+# Lists can't be compared, so a second list key is an error even if it
+# is the same value.
+let k = [ 1 ]; in
+builtins.genericClosure { startSet = [ { key = k; } ]; operator = _: [ { key = k; } ]; }
@@ -0,0 +1 @@
+builtins.range (-9223372036854775807 - 1) 9223372036854775807
@@ -0,0 +1,18 @@
+let
+
+  strings = builtins.genericClosure {
+    startSet = [ { key = "a"; } ];
+    operator = { key }:
+      if builtins.stringLength key < 3
+      then [ { key = key + "a"; } { key = key + "b"; } { key = "a"; } ]
+      else [];
+  };
+
+  # Integers and floats with the same value are the same key.
+  numbers = builtins.genericClosure {
+    startSet = [ { key = 1; } ];
+    operator = { key }:
+      if key < 3 then [ { key = key + 1.0; } { key = key + 1; } ] else [];
+  };
+
+in [ (map (x: x.key) strings) (builtins.length numbers) ]
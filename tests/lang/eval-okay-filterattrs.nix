@@ -0,0 +1,6 @@
+let set = { foo = 1; bar = 2; baz = 3; qux = 4; }; in
+
+[ (builtins.filterAttrs (name: value: value / 2 * 2 == value) set)
+  (builtins.filterAttrs (name: value: builtins.hasPrefix "ba" name) set)
+  (builtins.mapAttrsToList (name: value: name + "=" + toString value) set)
+]
@@ -0,0 +1 @@
+builtins.groupBy (n: if n / 3 * 3 == n then "fizz" else if n / 2 * 2 == n then "even" else "odd") (builtins.range 0 10)
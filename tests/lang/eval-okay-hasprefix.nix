@@ -0,0 +1,8 @@
+[ (builtins.hasPrefix "foo" "foobar")
+  (builtins.hasPrefix "bar" "foobar")
+  (builtins.hasPrefix "" "foobar")
+  (builtins.hasPrefix "foobarbaz" "foobar")
+  (builtins.hasSuffix "bar" "foobar")
+  (builtins.hasSuffix "foo" "foobar")
+  (builtins.hasSuffix "" "")
+]
@@ -0,0 +1,4 @@
+[ (builtins.range 3 7)
+  (builtins.range 7 3)
+  (builtins.range (-2) (-2))
+]
@@ -11,14 +11,34 @@ remoteRoot=$TEST_ROOT/store2
 chmod -R u+w "$remoteRoot" || true
 rm -rf "$remoteRoot"
 
+remoteStore="ssh://localhost?store=$NIX_STORE_DIR&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR"
+
 outPath=$(nix-build --no-out-link dependencies.nix)
 
-nix copy --to "ssh://localhost?store=$NIX_STORE_DIR&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR" $outPath
+nix copy --to "$remoteStore" $outPath
+
+[ -f $remoteRoot$outPath/foobar ]
+
+# The whole closure should have arrived with its hashes intact.
+[ "$(nix path-info --store "$remoteStore" --json -r $outPath | grep -o '"\(path\|narHash\)":"[^"]*"')" \
+  = "$(nix path-info --json -r $outPath | grep -o '"\(path\|narHash\)":"[^"]*"')" ]
+
+clearStore
+
+nix copy --no-check-sigs --from "$remoteStore" $outPath
+
+[ -f $outPath/foobar ]
+
+# Same, with the NARs compressed by the serve protocol.
+chmod -R u+w "$remoteRoot"
+rm -rf "$remoteRoot"
+
+nix copy --to "$remoteStore&transport-compression=xz" $outPath
 
 [ -f $remoteRoot$outPath/foobar ]
 
 clearStore
 
-nix copy --no-check-sigs --from "ssh://localhost?store=$NIX_STORE_DIR&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR" $outPath
+nix copy --no-check-sigs --from "$remoteStore&transport-compression=bzip2" $outPath
 
 [ -f $outPath/foobar ]
@@ -2,7 +2,7 @@ source common.sh
 
 clearStore
 
-max=500
+max=1100
 
 if [[ "$(uname)" =~ ^MINGW|^MSYS ]]; then
     reference=$(cygpath -m "$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa")
@@ -13,6 +13,10 @@ fi
 touch $reference
 (echo $reference && echo && echo 0) | nix-store --register-validity 
 
+# Small queries don't take a snapshot of the reference graph.
+test "$(nix-store -q --referrers-closure $reference | wc -l)" -eq 1
+test ! -e "$NIX_STATE_DIR"/db/reference-graph
+
 echo "making registration..."
 
 set +x
@@ -39,9 +43,35 @@ echo "registering..."
 
 nix-store --register-validity < $TEST_ROOT/reg_info
 
+# A query that visits most of the store takes a snapshot.
+test "$(nix-store -q --referrers-closure $reference | wc -l)" -eq $((max + 1))
+test -e "$NIX_STATE_DIR"/db/reference-graph
+test "$(nix-store -qR $NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-0 | wc -l)" -eq $((max + 1))
+
+# A corrupt snapshot is ignored and rebuilt.
+printf '\xff\xff\xff\xff\xff\xff\xff\xff' | dd of="$NIX_STATE_DIR"/db/reference-graph bs=1 seek=48 conv=notrunc
+nix-store -q --referrers-closure $reference 2>&1 >/dev/null | grep -q "ignoring reference graph"
+(! nix-store -q --referrers-closure $reference 2>&1 >/dev/null | grep -q "ignoring reference graph")
+
+# Paths registered after the snapshot was taken must be included.
+if [[ "$(uname)" =~ ^MINGW|^MSYS ]]; then
+    extra=$(cygpath -m "$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-extra")
+else
+    extra=$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-extra
+fi
+touch $extra
+(echo $extra && echo && echo 1 && echo $reference) | nix-store --register-validity
+test "$(nix-store -q --referrers-closure $reference | wc -l)" -eq $((max + 2))
+
 echo "collecting garbage..."
 ln -sfn $reference "$NIX_STATE_DIR"/gcroots/ref
-nix-store --gc
+nix-store --gc -vvvvv 2> $TEST_ROOT/gc.log
+
+# The collector rebuilds the snapshot it made stale.
+grep -q "created reference graph" $TEST_ROOT/gc.log
+
+# Deleted paths must be dropped.
+test "$(nix-store -q --referrers-closure $reference | wc -l)" -eq 1
 
 if [ -n "$(type -p sqlite3)" -a "$(sqlite3 $NIX_STATE_DIR/db/db.sqlite 'select count(*) from Refs')" -ne 0 ]; then
     echo "referrers not cleaned up"
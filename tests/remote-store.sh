@@ -14,10 +14,47 @@ nix-store --dump-db > $TEST_ROOT/d1
 NIX_REMOTE= nix-store --dump-db > $TEST_ROOT/d2
 cmp $TEST_ROOT/d1 $TEST_ROOT/d2
 
+# Closure queries must give the same answer with and without a
+# multiplexed daemon connection.
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix path-info -r --store "daemon?multiplex=true" $outPath | sort > $TEST_ROOT/q1
+nix path-info -r --store "daemon?multiplex=false" $outPath | sort > $TEST_ROOT/q2
+cmp $TEST_ROOT/q1 $TEST_ROOT/q2
+[ "$(wc -l < $TEST_ROOT/q1)" -gt 1 ]
+
+# The bulk query operations must agree with the local store.
+for q in --requisites --referrers --referrers-closure --references; do
+    nix-store -q $q $outPath | sort > $TEST_ROOT/q3
+    NIX_REMOTE= nix-store -q $q $outPath | sort > $TEST_ROOT/q4
+    cmp $TEST_ROOT/q3 $TEST_ROOT/q4
+done
+
 nix-store --gc --max-freed 1K
 
 killDaemon
 
+# A threaded daemon must give the same answers, also to concurrent
+# clients.
+startDaemon --option daemon-threaded true
+outPath=$(nix-build dependencies.nix --no-out-link)
+for i in 1 2 3 4; do
+    nix-store -qR $outPath | sort > $TEST_ROOT/t$i &
+done
+wait
+for i in 1 2 3 4; do
+    NIX_REMOTE= nix-store -qR $outPath | sort | cmp - $TEST_ROOT/t$i
+done
+
+# The temporary roots of a connection go away with the connection.
+echo $RANDOM > $TEST_ROOT/temp-root
+nix-store --add $TEST_ROOT/temp-root
+for i in $(seq 1 10); do
+    ls $NIX_STATE_DIR/temproots | grep -q -- - || break
+    sleep 1
+done
+(! ls $NIX_STATE_DIR/temproots | grep -- -)
+killDaemon
+
 user=$(whoami)
 [ -e $NIX_STATE_DIR/gcroots/per-user/$user ]
 [ -e $NIX_STATE_DIR/profiles/per-user/$user ]
@@ -22,4 +22,9 @@ with import ./config.nix;
     '';
     meta.description = "broken bar";
   };
+  multi = mkDerivation rec {
+    name = "multi-1";
+    buildCommand = "touch $out";
+    meta.description = "first line\nsecond line";
+  };
 }
@@ -41,3 +41,14 @@ clearCache
 nix search|grep -q foo
 nix search|grep -q bar
 nix search|grep -q hello
+
+# The search index gives the same results as looking at every package.
+searchAttrs() {
+    nix search --json "$@" | grep -o '"[a-z]*":{"pkgName"' | cut -d '"' -f 2 | sort | tr '\n' ' '
+}
+[[ -e $TEST_HOME/.cache/nix/package-search.idx ]]
+[[ $(searchAttrs 'hel|foo') = "foo hello " ]]
+[[ $(searchAttrs 'hel|fo[o]') = "foo hello " ]]
+[[ $(searchAttrs '^hello$') = "hello " ]]
+[[ $(searchAttrs 'line second') = "multi " ]]
+[[ $(searchAttrs 'line sec[o]nd') = "multi " ]]
@@ -118,6 +118,25 @@ nix-env -i foo
 nix-env --list-generations
 test "$(nix-env --list-generations | wc -l)" -eq 8
 
+# The generations are recorded in the profile's generation index, which
+# notices generation links removed behind its back.
+grep -q "^8	" $profiles/.generations/test
+rm $profiles/test-3-link
+test "$(nix-env --list-generations | wc -l)" -eq 7
+(! grep -q "^3	" $profiles/.generations/test)
+
+# It also notices generation links replaced behind its back.
+target2=$(readlink $profiles/test-2-link)
+ln -sfn $target2 $profiles/test-4-link
+nix-env --list-generations
+grep -q "^4	.*	$target2\$" $profiles/.generations/test
+
+# Once the profile directory has settled, the index records its status,
+# so that later listings don't have to look at every generation link.
+sleep 1
+nix-env --list-generations
+[ "$(head -n 1 $profiles/.generations/test | cut -f 4)" != 0 ]
+
 # Switch to a specified generation.
 nix-env --switch-generation 7
 [ "$(nix-store -q --resolve $profiles/test)" = "$oldGen" ]
@@ -183,3 +202,29 @@ nix-env --set $outPath10
 [ "$(nix-store -q --resolve $profiles/test)" = $outPath10 ]
 nix-env --set $drvPath10
 [ "$(nix-store -q --resolve $profiles/test)" = $outPath10 ]
+
+# Test that the package index used by 'nix-env -qa' is refreshed when
+# the expression changes.
+cat > $TEST_ROOT/index.nix <<EOF2
+[ { type = "derivation"; name = "indexed-1.0"; system = "$system"; outPath = "/foo"; } ]
+EOF2
+nix-env -f $TEST_ROOT/index.nix -qa | grep -q indexed-1.0
+[ -n "$(ls $TEST_HOME/.cache/nix/package-index)" ]
+nix-env -f $TEST_ROOT/index.nix -qa | grep -q indexed-1.0
+sed -i 's/indexed-1.0/indexed-2.0/' $TEST_ROOT/index.nix
+nix-env -f $TEST_ROOT/index.nix -qa | grep -q indexed-2.0
+
+# Evaluations that use the current time are not indexed.
+rm -rf $TEST_HOME/.cache/nix/package-index
+cat > $TEST_ROOT/index.nix <<EOF2
+[ { type = "derivation"; name = "indexed-\${toString builtins.currentTime}"; system = "$system"; outPath = "/foo"; } ]
+EOF2
+nix-env -f $TEST_ROOT/index.nix -qa | grep -q indexed-
+[ -z "$(ls $TEST_HOME/.cache/nix/package-index)" ]
+
+# Neither are evaluations that only use it in an indexed meta attribute.
+cat > $TEST_ROOT/index.nix <<EOF2
+[ { type = "derivation"; name = "indexed-1.0"; system = "$system"; outPath = "/foo"; meta.description = "built at \${toString builtins.currentTime}"; } ]
+EOF2
+nix-env -f $TEST_ROOT/index.nix -qa | grep -q indexed-1.0
+[ -z "$(ls $TEST_HOME/.cache/nix/package-index)" ]